@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+//! Breakpoints by id. Each enabled one in flash holds an FPB code
+//! comparator, taken when it is set or enabled and given back when it is
+//! disabled or deleted. One in code running from SRAM is a software
+//! breakpoint instead: a BKPT instruction patched over the original, which
+//! the table keeps. Controlled with the bkpt command.
+
+//! Size of the breakpoint table, enabled or not. Only the FPB limits the
+//! breakpoints in flash, the table those in SRAM.
+#ifndef BKPT_MAX
+#define BKPT_MAX (16)
+#endif
+
+//! Who set a breakpoint. Only the owner changes or deletes it.
+typedef enum {
+  //! the bkpt command, stops in the monitor
+  kBkptOwner_User,
+  //! a tracepoint, see trace.h
+  kBkptOwner_Trace,
+} eBkptOwner;
+
+typedef struct {
+  uint32_t addr;
+  eBkptOwner owner;
+  bool enabled;
+  //! Patched into RAM code rather than on the FPB
+  bool soft;
+  uint32_t hits;
+} sBkptInfo;
+
+//! Returns the id of the breakpoint at addr, the one already there if
+//! there is one, enabling it. -1 if the table or the FPB is full, addr
+//! isn't code, or another owner has a breakpoint there.
+int bkpt_set(uint32_t addr, eBkptOwner owner);
+bool bkpt_enable(int id, bool enable);
+bool bkpt_delete(int id);
+//! Deletes the breakpoints of owner
+void bkpt_delete_all(eBkptOwner owner);
+bool bkpt_get(int id, sBkptInfo *info);
+//! The id of the breakpoint at addr, or -1
+int bkpt_find(uint32_t addr);
+
+//! From the debug monitor: the id of the breakpoint at pc, counting the
+//! hit, or -1 if there is none
+int bkpt_hit(uint32_t pc);
+
+//! From the debug monitor: puts the original instruction back if pc is on
+//! a software breakpoint, for a single step over it. Returns false if it
+//! isn't one.
+bool bkpt_step_begin(uint32_t pc);
+//! Once the step is done, patches the BKPT back in
+void bkpt_step_done(void);
@@ -4,10 +4,11 @@
 #include <stdlib.h>
 #include <stddef.h>
 #include <stdbool.h>
-#include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdarg.h>
 #include "main.h"
+#include "mux.h"
 
 //! Prints a line then a newline
 void shell_put_line(const char *str);
@@ -16,4 +17,72 @@ bool shell_getchar(char *c_out);
 
 int shell_putc(char c);
 
+//! Set by the shell while a command runs, logp() from thread mode then goes
+//! to the shell channel instead of the log channel
+void console_set_command_active(bool active);
+//! Channel logp() from the current context writes to
+eMuxChannel console_log_channel(void);
+
+#ifndef LOG_DEFERRED
+#define LOG_DEFERRED (0)
+#endif
+
+#if LOG_DEFERRED
+
+// Deferred logging: the format string is placed in the non-loaded .log_fmt
+// section and only its offset there plus the raw arguments go out, as a
+// kDbgProtoEvt_Log frame. tools/logdecode.py turns them back into text using
+// the ELF. Arguments are sent as 32-bit words. A char * the ELF doesn't hold,
+// e.g. one from argv, is copied into the frame after the words instead, as
+// far as it fits. 64-bit and floating point arguments aren't supported.
+
+#define LOG_DEFERRED_MAX_ARGS (8)
+//! The word of a string copied into the frame, the low 16 bits are its
+//! offset in the payload
+#define LOG_DEFERRED_STR_INLINE (0xFFFF0000u)
+
+#define logp(_fmt, ...) \
+  do { \
+    static const char _log_fmt[] __attribute__((section(".log_fmt"), used)) = _fmt; \
+    const uint32_t _log_args[] = { 0, LOG_WORDS(__VA_ARGS__) }; \
+    log_deferred(_log_fmt, &_log_args[1], LOG_NARGS(__VA_ARGS__), LOG_STRS(__VA_ARGS__)); \
+  } while (0)
+
+//! strs has bit n set if args[n] is a char *
+void log_deferred(const char *fmt, const uint32_t *args, size_t nargs, uint32_t strs);
+
+#define LOG_NARGS(...) LOG_NARGS_(0, ##__VA_ARGS__, 8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define LOG_NARGS_(_0, _1, _2, _3, _4, _5, _6, _7, _8, _n, ...) _n
+
+#define LOG_CAT(_a, _b) LOG_CAT_(_a, _b)
+#define LOG_CAT_(_a, _b) _a##_b
+
+#define LOG_WORD(_a) ((uint32_t)(uintptr_t)(_a))
+#define LOG_WORDS(...) LOG_CAT(LOG_WORDS_, LOG_NARGS(__VA_ARGS__))(__VA_ARGS__)
+#define LOG_WORDS_0()
+#define LOG_WORDS_1(_a) LOG_WORD(_a)
+#define LOG_WORDS_2(_a, ...) LOG_WORD(_a), LOG_WORDS_1(__VA_ARGS__)
+#define LOG_WORDS_3(_a, ...) LOG_WORD(_a), LOG_WORDS_2(__VA_ARGS__)
+#define LOG_WORDS_4(_a, ...) LOG_WORD(_a), LOG_WORDS_3(__VA_ARGS__)
+#define LOG_WORDS_5(_a, ...) LOG_WORD(_a), LOG_WORDS_4(__VA_ARGS__)
+#define LOG_WORDS_6(_a, ...) LOG_WORD(_a), LOG_WORDS_5(__VA_ARGS__)
+#define LOG_WORDS_7(_a, ...) LOG_WORD(_a), LOG_WORDS_6(__VA_ARGS__)
+#define LOG_WORDS_8(_a, ...) LOG_WORD(_a), LOG_WORDS_7(__VA_ARGS__)
+
+#define LOG_IS_STR(_a) _Generic((_a), char *: 1u, const char *: 1u, default: 0u)
+#define LOG_STRS(...) LOG_CAT(LOG_STRS_, LOG_NARGS(__VA_ARGS__))(__VA_ARGS__)
+#define LOG_STRS_0() 0u
+#define LOG_STRS_1(_a) LOG_IS_STR(_a)
+#define LOG_STRS_2(_a, ...) (LOG_IS_STR(_a) | LOG_STRS_1(__VA_ARGS__) << 1)
+#define LOG_STRS_3(_a, ...) (LOG_IS_STR(_a) | LOG_STRS_2(__VA_ARGS__) << 1)
+#define LOG_STRS_4(_a, ...) (LOG_IS_STR(_a) | LOG_STRS_3(__VA_ARGS__) << 1)
+#define LOG_STRS_5(_a, ...) (LOG_IS_STR(_a) | LOG_STRS_4(__VA_ARGS__) << 1)
+#define LOG_STRS_6(_a, ...) (LOG_IS_STR(_a) | LOG_STRS_5(__VA_ARGS__) << 1)
+#define LOG_STRS_7(_a, ...) (LOG_IS_STR(_a) | LOG_STRS_6(__VA_ARGS__) << 1)
+#define LOG_STRS_8(_a, ...) (LOG_IS_STR(_a) | LOG_STRS_7(__VA_ARGS__) << 1)
+
+#else
+
 void logp(const char *fmt, ...);
+
+#endif /* LOG_DEFERRED */
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+//! Core debug registers on the private peripheral bus. The debugger only
+//! touches them through core_reg_read() / core_reg_write() so that the host
+//! build (make host) and the QEMU build (make qemu) can simulate them.
+
+#define CORE_REG_SHPR3 (0xE000ED20)
+#define CORE_REG_DFSR (0xE000ED30)
+#define CORE_REG_DHCSR (0xE000EDF0)
+#define CORE_REG_DEMCR (0xE000EDFC)
+
+#define CORE_REG_DWT_CTRL (0xE0001000)
+#define CORE_REG_DWT_CYCCNT (0xE0001004)
+#define CORE_REG_DWT_COMP(_n) (0xE0001020 + 0x10 * (_n))
+#define CORE_REG_DWT_MASK(_n) (0xE0001024 + 0x10 * (_n))
+#define CORE_REG_DWT_FUNCTION(_n) (0xE0001028 + 0x10 * (_n))
+
+#define CORE_REG_FP_CTRL (0xE0002000)
+#define CORE_REG_FP_REMAP (0xE0002004)
+#define CORE_REG_FP_COMP(_n) (0xE0002008 + 4 * (_n))
+
+#define CORE_REG_DFSR_HALTED (1u << 0)
+#define CORE_REG_DFSR_BKPT (1u << 1)
+#define CORE_REG_DFSR_DWTTRAP (1u << 2)
+
+#define CORE_REG_DWT_CTRL_NUMCOMP_SHIFT (28)
+#define CORE_REG_DWT_FUNCTION_DATAVMATCH (1u << 8)
+//! Set by a match, cleared by reading DWT_FUNCTION
+#define CORE_REG_DWT_FUNCTION_MATCHED (1u << 24)
+
+#define CORE_REG_DEMCR_MON_EN (1u << 16)
+#define CORE_REG_DEMCR_MON_STEP (1u << 18)
+#define CORE_REG_DEMCR_TRCENA (1u << 24)
+
+//! Private peripheral bus, where every core register lives
+static inline bool core_reg_is_ppb(uint32_t addr)
+{
+  return addr >= 0xE0000000 && addr < 0xE0100000;
+}
+
+#ifndef HOST_BUILD
+#define HOST_BUILD (0)
+#endif
+
+#ifndef QEMU_BUILD
+#define QEMU_BUILD (0)
+#endif
+
+#if HOST_BUILD || QEMU_BUILD
+
+//! Routed by Host/Src/host_regs.c or Qemu/Src/qemu_regs.c, the debug
+//! registers to the simulation in Host/Src/sim_regs.c
+uint32_t core_reg_read(uint32_t addr);
+void core_reg_write(uint32_t addr, uint32_t value);
+
+#else
+
+static inline uint32_t core_reg_read(uint32_t addr)
+{
+  return *(volatile uint32_t *)addr;
+}
+
+static inline void core_reg_write(uint32_t addr, uint32_t value)
+{
+  *(volatile uint32_t *)addr = value;
+}
+
+#endif /* HOST_BUILD || QEMU_BUILD */
+
+//! Read-modify-write, not atomic
+static inline void core_reg_modify(uint32_t addr, uint32_t clear, uint32_t set)
+{
+  core_reg_write(addr, (core_reg_read(addr) & ~clear) | set);
+}
@@ -11,13 +11,6 @@ typedef struct {
   size_t num_literal_comparators;
 } sFpbConfig;
 
-typedef struct {
-  volatile uint32_t FP_CTRL;
-  volatile uint32_t FP_REMAP;
-  // Number Implemented determined by FP_CTRL
-  volatile uint32_t FP_COMP[];
-} sFpbUnit;
-
 typedef struct __attribute__((packed)) ContextStateFrame {
   uint32_t r0;
   uint32_t r1;
@@ -29,6 +22,59 @@ typedef struct __attribute__((packed)) ContextStateFrame {
   uint32_t xpsr;
 } sContextStateFrame;
 
+//! Everything DebugMon_Handler saves on entry, besides what the core stacks,
+//! and puts back on exit. Laid out for its single store multiple, the
+//! order is fixed in stm32f1xx_it.c.
+typedef struct __attribute__((aligned(32))) DebugContext {
+  uint32_t r4_r11[8];
+  uint32_t primask;
+  uint32_t basepri;
+  uint32_t control;
+  uint32_t exc_return;
+  //! Filled in by debug_monitor_handler_c()
+  uint32_t sp;
+  sContextStateFrame *frame;
+} sDebugContext;
+
+//! Only valid while debug_monitor_handler_c() runs
+extern sDebugContext g_debug_context;
+
+//! The registers of the code the debug monitor stopped, in debug_reg_read()
+//! and debug_reg_write() order
+typedef enum {
+  kDebugReg_R0,
+  kDebugReg_R1,
+  kDebugReg_R2,
+  kDebugReg_R3,
+  kDebugReg_R4,
+  kDebugReg_R5,
+  kDebugReg_R6,
+  kDebugReg_R7,
+  kDebugReg_R8,
+  kDebugReg_R9,
+  kDebugReg_R10,
+  kDebugReg_R11,
+  kDebugReg_R12,
+  kDebugReg_Sp,
+  kDebugReg_Lr,
+  kDebugReg_Pc,
+  kDebugReg_Xpsr,
+  kDebugReg_Primask,
+  kDebugReg_Basepri,
+  kDebugReg_Control,
+  kDebugReg_ExcReturn,
+
+  kDebugReg_Count,
+} eDebugReg;
+
+const char *debug_reg_name(eDebugReg reg);
+//! Accepts the names debug_reg_name() gives, case sensitive
+bool debug_reg_lookup(const char *name, eDebugReg *reg);
+uint32_t debug_reg_read(eDebugReg reg);
+//! Returns false for sp and exc_return, which can't move without the
+//! stacked frame moving too. Takes effect when the monitor returns.
+bool debug_reg_write(eDebugReg reg, uint32_t value);
+
 typedef enum {
   kDebugState_None,
   kDebugState_SingleStep,
@@ -47,12 +93,17 @@ typedef struct {
 
 bool fpb_get_comp_config(size_t comp_id, sFpbCompConfig *config);
 bool fpb_set_breakpoint(size_t comp_id, uint32_t addr);
+bool fpb_clear_breakpoint(size_t comp_id);
 bool fpb_remap_function(size_t comp_id, uint32_t orig_instr_addr,
                         uint32_t new_instr_addr);
 
 void fpb_enable(void);
 void fpb_disable(void);
 
+//! Starts the DWT cycle counter (CYCCNT), leaving it running if it already is
+void dwt_cyccnt_enable(void);
+uint32_t dwt_cyccnt_read(void);
+
 bool debug_monitor_enable(void);
 bool debug_monitor_disable(void);
 void debug_monitor_handler_c(sContextStateFrame *frame);
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+//! Binary debug channel sharing the UART with the text shell.
+//!
+//! Every frame is sent as 0x00 COBS(packet) 0x00. The text shell never sees a
+//! NUL from a terminal, so the leading delimiter is what switches the receive
+//! path over to the binary channel for one frame.
+//!
+//! Packet layout (little endian):
+//!   request:  seq(1) cmd(1) payload(n) crc16(2)
+//!   response: seq(1) cmd|0x80(1) status(1) payload(n) crc16(2)
+//! The CRC is CRC-16/CCITT-FALSE over everything before it.
+
+#define DBG_PROTO_VERSION (1)
+//! Largest payload carried in a single frame
+#define DBG_PROTO_MAX_PAYLOAD (256)
+#define DBG_PROTO_RESPONSE_FLAG (0x80)
+
+typedef enum {
+  kDbgProtoCmd_Ping = 0x01,
+  //! addr(4) len(2) -> data, whole words from the PPB
+  kDbgProtoCmd_MemRead = 0x02,
+  //! addr(4) data(n), SRAM and peripherals, or whole words into the PPB
+  kDbgProtoCmd_MemWrite = 0x03,
+  //! addr(4) -> value(4), single 32-bit access
+  kDbgProtoCmd_RegRead = 0x04,
+  //! addr(4) value(4), single 32-bit access
+  kDbgProtoCmd_RegWrite = 0x05,
+  //! comp_id(1) addr(4)
+  kDbgProtoCmd_BkptSet = 0x06,
+  //! comp_id(1)
+  kDbgProtoCmd_BkptClear = 0x07,
+  //! addr(4) len(4) -> offset(4) data(n) per frame, then an empty kOk frame.
+  //! Whole words from the PPB, as MemRead.
+  //! Fails while another stream runs, len 0 cancels the running one.
+  kDbgProtoCmd_MemStream = 0x08,
+  //! baud(4), 0 for the fastest rate -> baud(4) timeout_ms(4)
+  //! Fails outside uart_get_min_baud() to uart_get_max_baud().
+  //! The response goes out at the old rate. The target then switches and
+  //! keeps the new rate only if a valid Ping arrives within timeout_ms.
+  kDbgProtoCmd_SetBaud = 0x09,
+} eDbgProtoCmd;
+
+//! Frames the target sends on its own. They look like responses with a
+//! sequence number of 0.
+typedef enum {
+  //! fmt_id(2) args(4 * n) strings, see LOG_DEFERRED in console.h
+  kDbgProtoEvt_Log = 0x40,
+  //! one CBOR map, see record.h
+  kDbgProtoEvt_Record = 0x41,
+} eDbgProtoEvt;
+
+//! Largest payload dbg_proto_send_event() carries
+#define DBG_PROTO_MAX_EVENT_PAYLOAD (64)
+
+typedef enum {
+  kDbgProtoStatus_Ok = 0,
+  //! More response frames follow for this request
+  kDbgProtoStatus_More = 1,
+  kDbgProtoStatus_BadCrc = 2,
+  kDbgProtoStatus_BadLength = 3,
+  kDbgProtoStatus_BadAddress = 4,
+  kDbgProtoStatus_UnknownCmd = 5,
+  kDbgProtoStatus_Failed = 6,
+} eDbgProtoStatus;
+
+//! Registers the task that sends memory streams, call before the scheduler runs
+void dbg_proto_init(void);
+
+//! Feed a received byte. Returns true if the byte belongs to the binary
+//! channel, false if it should go to the text shell.
+bool dbg_proto_receive_char(uint8_t c);
+
+//! Send a response frame
+void dbg_proto_send(uint8_t seq, uint8_t cmd, eDbgProtoStatus status,
+                    const void *payload, size_t len);
+
+//! Send an unsolicited frame. Unlike dbg_proto_send() this is safe to call from
+//! any context, the frame is built on the stack.
+void dbg_proto_send_event(eDbgProtoEvt evt, const void *payload, size_t len);
+//! Like dbg_proto_send_event() for up to DBG_PROTO_MAX_PAYLOAD bytes, thread
+//! mode only as it shares the response buffers
+void dbg_proto_send_event_large(eDbgProtoEvt evt, const void *payload, size_t len);
+
+uint16_t dbg_proto_crc16(uint16_t crc, const void *data, size_t len);
+//! COBS encode len bytes from in to out, which must hold len + len/254 + 1
+//! bytes. Returns the encoded length.
+size_t dbg_proto_cobs_encode(const uint8_t *in, size_t len, uint8_t *out);
+//! Decode in place. Returns the decoded length or 0 if malformed.
+size_t dbg_proto_cobs_decode(uint8_t *buf, size_t len);
+//! True if [addr, addr + len) lies in memory that exists on the STM32F103RC,
+//! so reading it can't end in a BusFault. Byte reads of the PPB are still
+//! UNPREDICTABLE, read through dbg_proto_mem_read().
+bool dbg_proto_access_ok(uint32_t addr, uint32_t len);
+//! dbg_proto_access_ok(), and whole aligned words in the PPB
+bool dbg_proto_read_ok(uint32_t addr, uint32_t len);
+//! Copies [addr, addr + len) to dst if dbg_proto_read_ok(), the PPB a word at
+//! a time through core_reg_read()
+bool dbg_proto_mem_read(void *dst, uint32_t addr, uint32_t len);
+//! True if [addr, addr + len) is SRAM or peripherals, which take plain
+//! stores. Flash and system memory don't, and the PPB is written through
+//! core_reg_write().
+bool dbg_proto_write_ok(uint32_t addr, uint32_t len);
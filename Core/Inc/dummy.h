@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdint.h>
+#include "console.h"
 
 typedef struct {
   const char *name;
@@ -8,9 +9,7 @@ typedef struct {
 } sDummyFunction;
 
 extern const sDummyFunction s_dummy_funcs[];
-const uint32_t dummy_num;
-
-void logp(const char *fmt, ...);
+extern const uint32_t dummy_num;
 
 void dummy_function_1(void);
 void dummy_function_2(void);
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+//! Named shell command lines kept in the last flash page. Typing the name of
+//! a macro runs its body as if it had been typed, `;` separated commands
+//! included.
+
+#define MACRO_NAME_MAX (16)
+#define MACRO_BODY_MAX (512)
+
+//! Run once the shell is up
+#define MACRO_FLAG_BOOT (1 << 0)
+
+//! Body of the macro, in flash, or NULL if there is none by that name
+const char *macro_find(const char *name, uint8_t *flags);
+//! First macro flagged MACRO_FLAG_BOOT, or NULL. Sets name if found.
+const char *macro_find_boot(const char **name);
+
+//! Adds or replaces a macro. Erases the page, compacting it, only when the
+//! free space at its end runs out.
+bool macro_define(const char *name, const char *body, uint8_t flags);
+bool macro_delete(const char *name);
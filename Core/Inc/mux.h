@@ -0,0 +1,85 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "ring.h"
+
+//! Multiplexes several output channels over USART1.
+//!
+//! Every channel has its own TX queue, priority and weight. The TXE interrupt
+//! always serves the highest priority channel with data queued, channels of
+//! equal priority share the link in proportion to their weights (deficit
+//! round robin in MUX_QUANTUM byte steps).
+//!
+//! With MUX_FRAMED=0 the bytes go out as they are and channels only take
+//! turns at the end of a line or of a dbg_proto frame, so a plain terminal
+//! still works. With MUX_FRAMED=1 every chunk of up to MUX_CHUNK_MAX bytes is
+//! sent as 0x00 COBS(0xA0 | channel, data) 0x00, turns are taken after every
+//! chunk and tools/demux.py splits the streams back out.
+#ifndef MUX_FRAMED
+#define MUX_FRAMED (0)
+#endif
+
+typedef enum {
+  //! Echo, prompt and the output of shell commands
+  kMuxChannel_Shell,
+  //! logp() from anywhere else, deferred log events
+  kMuxChannel_Log,
+  kMuxChannel_Trace,
+  //! dbg_proto responses and other bulk transfers
+  kMuxChannel_Bulk,
+  kMuxChannel_Count,
+} eMuxChannel;
+
+//! Largest contiguous region mux_reserve() hands out
+#define MUX_RESERVE_MAX (264)
+//! Most payload bytes per frame in framed mode
+#define MUX_CHUNK_MAX (64)
+//! Credit a channel gets per round for each unit of weight
+#define MUX_QUANTUM (64)
+//! Frame header, the low bits are the channel
+#define MUX_FRAME_TAG (0xA0)
+
+typedef enum {
+  //! Wait for the interrupt to drain the queue. If the caller runs at a
+  //! priority the USART1 interrupt can't preempt, drain it by polling instead.
+  kMuxPolicy_Block,
+  //! Discard the oldest queued bytes to make room
+  kMuxPolicy_DropOldest,
+  //! Discard whatever doesn't fit
+  kMuxPolicy_DropNewest,
+} eMuxPolicy;
+
+//! Policy of the log channel
+#ifndef MUX_LOG_POLICY
+#define MUX_LOG_POLICY kMuxPolicy_Block
+#endif
+
+typedef struct {
+  uint32_t queued;
+  uint32_t sent;
+  uint32_t dropped;
+} sMuxStats;
+
+//! Queue bytes on a channel. Returns how many were queued, which is less than
+//! len only if the channel's policy dropped some of them. Any number of
+//! contexts may write, each call of up to half the channel's queue reaches
+//! the wire in one piece.
+size_t mux_write(eMuxChannel ch, const void *buf, size_t len);
+//! Claims between min_len and max_len contiguous bytes of a channel's queue
+//! to be filled in place, at most MUX_RESERVE_MAX or half the queue. How many
+//! depends on the policy, res->len says. Returns NULL if not even min_len
+//! was available.
+uint8_t *mux_reserve(eMuxChannel ch, size_t min_len, size_t max_len,
+                     sRingReservation *res);
+//! Hands a filled reservation to the transmitter
+void mux_commit(eMuxChannel ch, sRingReservation *res);
+
+void mux_set_policy(eMuxChannel ch, eMuxPolicy policy);
+eMuxPolicy mux_get_policy(eMuxChannel ch);
+//! Higher priorities are served first, weight must be at least 1
+void mux_set_sched(eMuxChannel ch, uint8_t priority, uint8_t weight);
+void mux_get_sched(eMuxChannel ch, uint8_t *priority, uint8_t *weight);
+void mux_get_stats(eMuxChannel ch, sMuxStats *stats);
+const char *mux_channel_name(eMuxChannel ch);
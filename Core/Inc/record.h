@@ -0,0 +1,36 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+//! Structured command output. A handler describes each result as a record,
+//! a type and a list of named fields, and the session's format decides what
+//! goes on the wire:
+//!   text: `type: key=value key=value` for humans
+//!   json: one compact object per line, {"t":"type","key":value}
+//!   cbor: one CBOR map per kDbgProtoEvt_Record frame, keys as in json
+//! Records go where logp() output goes. Thread mode only.
+
+typedef enum {
+  kRecordFormat_Text,
+  kRecordFormat_Json,
+  kRecordFormat_Cbor,
+} eRecordFormat;
+
+//! Largest encoded record, fields that don't fit are dropped
+#define RECORD_MAX (240)
+
+void record_set_format(eRecordFormat format);
+eRecordFormat record_get_format(void);
+
+void record_begin(const char *type);
+void record_u32(const char *key, uint32_t value);
+//! A number humans read in hex, an address or a register
+void record_hex(const char *key, uint32_t value);
+void record_bool(const char *key, bool value);
+void record_str(const char *key, const char *value);
+//! A byte string in cbor, a hex string in json and text
+void record_bytes(const char *key, const void *data, size_t len);
+//! Sends the record
+void record_end(void);
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+//! Lock-free single-producer / single-consumer byte ring.
+//!
+//! head is only written by the producer and tail only by the consumer, so one
+//! side may run in an ISR without masking interrupts. Both indices run freely
+//! and are masked on access, which is why the size must be a power of two.
+//!
+//! A ring can also take several producers that preempt each other on one
+//! core (thread mode and ISRs) through ring_reserve()/ring_commit(). Then
+//! every producer of that ring must use them. The same goes for consumers
+//! and ring_get_atomic().
+typedef struct {
+  //! End of the data visible to the consumer
+  volatile uint32_t head;
+  volatile uint32_t tail;
+  //! End of the space claimed by producers, equal to head when none is busy
+  volatile uint32_t reserve;
+  //! Producers between ring_reserve() and ring_commit()
+  volatile uint32_t writers;
+  uint32_t mask;
+  //! Extra bytes after the end of buf, see ring_reserve()
+  uint32_t slack;
+  uint8_t *buf;
+} sRingBuf;
+
+typedef struct {
+  uint32_t idx;
+  size_t len;
+} sRingReservation;
+
+//! Defines a statically allocated ring called _name holding _size bytes
+#define RING_DEFINE(_name, _size) RING_DEFINE_WITH_SLACK(_name, _size, 0)
+
+//! Same as RING_DEFINE, with _slack bytes behind the ring so reservations of
+//! up to _slack bytes are always contiguous
+#define RING_DEFINE_WITH_SLACK(_name, _size, _slack) \
+  _Static_assert(((_size) & ((_size) - 1)) == 0, #_name " size must be a power of two"); \
+  static uint8_t _name##_storage[(_size) + (_slack)]; \
+  static sRingBuf _name = { .mask = (_size) - 1, .slack = (_slack), .buf = _name##_storage }
+
+//! Returns false if size is not a power of two
+bool ring_init(sRingBuf *ring, void *buf, size_t size);
+
+size_t ring_size(const sRingBuf *ring);
+size_t ring_used(const sRingBuf *ring);
+size_t ring_free(const sRingBuf *ring);
+
+// Producer side
+//! Copies as much of buf as fits and returns the number of bytes written
+size_t ring_write_bulk(sRingBuf *ring, const void *buf, size_t len);
+bool ring_put(sRingBuf *ring, uint8_t byte);
+
+// Consumer side
+//! Copies up to len bytes out and returns the number of bytes read
+size_t ring_read_bulk(sRingBuf *ring, void *buf, size_t len);
+bool ring_get(sRingBuf *ring, uint8_t *byte);
+//! Discards up to len bytes and returns the number discarded
+size_t ring_skip(sRingBuf *ring, size_t len);
+
+// Multiple producers
+//! Claims len bytes. Returns false, claiming nothing, if they don't fit.
+bool ring_reserve(sRingBuf *ring, size_t len, sRingReservation *res);
+//! Where to write a reservation. The bytes are contiguous as long as the ring
+//! was defined with at least res->len bytes of slack, else only up to the end
+//! of the ring.
+uint8_t *ring_reservation_ptr(const sRingBuf *ring, const sRingReservation *res);
+//! Marks a reservation as written. The consumer sees it once every producer
+//! that reserved before this one has committed too.
+void ring_commit(sRingBuf *ring, const sRingReservation *res);
+//! ring_reserve() + copy + ring_commit(). Writes all of buf or nothing.
+bool ring_write_atomic(sRingBuf *ring, const void *buf, size_t len);
+
+// Multiple consumers
+//! ring_get() for consumers that preempt each other on one core, the debug
+//! monitor and thread mode say. A read that was interrupted by another one
+//! starts over instead of moving tail back. Every consumer of that ring
+//! must use it.
+bool ring_get_atomic(sRingBuf *ring, uint8_t *byte);
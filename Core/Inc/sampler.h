@@ -0,0 +1,5 @@
+#pragma once
+
+//! Periodically reads a word of memory and reports it on the trace channel,
+//! driven by a scheduler timer. Controlled with the sample command.
+void sampler_init(void);
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+//! Run-to-completion task scheduler.
+//!
+//! Every task has its own priority, so the highest ready task is found with
+//! one CLZ over the ready bitmap and dispatch costs the same whatever the
+//! number of tasks. Tasks run in thread mode, the highest priority first, and
+//! are never preempted by other tasks, only by interrupts. A task becomes ready
+//! when someone posts one of its event flags, from any context, or when one
+//! of its timers expires. The core sleeps in WFI while no task is ready.
+//!
+//! Timers are checked by SysTick, which only compares the tick against the
+//! earliest deadline and pends PendSV. PendSV, at the lowest priority, then
+//! walks the sorted timer list and posts the events.
+
+//! 0 keeps the core awake, some debug probes lose the connection in WFI
+#ifndef SCHED_SLEEP
+#define SCHED_SLEEP (1)
+#endif
+
+//! Also the number of priorities, 0 being the lowest
+#define SCHED_MAX_TASKS (8)
+
+typedef void (*SchedHandler)(uint32_t events, void *ctx);
+
+typedef struct {
+  const char *name;
+  SchedHandler handler;
+  void *ctx;
+  //! Unique among the tasks, below SCHED_MAX_TASKS
+  uint8_t prio;
+
+  // Owned by the scheduler
+  volatile uint32_t events;
+  uint32_t runs;
+  uint64_t cycles;
+  uint32_t max_cycles;
+} sSchedTask;
+
+typedef struct SchedTimer {
+  sSchedTask *task;
+  //! Posted to task on expiry
+  uint32_t events;
+  //! 0 for a one shot timer
+  uint32_t period_ms;
+
+  // Owned by the scheduler
+  uint32_t expiry;
+  bool active;
+  struct SchedTimer *next;
+} sSchedTimer;
+
+typedef struct {
+  //! Cycles the core spent outside WFI (tasks and interrupts)
+  uint64_t active_cycles;
+  //! Length of the measurement window
+  uint32_t elapsed_ms;
+  uint32_t wakeups;
+  uint32_t dispatches;
+  //! Scheduler cycles per dispatch, without the task itself
+  uint32_t overhead_min;
+  uint32_t overhead_max;
+  uint64_t overhead_total;
+  uint32_t timer_runs;
+} sSchedStats;
+
+//! Returns false if the priority is out of range or taken
+bool sched_task_add(sSchedTask *task);
+//! Sets event flags of a task and makes it ready. Safe from any context.
+void sched_post(sSchedTask *task, uint32_t events);
+
+//! (Re)arms a timer to fire after delay_ms, then every period_ms if that is
+//! not 0. Safe from any context.
+void sched_timer_start(sSchedTimer *timer, uint32_t delay_ms);
+void sched_timer_stop(sSchedTimer *timer);
+
+//! Called from SysTick_Handler after HAL_IncTick()
+void sched_tick(void);
+//! Called from PendSV_Handler
+void sched_timer_irq(void);
+
+__attribute__((noreturn))
+void sched_run(void);
+
+void sched_get_stats(sSchedStats *stats);
+void sched_reset_stats(void);
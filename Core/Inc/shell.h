@@ -14,6 +14,14 @@ extern "C" {
 #include <string.h>
 #include "main.h"
 
+//! Longest command line, longer ones run once the buffer is full
+#ifndef SHELL_LINE_MAX
+#define SHELL_LINE_MAX (256)
+#endif
+#ifndef SHELL_MAX_ARGS
+#define SHELL_MAX_ARGS (16)
+#endif
+
 typedef struct ShellImpl {
   //! Function to call whenever a character needs to be sent out.
   int (*send_char)(char c);
@@ -30,6 +38,31 @@ int shell_help_handler(int argc, char *argv[]);
 void prv_echo_str(const char *str);
 void prv_echo(char c);
 
+//! Returned by a handler that handed its work to shell_job_start(). The
+//! prompt only comes back once the job is done.
+#define SHELL_CMD_PENDING (1)
+
+//! One slice of a job. Returns SHELL_CMD_PENDING to be called again, anything
+//! else ends the job. Keep slices short, input is only handled in between.
+typedef int (*ShellJobStep)(void *ctx);
+
+//! Runs step in the background until it is done or cancelled with Ctrl-C.
+//! Ctrl-T prints the last progress reported. Returns SHELL_CMD_PENDING, for
+//! the handler to return, or -1 if another job is still running.
+int shell_job_start(const char *name, ShellJobStep step, void *ctx);
+//! Called from a step to report how far the job got
+void shell_job_progress(uint32_t done, uint32_t total);
+bool shell_job_active(void);
+
+//! Called with whether Enter arrived in time, returns what the command does
+typedef int (*ShellAwaitDone)(bool entered);
+
+//! A job that holds the prompt until Enter is typed or timeout_ms pass, then
+//! calls done. It sleeps on a scheduler timer meanwhile, other input is
+//! dropped and Ctrl-C counts as no Enter. Returns SHELL_CMD_PENDING, for the
+//! handler to return, or -1 if another job is still running.
+int shell_await_enter(const char *name, ShellAwaitDone done, uint32_t timeout_ms);
+
 __attribute__((noreturn))
 void shell_processing_loop(void);
 
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+//! Typed argument parsing shared by all shell handlers. Everything parses in
+//! place into the caller's variables, nothing is allocated. Each function
+//! returns false if the whole argument doesn't match.
+
+//! Decimal, 0x hex or 0 octal, no sign and at most UINT32_MAX
+bool shell_arg_u32(const char *arg, uint32_t *out);
+
+//! A number or a symbol, optionally followed by +offset, e.g. _sdata+0x10 or
+//! dummy_function_3. Function addresses come without the thumb bit.
+bool shell_arg_addr(const char *arg, uint32_t *out);
+
+//! <addr>+<len> or <addr>..<end>, the end being exclusive
+bool shell_arg_range(const char *arg, uint32_t *addr, uint32_t *len);
+
+//! Hex digits, two per byte, optionally with a 0x prefix. Stores the bytes
+//! in buf and their count in len.
+bool shell_arg_hex(const char *arg, uint8_t *buf, size_t size, size_t *len);
@@ -1,19 +1,48 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdint.h>
 
 #define ARRAY_SIZE(arr) (sizeof(arr) / sizeof(arr[0]))
 
-#define SHELL_FOR_EACH_COMMAND(command) \
-  for (const sShellCommand *command = g_shell_commands; \
-    command < &g_shell_commands[g_num_shell_commands]; \
-    ++command)
+//! Every run of a command since boot or the last `cmdstats reset`. Jobs
+//! count until their last slice, so the cycles include other tasks and
+//! interrupts that ran in between.
+typedef struct {
+  uint32_t runs;
+  uint32_t min_cycles;
+  uint32_t max_cycles;
+  uint64_t total_cycles;
+} sShellCmdStats;
 
 typedef struct ShellCommand {
   const char *command;
   int (*handler)(int argc, char *argv[]);
   const char *help;
+  sShellCmdStats *stats;
 } sShellCommand;
 
-extern const sShellCommand *const g_shell_commands;
-extern const size_t g_num_shell_commands;
+//! Registers a command from any module. The entry goes to its own
+//! .shell_cmd.<name> section, which the linker script sorts by name into one
+//! table, so lookup can binary search it. _name must be a C identifier, a
+//! name registered twice fails to link. The table itself stays in flash,
+//! each entry points to its statistics in RAM.
+#define SHELL_COMMAND(_name, _handler, _help) \
+  static sShellCmdStats g_shell_cmd_stats_##_name; \
+  const sShellCommand g_shell_cmd_##_name \
+  __attribute__((section(".shell_cmd." #_name), used, aligned(4))) = { \
+    .command = #_name, .handler = _handler, .help = _help, \
+    .stats = &g_shell_cmd_stats_##_name, \
+  }
+
+// Bounds of the sorted table, defined in the linker script
+extern const sShellCommand __shell_cmds_start[];
+extern const sShellCommand __shell_cmds_end[];
+
+//! Binary search of the table, NULL if there is no such command
+const sShellCommand *shell_find_command(const char *name);
+
+#define SHELL_FOR_EACH_COMMAND(command) \
+  for (const sShellCommand *command = __shell_cmds_start; \
+    command < __shell_cmds_end; \
+    ++command)
@@ -18,6 +18,7 @@ void DebugMon_Handler(void);
 void PendSV_Handler(void);
 void SysTick_Handler(void);
 void USART1_IRQHandler(void);
+void DMA1_Channel5_IRQHandler(void);
 
 #ifdef __cplusplus
 }
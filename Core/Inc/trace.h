@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dbg.h"
+
+//! Tracepoints: breakpoints that don't stop. A hit captures a CYCCNT
+//! timestamp, a set of registers and a few memory words into a RAM ring and
+//! the code resumes right away, nothing goes out on the UART until the ring
+//! is read with `trace dump`. Each one sits on a breakpoint of bkpt.h, an
+//! FPB one or a software one. Controlled with the trace command.
+
+//! Tracepoints at once
+#define TRACE_MAX (8)
+//! Memory words one tracepoint captures
+#define TRACE_WORDS_MAX (4)
+//! Registers and words one hit records
+#define TRACE_VALUES_MAX (8)
+
+//! Bytes of the ring the hits go to, a power of two
+#ifndef TRACE_RING_SIZE
+#define TRACE_RING_SIZE (2048)
+#endif
+
+//! Traces addr, capturing the registers whose bits (1 << eDebugReg) are set
+//! in regs and the words at words[]. Returns the tracepoint's id, or -1.
+int trace_set(uint32_t addr, uint32_t regs, const uint32_t *words, size_t num_words);
+bool trace_clear(int id);
+void trace_clear_all(void);
+
+//! From the debug monitor on a breakpoint event: records the hit and
+//! returns true if the breakpoint is a tracepoint, started is CYCCNT when
+//! the monitor was entered
+bool trace_hit(const sContextStateFrame *frame, uint32_t started);
+//! From the debug monitor once the step over the tracepoint is done, for
+//! the cost of the hit
+void trace_step_done(void);
@@ -8,14 +8,129 @@ extern "C" {
 
 /* Includes ------------------------------------------------------------------*/
 #include "main.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+//! 1: receive USART1 into a circular DMA1 buffer and publish on IDLE/HT/TC.
+//! 0: fall back to one HAL_UART_Receive_IT() per byte.
+#ifndef UART_RX_DMA
+#define UART_RX_DMA (1)
+#endif
+
+//! 1: drive USART1 and its RX DMA channel through the registers directly.
+//! 0: go through HAL_UART_Init() / HAL_UART_IRQHandler() / HAL_DMA_IRQHandler().
+#ifndef UART_LL
+#define UART_LL (0)
+#endif
+
+//! Size of the circular DMA receive buffer. Data is published at least every
+//! half buffer, so this bounds how long RX interrupts may be held off.
+#define UART_RX_DMA_BUF_SIZE (256)
+
+typedef enum {
+  kUartFlow_None,
+  //! CTS (PA11) pauses our transmitter in hardware, RTS (PA12) is dropped
+  //! while the receive ring is above its high watermark
+  kUartFlow_RtsCts,
+  //! XOFF/XON are sent instead of moving RTS, and XOFF/XON from the host
+  //! pause our output. Text only, binary frames may contain these bytes.
+  kUartFlow_XonXoff,
+} eUartFlow;
+
+#ifndef UART_FLOW
+#define UART_FLOW kUartFlow_None
+#endif
+
+#define UART_XON (0x11)
+#define UART_XOFF (0x13)
+
+typedef struct {
+  //! Bytes taken off the wire
+  uint32_t rx_bytes;
+  //! Bytes the consumer had no room for
+  uint32_t dropped;
+  //! Hardware overrun / framing / noise errors
+  uint32_t errors;
+  //! Number of times data was handed to the consumer
+  uint32_t publish_events;
+  //! Number of times the host was asked to stop sending
+  uint32_t throttled;
+} sUartRxStats;
 
 extern UART_HandleTypeDef huart1;
+extern DMA_HandleTypeDef hdma_usart1_rx;
 
 void MX_USART1_UART_Init(void);
 
+//! USART1_IRQHandler: receive, IDLE, errors and feeding the TX queue
+void uart_irq(void);
+//! DMA1_Channel5_IRQHandler: receive DMA half/full transfer
+void uart_rx_dma_irq(void);
+//! Cycles spent in uart_irq() and how often it ran since the last reset.
+//! Only counts while DWT CYCCNT is enabled.
+void uart_get_irq_profile(uint32_t *cycles, uint32_t *count);
+void uart_reset_irq_profile(void);
+
+//! Supplies the next byte to send, called from the TXE interrupt or, while
+//! that can't run, by polling. Returns false once nothing is queued.
+//! Implemented by the multiplexer in mux.c.
+bool uart_tx_next_byte_cb(uint8_t *byte);
+//! Let the TXE interrupt pull from uart_tx_next_byte_cb()
+void uart_tx_kick(void);
+//! True if the USART1 interrupt is able to preempt the current context, i.e.
+//! it is safe to wait for it to drain the queues
+bool uart_tx_irq_can_run(void);
+//! Busy-waits for the data register and writes one byte
+void uart_tx_poll_byte(uint8_t byte);
+//! Sends the next queued byte by polling. Only for when the interrupt can't
+//! run, so the caller is the only consumer. Returns false if nothing is queued.
+bool uart_tx_poll_one(void);
+//! In direct mode output is written out by polling before the call returns,
+//! bypassing the interrupt. Used while the debug monitor holds the CPU: a
+//! producer it preempted may have an open reservation that would otherwise
+//! keep everything queued after it from being sent. Only the context that
+//! enabled direct mode may write while it is on.
+void uart_tx_set_direct(bool direct);
+bool uart_tx_is_direct(void);
+//! Wait until everything queued has left the shift register
+void uart_tx_flush(void);
+//! Bytes written to the data register, framing included
+uint32_t uart_tx_get_sent(void);
+
+//! How long a new baud rate waits for the host to confirm it before
+//! falling back to the previous one
+#define UART_BAUD_CONFIRM_TIMEOUT_MS (3000)
+
+uint32_t uart_get_baud(void);
+//! Fastest rate PCLK2 allows with 16x oversampling (BRR mantissa of 1)
+uint32_t uart_get_max_baud(void);
+//! Slowest rate whose BRR mantissa still fits its 12 bits, below it BRR
+//! would be truncated to a faster rate
+uint32_t uart_get_min_baud(void);
+//! Rate actually produced by the BRR value closest to baud
+uint32_t uart_get_actual_baud(uint32_t baud);
+//! Drains the TX queue, then reprograms BRR. Returns false if the rate is out
+//! of range for the current PCLK2, see uart_get_min_baud().
+bool uart_set_baud(uint32_t baud);
+
+void uart_set_flow(eUartFlow flow);
+eUartFlow uart_get_flow(void);
+//! Asks the host to stop (or resume) sending, by RTS or XOFF/XON depending
+//! on the flow control mode. Called by the consumer of received data as its
+//! buffer crosses its watermarks, from any context but with interrupts
+//! masked so the decision and the signal stay in order.
+void uart_rx_throttle(bool stop);
+bool uart_rx_throttled(void);
+
+void uart_rx_get_stats(sUartRxStats *stats);
+void uart_rx_reset_stats(void);
+
+//! Consumer of received data, called from interrupt context with as many
+//! bytes as are available. Returns the number of bytes it accepted.
+size_t uart_byte_received_cb(const uint8_t *buf, size_t size);
+
 #ifdef __cplusplus
 }
 #endif
 
 #endif /* __USART_H__ */
-
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "dbg.h"
+
+//! Data watchpoints on the DWT comparators. A hit is a DebugMonitor event
+//! (DFSR.DWTTRAP), so the monitor has to be enabled with debug_mon_en.
+//! Controlled with the watch command.
+
+//! A Cortex-M3 has four comparators, more are left alone
+#define WATCH_MAX (4)
+
+//! How much of a watched range is copied to report old values on a hit
+#define WATCH_SHADOW_BYTES (16)
+
+typedef enum {
+  kWatchAccess_Read,
+  kWatchAccess_Write,
+  kWatchAccess_ReadWrite,
+} eWatchAccess;
+
+//! What the DWT of this core offers
+typedef struct {
+  uint32_t num_comparators;
+  //! Largest watched range, 2^max_mask bytes
+  uint32_t max_mask;
+  //! Comparator 1 can match data values
+  bool value_match;
+} sWatchConfig;
+
+void watch_get_config(sWatchConfig *config);
+
+//! Watches [addr, addr + size), size being a power of two addr is aligned
+//! to. Returns the watchpoint's id, or -1.
+int watch_set(uint32_t addr, uint32_t size, eWatchAccess access);
+//! Watches for value being read or written at addr, size 1, 2 or 4. Takes
+//! comparator 1 for the value and a second one for the address.
+int watch_set_value(uint32_t addr, uint32_t size, eWatchAccess access, uint32_t value);
+bool watch_clear(int id);
+void watch_clear_all(void);
+
+//! From debug_monitor_handler_c() on DFSR.DWTTRAP: logs which watchpoints
+//! hit, with the old and new values of a range or the value matched
+void watch_report_hits(const sContextStateFrame *frame);
@@ -0,0 +1,374 @@
+#include "bkpt.h"
+#include "dbg.h"
+#include "dbg_proto.h"
+#include "console.h"
+#include "main.h"
+#include "record.h"
+#include "shell_args.h"
+#include "shell_cmd.h"
+#include <string.h>
+
+#define BKPT_FLAG_USED (1 << 0)
+#define BKPT_FLAG_ENABLED (1 << 1)
+// patched into RAM code rather than on the FPB
+#define BKPT_FLAG_SOFT (1 << 2)
+// kBkptOwner_Trace rather than kBkptOwner_User
+#define BKPT_FLAG_TRACE (1 << 3)
+#define BKPT_NO_COMP (0xFF)
+#define BKPT_NONE (-1)
+
+// What a software breakpoint patches in, `bkpt #0`
+#define BKPT_SOFT_INSN (0xBE00)
+
+// Open addressing on the address, with about half the slots free so that
+// probes stay short. Slots hold id + 1, 0 is empty.
+#define BKPT_HASH_SIZE (2 * BKPT_MAX + 1)
+
+#if BKPT_MAX < 0xFF
+typedef uint8_t tBkptSlot;
+#else
+typedef uint16_t tBkptSlot;
+#endif
+_Static_assert(BKPT_MAX < 0xFFFF, "ids have to fit the hash slots");
+
+typedef struct {
+  uint32_t addr;
+  // saturates
+  uint16_t hits;
+  // the instruction a software breakpoint replaced
+  uint16_t orig;
+  // FP_COMP index while enabled
+  uint8_t comp;
+  uint8_t flags;
+} sBkpt;
+
+static sBkpt s_bkpts[BKPT_MAX];
+static tBkptSlot s_hash[BKPT_HASH_SIZE];
+
+// The software breakpoint whose instruction is back for a step over it
+static int s_lifted = BKPT_NONE;
+
+static bool prv_valid(int id)
+{
+  return id >= 0 && id < BKPT_MAX && (s_bkpts[id].flags & BKPT_FLAG_USED);
+}
+
+static size_t prv_hash(uint32_t addr)
+{
+  // instructions are halfword aligned
+  return (addr >> 1) % BKPT_HASH_SIZE;
+}
+
+// Slot holding addr, or the empty one it would go in
+static size_t prv_hash_slot(uint32_t addr)
+{
+  size_t slot = prv_hash(addr);
+  while (s_hash[slot] != 0 && s_bkpts[s_hash[slot] - 1].addr != addr) {
+    slot = (slot + 1) % BKPT_HASH_SIZE;
+  }
+  return slot;
+}
+
+static int prv_find(uint32_t addr)
+{
+  return (int)s_hash[prv_hash_slot(addr)] - 1;
+}
+
+// Deleting from open addressing would break the probe chains behind the
+// entry, rebuilding is cheap at this size
+static void prv_hash_rebuild(void)
+{
+  memset(s_hash, 0, sizeof(s_hash));
+  for (int i = 0; i < BKPT_MAX; i++) {
+    if (s_bkpts[i].flags & BKPT_FLAG_USED) {
+      s_hash[prv_hash_slot(s_bkpts[i].addr)] = (tBkptSlot)(i + 1);
+    }
+  }
+}
+
+// A code comparator neither a breakpoint here nor fpb_set_breakpoint or
+// fpb_remap_function from elsewhere is using
+static int prv_comp_alloc(void)
+{
+  sFpbConfig config;
+  fpb_get_config(&config);
+  for (size_t comp = 0; comp < config.num_code_comparators && comp < BKPT_NO_COMP; comp++) {
+    sFpbCompConfig comp_config;
+    if (!fpb_get_comp_config(comp, &comp_config) || comp_config.enabled) {
+      continue;
+    }
+    bool taken = false;
+    for (int i = 0; i < BKPT_MAX && !taken; i++) {
+      taken = (s_bkpts[i].flags & BKPT_FLAG_ENABLED) && s_bkpts[i].comp == comp;
+    }
+    if (!taken) {
+      return (int)comp;
+    }
+  }
+  logp("No free FPB comparator");
+  return -1;
+}
+
+// Code the FPB can't reach but a write can: what runs from SRAM
+static bool prv_is_ram_code(uint32_t addr)
+{
+#if HOST_BUILD
+  // nothing runs from RAM on the host, ram_func stands in for it and is
+  // made writable by host_main.c
+  extern const char __start_ram_func[], __stop_ram_func[];
+  return addr >= (uintptr_t)__start_ram_func && addr + 2 <= (uintptr_t)__stop_ram_func;
+#else
+  return addr >= 0x20000000 && addr < 0x40000000 && dbg_proto_access_ok(addr, 2);
+#endif
+}
+
+static void prv_patch(uint32_t addr, uint16_t insn)
+{
+  *(volatile uint16_t *)(uintptr_t)addr = insn;
+  // nothing fetched ahead may still hold the old instruction
+  __DSB();
+  __ISB();
+}
+
+static bool prv_arm(sBkpt *bkpt)
+{
+  if (bkpt->flags & BKPT_FLAG_SOFT) {
+    bkpt->orig = *(volatile uint16_t *)(uintptr_t)bkpt->addr;
+    prv_patch(bkpt->addr, BKPT_SOFT_INSN);
+    if (*(volatile uint16_t *)(uintptr_t)bkpt->addr != BKPT_SOFT_INSN) {
+      logp("0x%x didn't take the BKPT", (int)bkpt->addr);
+      return false;
+    }
+    bkpt->flags |= BKPT_FLAG_ENABLED;
+    return true;
+  }
+
+  const int comp = prv_comp_alloc();
+  if (comp < 0 || !fpb_set_breakpoint((size_t)comp, bkpt->addr)) {
+    return false;
+  }
+  bkpt->comp = (uint8_t)comp;
+  bkpt->flags |= BKPT_FLAG_ENABLED;
+  return true;
+}
+
+static void prv_disarm(sBkpt *bkpt)
+{
+  if (s_lifted != BKPT_NONE && bkpt == &s_bkpts[s_lifted]) {
+    s_lifted = BKPT_NONE; // already the original instruction
+  } else if ((bkpt->flags & BKPT_FLAG_ENABLED) && (bkpt->flags & BKPT_FLAG_SOFT)) {
+    prv_patch(bkpt->addr, bkpt->orig);
+  } else if (bkpt->flags & BKPT_FLAG_ENABLED) {
+    fpb_clear_breakpoint(bkpt->comp);
+  }
+  bkpt->comp = BKPT_NO_COMP;
+  bkpt->flags &= ~BKPT_FLAG_ENABLED;
+}
+
+static eBkptOwner prv_owner(const sBkpt *bkpt)
+{
+  return (bkpt->flags & BKPT_FLAG_TRACE) ? kBkptOwner_Trace : kBkptOwner_User;
+}
+
+int bkpt_set(uint32_t addr, eBkptOwner owner)
+{
+  addr &= ~0x1u;
+  int id = prv_find(addr);
+  if (id >= 0 && prv_owner(&s_bkpts[id]) != owner) {
+    // a tracepoint would keep a breakpoint from stopping, and deleting
+    // either would take the other along
+    logp("0x%x already has a %s", (int)addr,
+         (owner == kBkptOwner_User) ? "tracepoint" : "breakpoint");
+    return -1;
+  }
+  if (id >= 0) {
+    return bkpt_enable(id, true) ? id : -1;
+  }
+
+  for (id = 0; id < BKPT_MAX && (s_bkpts[id].flags & BKPT_FLAG_USED); id++) { }
+  if (id == BKPT_MAX) {
+    logp("All %d breakpoints are in use", BKPT_MAX);
+    return -1;
+  }
+
+  sBkpt *bkpt = &s_bkpts[id];
+  *bkpt = (sBkpt) {
+    .addr = addr,
+    .comp = BKPT_NO_COMP,
+    .flags = (prv_is_ram_code(addr) ? BKPT_FLAG_SOFT : 0) |
+        ((owner == kBkptOwner_Trace) ? BKPT_FLAG_TRACE : 0),
+  };
+  if (!prv_arm(bkpt)) {
+    *bkpt = (sBkpt) { 0 };
+    return -1;
+  }
+  bkpt->flags |= BKPT_FLAG_USED;
+  s_hash[prv_hash_slot(addr)] = (tBkptSlot)(id + 1);
+  return id;
+}
+
+bool bkpt_enable(int id, bool enable)
+{
+  if (!prv_valid(id)) {
+    return false;
+  }
+  sBkpt *bkpt = &s_bkpts[id];
+  if (enable == ((bkpt->flags & BKPT_FLAG_ENABLED) != 0)) {
+    return true;
+  }
+  if (enable) {
+    return prv_arm(bkpt);
+  }
+  prv_disarm(bkpt);
+  return true;
+}
+
+bool bkpt_delete(int id)
+{
+  if (!prv_valid(id)) {
+    return false;
+  }
+  prv_disarm(&s_bkpts[id]);
+  s_bkpts[id] = (sBkpt) { 0 };
+  prv_hash_rebuild();
+  return true;
+}
+
+void bkpt_delete_all(eBkptOwner owner)
+{
+  for (int i = 0; i < BKPT_MAX; i++) {
+    if ((s_bkpts[i].flags & BKPT_FLAG_USED) && prv_owner(&s_bkpts[i]) == owner) {
+      prv_disarm(&s_bkpts[i]);
+      s_bkpts[i] = (sBkpt) { 0 };
+    }
+  }
+  prv_hash_rebuild();
+}
+
+bool bkpt_get(int id, sBkptInfo *info)
+{
+  if (!prv_valid(id)) {
+    return false;
+  }
+  const sBkpt *bkpt = &s_bkpts[id];
+  *info = (sBkptInfo) {
+    .addr = bkpt->addr,
+    .owner = prv_owner(bkpt),
+    .enabled = (bkpt->flags & BKPT_FLAG_ENABLED) != 0,
+    .soft = (bkpt->flags & BKPT_FLAG_SOFT) != 0,
+    .hits = bkpt->hits,
+  };
+  return true;
+}
+
+int bkpt_find(uint32_t addr)
+{
+  return prv_find(addr & ~0x1u);
+}
+
+int bkpt_hit(uint32_t pc)
+{
+  const int id = prv_find(pc);
+  if (id >= 0 && s_bkpts[id].hits != UINT16_MAX) {
+    s_bkpts[id].hits++;
+  }
+  return id;
+}
+
+bool bkpt_step_begin(uint32_t pc)
+{
+  bkpt_step_done();
+  const int id = prv_find(pc);
+  const uint8_t armed = BKPT_FLAG_SOFT | BKPT_FLAG_ENABLED;
+  if (id < 0 || (s_bkpts[id].flags & armed) != armed) {
+    return false;
+  }
+  prv_patch(pc, s_bkpts[id].orig);
+  s_lifted = id;
+  return true;
+}
+
+void bkpt_step_done(void)
+{
+  if (s_lifted != BKPT_NONE) {
+    prv_patch(s_bkpts[s_lifted].addr, BKPT_SOFT_INSN);
+    s_lifted = BKPT_NONE;
+  }
+}
+
+/* Shell ---------------------------------------------------------------------*/
+
+static int prv_bkpt_list(void)
+{
+  for (int i = 0; i < BKPT_MAX; i++) {
+    const sBkpt *bkpt = &s_bkpts[i];
+    if ((bkpt->flags & BKPT_FLAG_USED) == 0) {
+      continue;
+    }
+    record_begin("bkpt");
+    record_u32("id", i);
+    record_hex("addr", bkpt->addr);
+    record_bool("enabled", (bkpt->flags & BKPT_FLAG_ENABLED) != 0);
+    record_str("kind", (bkpt->flags & BKPT_FLAG_SOFT) ? "soft" : "fpb");
+    if (bkpt->flags & BKPT_FLAG_TRACE) {
+      record_str("owner", "trace");
+    }
+    if ((bkpt->flags & BKPT_FLAG_ENABLED) && !(bkpt->flags & BKPT_FLAG_SOFT)) {
+      record_u32("comp", bkpt->comp);
+    }
+    record_u32("hits", bkpt->hits);
+    record_end();
+  }
+  return 0;
+}
+
+// The bkpt command only touches its own breakpoints, the trace command
+// those of tracepoints
+static bool prv_user_id(int id)
+{
+  sBkptInfo info;
+  return bkpt_get(id, &info) && info.owner == kBkptOwner_User;
+}
+
+static int prv_bkpt(int argc, char *argv[])
+{
+  if (argc < 2) {
+    __BKPT(1);
+    return 0;
+  }
+  const char *op = argv[1];
+  if (strcmp(op, "list") == 0) {
+    return prv_bkpt_list();
+  }
+
+  const bool enable = (strcmp(op, "enable") == 0);
+  uint32_t arg;
+  bool ok;
+  if (argc == 3 && strcmp(op, "set") == 0 && shell_arg_addr(argv[2], &arg)) {
+    const int id = bkpt_set(arg, kBkptOwner_User);
+    if (id < 0) {
+      return -1;
+    }
+    logp("bkpt set %d: 0x%x", id, (int)(arg & ~0x1u));
+    return 0;
+  } else if (argc == 3 && strcmp(op, "clear") == 0 && strcmp(argv[2], "all") == 0) {
+    bkpt_delete_all(kBkptOwner_User);
+    ok = true;
+  } else if (argc == 3 && strcmp(op, "clear") == 0 && shell_arg_u32(argv[2], &arg)) {
+    ok = prv_user_id((int)arg) && bkpt_delete((int)arg);
+  } else if (argc == 3 && (enable || strcmp(op, "disable") == 0) &&
+             shell_arg_u32(argv[2], &arg)) {
+    ok = prv_user_id((int)arg) && bkpt_enable((int)arg, enable);
+  } else {
+    logp("Expected nothing to run a BKPT instruction, or list | set <addr> | "
+         "enable <id> | disable <id> | clear <id>|all");
+    return -1;
+  }
+
+  logp("bkpt %s %s: %s", op, argv[2], ok ? "ok" : "failed");
+  return ok ? 0 : -1;
+}
+
+SHELL_COMMAND(bkpt, prv_bkpt,
+              "Issue a Breakpoint Instruction, or manage breakpoints: list | set <addr> | "
+              "enable <id> | disable <id> | clear <id>|all");
@@ -1,25 +1,118 @@
 #include "console.h"
+#include "mux.h"
+#include "dbg_proto.h"
 
-extern UART_HandleTypeDef huart1;
+static volatile bool s_command_active;
 
 int shell_putc(char c)
 {
-  uart_tx_blocking(&c, sizeof(c));
-  return 1;
+  return (int)mux_write(kMuxChannel_Shell, &c, sizeof(c));
 }
 
-void uart_tx_blocking(void * buf, size_t buf_len)
+void console_set_command_active(bool active)
 {
-	HAL_UART_Transmit(&huart1, (uint8_t *)buf, (uint16_t)buf_len, ~0);
+  s_command_active = active;
 }
 
+eMuxChannel console_log_channel(void)
+{
+  // What a shell command prints belongs to the session and mustn't be
+  // overtaken by the prompt that follows it
+  return (s_command_active && __get_IPSR() == 0) ? kMuxChannel_Shell : kMuxChannel_Log;
+}
+
+#if LOG_DEFERRED
+
+_Static_assert(2 + LOG_DEFERRED_MAX_ARGS * sizeof(uint32_t) < DBG_PROTO_MAX_EVENT_PAYLOAD,
+               "a frame has to leave room for strings");
+
+// Flash up to the initial values of .data, what logdecode.py finds in the ELF
+static bool prv_in_image(uint32_t addr)
+{
+  extern const uint32_t g_pfnVectors[];
+  extern const uint32_t _sidata[];
+  return addr >= (uintptr_t)g_pfnVectors && addr < (uintptr_t)_sidata;
+}
+
+void log_deferred(const char *fmt, const uint32_t *args, size_t nargs, uint32_t strs)
+{
+  if (nargs > LOG_DEFERRED_MAX_ARGS) {
+    nargs = LOG_DEFERRED_MAX_ARGS;
+  }
+
+  // .log_fmt is linked at 0 and kept below 64K, so the address is the id
+  const uint16_t id = (uint16_t)(uintptr_t)fmt;
+  uint8_t payload[DBG_PROTO_MAX_EVENT_PAYLOAD];
+  memcpy(payload, &id, sizeof(id));
+  size_t len = sizeof(id) + nargs * sizeof(uint32_t);
+  for (size_t i = 0; i < nargs; i++) {
+    uint32_t word = args[i];
+    if ((strs & (1u << i)) && word != 0 && !prv_in_image(word)) {
+      // cut to what is left, keeping a terminator for each string after it
+      const size_t later = (size_t)__builtin_popcount(strs >> (i + 1));
+      const char *str = (const char *)(uintptr_t)word;
+      const size_t n = strnlen(str, sizeof(payload) - len - 1 - later);
+      memcpy(&payload[len], str, n);
+      payload[len + n] = '\0';
+      word = LOG_DEFERRED_STR_INLINE | (uint32_t)len;
+      len += n + 1;
+    }
+    memcpy(&payload[sizeof(id) + i * sizeof(uint32_t)], &word, sizeof(word));
+  }
+  dbg_proto_send_event(kDbgProtoEvt_Log, payload, len);
+}
+
+#else
+
+#define LOG_EOL "\r\n"
+#define LOG_TRUNCATED_MARK "..."
+#define LOG_EOL_LEN (sizeof(LOG_EOL) - 1)
+#define LOG_MARK_LEN (sizeof(LOG_TRUNCATED_MARK) - 1)
+//! Longest line logp() emits, longer ones are cut and marked
+#define LOG_LINE_MAX (MUX_RESERVE_MAX - LOG_EOL_LEN)
+
+// Formats straight into a reservation in the TX queue so neither a line
+// buffer on the stack nor a copy is needed. The reservation is committed
+// as a whole, so lines from contexts preempting each other never interleave.
 static void prv_log(const char *fmt, va_list *args) 
 {
-  char log_buf[256];
-  const size_t size = vsnprintf(log_buf, sizeof(log_buf) - 2, fmt, *args);
-  log_buf[size] = '\r';
-  log_buf[size + 1] = '\n';
-  uart_tx_blocking(log_buf, size + 2);
+  va_list measure;
+  va_copy(measure, *args);
+  const int needed = vsnprintf(NULL, 0, fmt, measure);
+  va_end(measure);
+  if (needed < 0) {
+    return;
+  }
+
+  const size_t want = ((size_t)needed < LOG_LINE_MAX ? (size_t)needed : LOG_LINE_MAX) +
+      LOG_EOL_LEN;
+  // any less room than this and there is nothing left to say but "..."
+  const size_t min = (want < LOG_MARK_LEN + LOG_EOL_LEN) ? want : LOG_MARK_LEN + LOG_EOL_LEN;
+  const eMuxChannel ch = console_log_channel();
+  sRingReservation res;
+  char *line = (char *)mux_reserve(ch, min, want, &res);
+  if (line == NULL) {
+    return;
+  }
+
+  size_t text = res.len - LOG_EOL_LEN;
+  const bool truncated = text < (size_t)needed;
+  if (truncated) {
+    text -= LOG_MARK_LEN;
+  }
+
+  // vsnprintf's terminator lands where the mark or EOL goes
+  const int written = vsnprintf(line, text + 1, fmt, *args);
+  if (written >= 0 && (size_t)written < text) {
+    // the arguments changed since they were measured
+    memset(&line[written], ' ', text - written);
+  }
+  if (truncated) {
+    memcpy(&line[text], LOG_TRUNCATED_MARK, LOG_MARK_LEN);
+    text += LOG_MARK_LEN;
+  }
+  memcpy(&line[text], LOG_EOL, LOG_EOL_LEN);
+  mux_commit(ch, &res);
 }
 
 void logp(const char *fmt, ...) 
@@ -29,3 +122,5 @@ void logp(const char *fmt, ...)
   prv_log(fmt, &args);
   va_end(args);
 }
+
+#endif /* LOG_DEFERRED */
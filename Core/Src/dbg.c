@@ -4,66 +4,252 @@
 #include "dbg.h"
 #include "shell.h"
 #include "console.h"
-
-static sFpbUnit *const FPB = (sFpbUnit *)0xE0002000;
+#include "usart.h"
+#include "record.h"
+#include "core_regs.h"
+#include "shell_args.h"
+#include "shell_cmd.h"
+#include "watch.h"
+#include "bkpt.h"
+#include "trace.h"
 
 static eDebugState s_user_requested_debug_state = kDebugState_None;
+// Stepping over a tracepoint, the HALTED event that ends it is quiet too
+static bool s_trace_stepping;
+
+sDebugContext g_debug_context;
+
+#if !HOST_BUILD
+// the store and load multiples in DebugMon_Handler
+_Static_assert(offsetof(sDebugContext, primask) == 32, "DebugMon_Handler layout");
+_Static_assert(offsetof(sDebugContext, exc_return) == 44, "DebugMon_Handler layout");
+#endif
+
+// Where each register lives, a word of the stacked frame or of
+// g_debug_context, so that reads and writes are a table lookup
+typedef struct {
+  const char *name;
+  bool stacked;
+  bool writable;
+  uint8_t word;
+} sDebugRegInfo;
+
+#define FRAME_WORD(_field) (offsetof(sContextStateFrame, _field) / sizeof(uint32_t))
+#define CTX_WORD(_field) (offsetof(sDebugContext, _field) / sizeof(uint32_t))
+
+static const sDebugRegInfo s_reg_info[kDebugReg_Count] = {
+  [kDebugReg_R0] = { "r0", true, true, FRAME_WORD(r0) },
+  [kDebugReg_R1] = { "r1", true, true, FRAME_WORD(r1) },
+  [kDebugReg_R2] = { "r2", true, true, FRAME_WORD(r2) },
+  [kDebugReg_R3] = { "r3", true, true, FRAME_WORD(r3) },
+  [kDebugReg_R4] = { "r4", false, true, CTX_WORD(r4_r11[0]) },
+  [kDebugReg_R5] = { "r5", false, true, CTX_WORD(r4_r11[1]) },
+  [kDebugReg_R6] = { "r6", false, true, CTX_WORD(r4_r11[2]) },
+  [kDebugReg_R7] = { "r7", false, true, CTX_WORD(r4_r11[3]) },
+  [kDebugReg_R8] = { "r8", false, true, CTX_WORD(r4_r11[4]) },
+  [kDebugReg_R9] = { "r9", false, true, CTX_WORD(r4_r11[5]) },
+  [kDebugReg_R10] = { "r10", false, true, CTX_WORD(r4_r11[6]) },
+  [kDebugReg_R11] = { "r11", false, true, CTX_WORD(r4_r11[7]) },
+  [kDebugReg_R12] = { "r12", true, true, FRAME_WORD(r12) },
+  [kDebugReg_Sp] = { "sp", false, false, CTX_WORD(sp) },
+  [kDebugReg_Lr] = { "lr", true, true, FRAME_WORD(lr) },
+  [kDebugReg_Pc] = { "pc", true, true, FRAME_WORD(return_address) },
+  [kDebugReg_Xpsr] = { "xpsr", true, true, FRAME_WORD(xpsr) },
+  [kDebugReg_Primask] = { "primask", false, true, CTX_WORD(primask) },
+  [kDebugReg_Basepri] = { "basepri", false, true, CTX_WORD(basepri) },
+  [kDebugReg_Control] = { "control", false, true, CTX_WORD(control) },
+  [kDebugReg_ExcReturn] = { "exc_return", false, false, CTX_WORD(exc_return) },
+};
+
+static uint32_t *prv_reg_word(eDebugReg reg) {
+  const sDebugRegInfo *info = &s_reg_info[reg];
+  uint32_t *base = info->stacked ? (uint32_t *)g_debug_context.frame
+                                 : (uint32_t *)&g_debug_context;
+  return &base[info->word];
+}
+
+const char *debug_reg_name(eDebugReg reg) {
+  return (reg < kDebugReg_Count) ? s_reg_info[reg].name : NULL;
+}
+
+bool debug_reg_lookup(const char *name, eDebugReg *reg) {
+  for (size_t i = 0; i < kDebugReg_Count; i++) {
+    if (strcmp(s_reg_info[i].name, name) == 0) {
+      *reg = (eDebugReg)i;
+      return true;
+    }
+  }
+  return false;
+}
+
+uint32_t debug_reg_read(eDebugReg reg) {
+  return *prv_reg_word(reg);
+}
+
+bool debug_reg_write(eDebugReg reg, uint32_t value) {
+  if (!s_reg_info[reg].writable) {
+    return false;
+  }
+  *prv_reg_word(reg) = value;
+  return true;
+}
+
+static void prv_dump_regs(void) {
+  for (size_t i = 0; i < kDebugReg_Count; i++) {
+    logp(" %-4s=0x%08x", s_reg_info[i].name, debug_reg_read((eDebugReg)i));
+  }
+}
+
+// `reg`, `reg <name>` or `reg <name> <value>`, typed while the monitor
+// waits for 'c' or 's'
+static void prv_halted_command(char *line) {
+  char *argv[4];
+  int argc = 0;
+  char *p = line;
+  while (argc < (int)ARRAY_SIZE(argv)) {
+    while (*p == ' ' || *p == '\t') {
+      *p++ = '\0';
+    }
+    if (*p == '\0') {
+      break;
+    }
+    argv[argc++] = p;
+    while (*p != '\0' && *p != ' ' && *p != '\t') {
+      p++;
+    }
+  }
+  if (argc == 0) {
+    return;
+  }
+
+  eDebugReg reg;
+  uint32_t value;
+  if (strcmp(argv[0], "reg") != 0 || argc > 3) {
+    logp("Expected 'c', 's' or reg [<name> [<value>]]");
+  } else if (argc == 1) {
+    prv_dump_regs();
+  } else if (!debug_reg_lookup(argv[1], &reg)) {
+    logp("Unknown register '%s'", argv[1]);
+  } else if (argc == 2) {
+    logp(" %-4s=0x%08x", s_reg_info[reg].name, debug_reg_read(reg));
+  } else if (!shell_arg_u32(argv[2], &value)) {
+    logp("Expected a value, not '%s'", argv[2]);
+  } else if (!debug_reg_write(reg, value)) {
+    logp("%s is read-only", s_reg_info[reg].name);
+  } else {
+    logp(" %-4s=0x%08x", s_reg_info[reg].name, value);
+  }
+}
+
+// A tracepoint hit, and the step over it, record and resume without a word
+// on the UART. Returns true if that was all, else leaves the events for the
+// rest of the monitor in dfsr.
+static bool prv_trace_event(sContextStateFrame *frame, uint32_t *dfsr, uint32_t started) {
+  const uint32_t events =
+      *dfsr & (CORE_REG_DFSR_BKPT | CORE_REG_DFSR_HALTED | CORE_REG_DFSR_DWTTRAP);
+  if (events == CORE_REG_DFSR_BKPT && trace_hit(frame, started)) {
+    bkpt_hit(frame->return_address);
+    if (!bkpt_step_begin(frame->return_address)) {
+      fpb_disable();
+    }
+    s_trace_stepping = true;
+    core_reg_modify(CORE_REG_DEMCR, 0, CORE_REG_DEMCR_MON_STEP);
+    core_reg_write(CORE_REG_DFSR, CORE_REG_DFSR_BKPT);
+    return true;
+  }
+  if ((events & CORE_REG_DFSR_HALTED) && s_trace_stepping) {
+    s_trace_stepping = false;
+    fpb_enable();
+    bkpt_step_done();
+    if (s_user_requested_debug_state != kDebugState_SingleStep) {
+      core_reg_modify(CORE_REG_DEMCR, CORE_REG_DEMCR_MON_STEP, 0);
+    }
+    core_reg_write(CORE_REG_DFSR, CORE_REG_DFSR_HALTED);
+    trace_step_done();
+    // a watchpoint the traced instruction hit is reported as any other
+    *dfsr &= ~CORE_REG_DFSR_HALTED;
+    return (events & CORE_REG_DFSR_DWTTRAP) == 0;
+  }
+  return false;
+}
 
 void debug_monitor_handler_c(sContextStateFrame *frame) {
-  volatile uint32_t *demcr = (uint32_t *)0xE000EDFC;
+  const uint32_t started = dwt_cyccnt_read();
+  // r4-r11 and the special registers are in there already, from
+  // DebugMon_Handler. What the code had in sp is above the frame, and the
+  // alignment padding the core may have put above that.
+  g_debug_context.frame = frame;
+  g_debug_context.sp = (uint32_t)(uintptr_t)frame + sizeof(*frame) +
+      ((frame->xpsr & (1 << 9)) ? 4 : 0);
+
+  uint32_t dfsr = core_reg_read(CORE_REG_DFSR);
+  if (prv_trace_event(frame, &dfsr, started)) {
+    return;
+  }
+  const bool is_dwt_dbg_evt = (dfsr & CORE_REG_DFSR_DWTTRAP);
+  const bool is_bkpt_dbg_evt = (dfsr & CORE_REG_DFSR_BKPT);
+  const bool is_halt_dbg_evt = (dfsr & CORE_REG_DFSR_HALTED);
 
-  volatile uint32_t *dfsr = (uint32_t *)0xE000ED30;
-  const uint32_t dfsr_dwt_evt_bitmask = (1 << 2);
-  const uint32_t dfsr_bkpt_evt_bitmask = (1 << 1);
-  const uint32_t dfsr_halt_evt_bitmask = (1 << 0);
-  const bool is_dwt_dbg_evt = (*dfsr & dfsr_dwt_evt_bitmask);
-  const bool is_bkpt_dbg_evt = (*dfsr & dfsr_bkpt_evt_bitmask);
-  const bool is_halt_dbg_evt = (*dfsr & dfsr_halt_evt_bitmask);
+  // We may have interrupted someone in the middle of a log line, don't wait
+  // for them to finish it before our output goes out
+  uart_tx_set_direct(true);
 
   logp("DebugMonitor Exception");
 
-  logp("DEMCR: 0x%08x", *demcr);
-  logp("DFSR:  0x%08x (bkpt=%d, halt=%d, dwt=%d)", *dfsr,
+  logp("DEMCR: 0x%08x", core_reg_read(CORE_REG_DEMCR));
+  logp("DFSR:  0x%08x (bkpt=%d, halt=%d, dwt=%d)", dfsr,
               (int)is_bkpt_dbg_evt, (int)is_halt_dbg_evt,
               (int)is_dwt_dbg_evt);
 
   logp("Register Dump");
-  logp(" r0  =0x%08x", frame->r0);
-  logp(" r1  =0x%08x", frame->r1);
-  logp(" r2  =0x%08x", frame->r2);
-  logp(" r3  =0x%08x", frame->r3);
-  logp(" r12 =0x%08x", frame->r12);
-  logp(" lr  =0x%08x", frame->lr);
-  logp(" pc  =0x%08x", frame->return_address);
-  logp(" xpsr=0x%08x", frame->xpsr);
+  prv_dump_regs();
+
+  if (is_bkpt_dbg_evt) {
+    const int id = bkpt_hit(frame->return_address);
+    if (id >= 0) {
+      logp("Breakpoint %d hit at 0x%x", id, frame->return_address);
+    }
+  }
+  if (is_dwt_dbg_evt) {
+    watch_report_hits(frame);
+  }
 
   if (is_dwt_dbg_evt || is_bkpt_dbg_evt ||
       (s_user_requested_debug_state == kDebugState_SingleStep))  {
     logp("Debug Event Detected, Awaiting 'c' or 's'");
+    // anything else is collected into a line for prv_halted_command()
+    char line[48];
+    size_t len = 0;
     while (1) {
       char c;
       if (!shell_getchar(&c)) {
         continue;
       }
 
-      logp("Got char '%c'!\n", c);
-      if (c == 'c') { // 'c' == 'continue'
-        s_user_requested_debug_state = kDebugState_None;
-        break;
-      } else if (c == 's') { // 's' == 'single step'
-        s_user_requested_debug_state = kDebugState_SingleStep;
+      if (len == 0 && (c == 'c' || c == 's')) {
+        logp("Got char '%c'!\n", c);
+        // 'c' == 'continue', 's' == 'single step'
+        s_user_requested_debug_state =
+            (c == 's') ? kDebugState_SingleStep : kDebugState_None;
         break;
+      } else if (c == '\r' || c == '\n') {
+        line[len] = '\0';
+        prv_halted_command(line);
+        len = 0;
+      } else if (len < sizeof(line) - 1) {
+        line[len++] = c;
       }
     }
   } else {
     logp("Resuming ...");
   }
 
-  const uint32_t demcr_single_step_mask = (1 << 18);
-
   if (is_bkpt_dbg_evt) {
     const uint16_t instruction = *(uint16_t*)frame->return_address;
-    if ((instruction & 0xff00) == 0xbe00) {
+    if (bkpt_step_begin(frame->return_address)) {
+      // A software breakpoint, the original instruction is back for the step
+      logp("Single-Stepping over software breakpoint at 0x%x", frame->return_address);
+    } else if ((instruction & 0xff00) == 0xbe00) {
       // advance past breakpoint instruction
       frame->return_address += sizeof(instruction);
     } else {
@@ -78,42 +264,54 @@ void debug_monitor_handler_c(sContextStateFrame *frame) {
     // once we return from the exception and a single
     // instruction has been executed. The HALTED bit
     // will be set in the DFSR when this happens.
-    *demcr |= (demcr_single_step_mask);
+    core_reg_modify(CORE_REG_DEMCR, 0, CORE_REG_DEMCR_MON_STEP);
     // We have serviced the breakpoint event so clear mask
-    *dfsr = dfsr_bkpt_evt_bitmask;
+    core_reg_write(CORE_REG_DFSR, CORE_REG_DFSR_BKPT);
   } else if (is_halt_dbg_evt) {
     // re-enable FPB in case we got here via single-step
-    // for a BKPT debug event
+    // for a BKPT debug event, and patch a software breakpoint back in
     fpb_enable();
+    bkpt_step_done();
 
     if (s_user_requested_debug_state != kDebugState_SingleStep) {
-      *demcr &= ~(demcr_single_step_mask);
+      core_reg_modify(CORE_REG_DEMCR, CORE_REG_DEMCR_MON_STEP, 0);
     }
 
     // We have serviced the single step event so clear mask
-    *dfsr = dfsr_halt_evt_bitmask;
-  } else if (is_dwt_dbg_evt) {
-    // Future exercise: handle DWT debug events
-    *dfsr = dfsr_dwt_evt_bitmask;
+    core_reg_write(CORE_REG_DFSR, CORE_REG_DFSR_HALTED);
+  }
+
+  if (is_dwt_dbg_evt) {
+    // reported above, the core carries on after the access
+    core_reg_write(CORE_REG_DFSR, CORE_REG_DFSR_DWTTRAP);
   }
+
+  uart_tx_set_direct(false);
 }
 
 static void prv_enable(bool do_enable) {
-  volatile uint32_t *demcr = (uint32_t *)0xE000EDFC;
-  const uint32_t mon_en_bit = 16;
   if (do_enable) {
     // clear any stale state in the DFSR
-    volatile uint32_t *dfsr = (uint32_t*)0xE000ED30;
-    *dfsr = *dfsr;
-    *demcr |= 1 << mon_en_bit;
+    core_reg_write(CORE_REG_DFSR, core_reg_read(CORE_REG_DFSR));
+    core_reg_modify(CORE_REG_DEMCR, 0, CORE_REG_DEMCR_MON_EN);
   } else {
-    *demcr &= ~(1 << mon_en_bit);
+    core_reg_modify(CORE_REG_DEMCR, CORE_REG_DEMCR_MON_EN, 0);
   }
 }
 
+void dwt_cyccnt_enable(void) {
+  const uint32_t dwt_ctrl_cyccntena = (1 << 0);
+
+  core_reg_modify(CORE_REG_DEMCR, 0, CORE_REG_DEMCR_TRCENA);
+  core_reg_modify(CORE_REG_DWT_CTRL, 0, dwt_ctrl_cyccntena);
+}
+
+uint32_t dwt_cyccnt_read(void) {
+  return core_reg_read(CORE_REG_DWT_CYCCNT);
+}
+
 static bool prv_halting_debug_enabled(void) {
-  volatile uint32_t *dhcsr = (uint32_t *)0xE000EDF0;
-  return (((*dhcsr) & 0x1) != 0);
+  return ((core_reg_read(CORE_REG_DHCSR) & 0x1) != 0);
 }
 
 bool debug_monitor_enable(void) {
@@ -127,9 +325,9 @@ bool debug_monitor_enable(void) {
 
   // Priority for DebugMonitor Exception is bits[7:0].
   // We will use the lowest priority so other ISRs can
-  // fire while in the DebugMonitor Interrupt
-  volatile uint32_t *shpr3 = (uint32_t *)0xE000ED20;
-  *shpr3 = 0xff;
+  // fire while in the DebugMonitor Interrupt. The upper bytes hold the
+  // PendSV and SysTick priorities, which the scheduler relies on.
+  core_reg_modify(CORE_REG_SHPR3, 0xff, 0xff);
 
   logp("Monitor Mode Debug Enabled!");
   return true;
@@ -141,17 +339,20 @@ bool debug_monitor_disable(void) {
 }
 
 void fpb_dump_breakpoint_config(void) {
-  const uint32_t fp_ctrl = FPB->FP_CTRL;
+  const uint32_t fp_ctrl = core_reg_read(CORE_REG_FP_CTRL);
   const uint32_t fpb_enabled = fp_ctrl & 0x1;
   const uint32_t revision = (fp_ctrl >> 28) & 0xF;
   const uint32_t num_code_comparators =
       (((fp_ctrl >> 12) & 0x7) << 4) | ((fp_ctrl >> 4) & 0xF);
 
-  logp("FPB Revision: %d, Enabled: %d, Hardware Breakpoints: %d",
-              revision, (int)fpb_enabled, (int)num_code_comparators);
+  record_begin("fpb");
+  record_u32("revision", revision);
+  record_bool("enabled", fpb_enabled);
+  record_u32("comparators", num_code_comparators);
+  record_end();
 
   for (size_t i = 0; i < num_code_comparators; i++) {
-    const uint32_t fp_comp = FPB->FP_COMP[i];
+    const uint32_t fp_comp = core_reg_read(CORE_REG_FP_COMP(i));
     const bool enabled = fp_comp & 0x1;
     const uint32_t replace = fp_comp >> 30;
 
@@ -160,22 +361,26 @@ void fpb_dump_breakpoint_config(void) {
       instruction_address |= 0x2;
     }
 
-    logp("  FP_COMP[%d] Enabled %d, Replace: %d, Address 0x%x",
-                (int)i, (int)enabled, (int)replace, instruction_address);
+    record_begin("fp_comp");
+    record_u32("id", i);
+    record_bool("enabled", enabled);
+    record_u32("replace", replace);
+    record_hex("addr", instruction_address);
+    record_end();
   }
 }
 
 
 void fpb_disable(void) {
-  FPB->FP_CTRL = (FPB->FP_CTRL & ~0x3) | 0x2;
+  core_reg_modify(CORE_REG_FP_CTRL, 0x3, 0x2);
 }
 
 void fpb_enable(void) {
-  FPB->FP_CTRL |= 0x3;
+  core_reg_modify(CORE_REG_FP_CTRL, 0, 0x3);
 }
 
 void fpb_get_config(sFpbConfig *config) {
-  uint32_t fp_ctrl = FPB->FP_CTRL;
+  uint32_t fp_ctrl = core_reg_read(CORE_REG_FP_CTRL);
 
   const uint32_t enabled = fp_ctrl & 0x1;
   const uint32_t revision = (fp_ctrl >> 28) & 0xF;
@@ -218,7 +423,19 @@ bool fpb_set_breakpoint(size_t comp_id, uint32_t instr_addr) {
 
   const uint32_t replace = (instr_addr & 0x2) == 0 ? 1 : 2;
   const uint32_t fp_comp = (instr_addr & ~0x3) | 0x1 | (replace << 30);
-  FPB->FP_COMP[comp_id] = fp_comp;
+  core_reg_write(CORE_REG_FP_COMP(comp_id), fp_comp);
+  return true;
+}
+
+bool fpb_clear_breakpoint(size_t comp_id) {
+  sFpbConfig config;
+  fpb_get_config(&config);
+  if (comp_id >= config.num_code_comparators) {
+    logp("Instruction Comparator %d Not Implemented", (int)comp_id);
+    return false;
+  }
+
+  core_reg_write(CORE_REG_FP_COMP(comp_id), 0);
   return true;
 }
 
@@ -236,7 +453,7 @@ bool fpb_get_comp_config(size_t comp_id, sFpbCompConfig *comp_config) {
     return false;
   }
 
-  uint32_t fp_comp = FPB->FP_COMP[comp_id];
+  uint32_t fp_comp = core_reg_read(CORE_REG_FP_COMP(comp_id));
   bool enabled = fp_comp & 0x1;
   uint32_t replace = fp_comp >> 30;
 
@@ -0,0 +1,555 @@
+#include <string.h>
+#include "dbg_proto.h"
+#include "dbg.h"
+#include "usart.h"
+#include "mux.h"
+#include "sched.h"
+#include "console.h"
+#include "core_regs.h"
+
+// seq + cmd/status + payload + crc
+#define DBG_PROTO_MAX_PACKET (3 + DBG_PROTO_MAX_PAYLOAD + 2)
+#define DBG_PROTO_MAX_ENCODED (DBG_PROTO_MAX_PACKET + DBG_PROTO_MAX_PACKET / 254 + 1)
+// leaves room for the offset word in streamed frames
+#define DBG_PROTO_STREAM_CHUNK (DBG_PROTO_MAX_PAYLOAD - 4)
+
+typedef enum {
+  kRxState_Idle,
+  kRxState_Frame,
+  //! frame overflowed, throw bytes away until the closing delimiter
+  kRxState_Discard,
+} eRxState;
+
+static struct {
+  eRxState state;
+  size_t len;
+  uint8_t buf[DBG_PROTO_MAX_ENCODED];
+} s_rx;
+
+// set while a new baud rate waits for the host's Ping
+static bool s_baud_confirm_pending;
+// the rate to go back to if the Ping doesn't come
+static uint32_t s_baud_old;
+
+// MemRead goes through here, the PPB can't be sent from where it is
+static uint8_t s_read_buf[DBG_PROTO_MAX_PAYLOAD];
+
+static uint8_t s_tx_packet[DBG_PROTO_MAX_PACKET];
+// two delimiters around the encoded packet
+static uint8_t s_tx_frame[DBG_PROTO_MAX_ENCODED + 2];
+
+uint16_t dbg_proto_crc16(uint16_t crc, const void *data, size_t len) {
+  // nibble table keeps flash use low while avoiding 8 shifts per byte
+  static const uint16_t s_table[16] = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+    0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
+  };
+  const uint8_t *p = data;
+  while (len--) {
+    crc = (crc << 4) ^ s_table[(crc >> 12) ^ (*p >> 4)];
+    crc = (crc << 4) ^ s_table[(crc >> 12) ^ (*p & 0x0f)];
+    p++;
+  }
+  return crc;
+}
+
+size_t dbg_proto_cobs_encode(const uint8_t *in, size_t len, uint8_t *out) {
+  size_t code_idx = 0;
+  size_t out_idx = 1;
+  uint8_t code = 1;
+
+  for (size_t i = 0; i < len; i++) {
+    if (in[i] != 0) {
+      out[out_idx++] = in[i];
+      code++;
+    }
+    if (in[i] == 0 || code == 0xff) {
+      out[code_idx] = code;
+      code_idx = out_idx++;
+      code = 1;
+    }
+  }
+  out[code_idx] = code;
+  return out_idx;
+}
+
+size_t dbg_proto_cobs_decode(uint8_t *buf, size_t len) {
+  size_t in_idx = 0;
+  size_t out_idx = 0;
+
+  while (in_idx < len) {
+    const uint8_t code = buf[in_idx++];
+    if (code == 0 || in_idx + code - 1 > len) {
+      return 0;
+    }
+    for (uint8_t i = 1; i < code; i++) {
+      buf[out_idx++] = buf[in_idx++];
+    }
+    if (code != 0xff && in_idx < len) {
+      buf[out_idx++] = 0;
+    }
+  }
+  return out_idx;
+}
+
+// Builds 0x00 COBS(seq cmd status payload crc) 0x00 in frame, which must hold
+// DBG_PROTO_FRAME_SIZE(len) bytes, using packet as scratch space
+#define DBG_PROTO_FRAME_SIZE(_len) ((_len) + 5 + ((_len) + 5) / 254 + 1 + 2)
+
+static size_t prv_build_frame(uint8_t *frame, uint8_t *packet, uint8_t seq,
+                              uint8_t cmd, uint8_t status, const void *payload,
+                              size_t len) {
+  packet[0] = seq;
+  packet[1] = cmd | DBG_PROTO_RESPONSE_FLAG;
+  packet[2] = status;
+  memcpy(&packet[3], payload, len);
+  const uint16_t crc = dbg_proto_crc16(0xffff, packet, len + 3);
+  packet[len + 3] = crc & 0xff;
+  packet[len + 4] = crc >> 8;
+
+  frame[0] = 0;
+  const size_t encoded = dbg_proto_cobs_encode(packet, len + 5, &frame[1]);
+  frame[encoded + 1] = 0;
+  return encoded + 2;
+}
+
+void dbg_proto_send(uint8_t seq, uint8_t cmd, eDbgProtoStatus status,
+                    const void *payload, size_t len) {
+  if (len > DBG_PROTO_MAX_PAYLOAD) {
+    len = DBG_PROTO_MAX_PAYLOAD;
+  }
+
+  const size_t frame_len = prv_build_frame(s_tx_frame, s_tx_packet, seq, cmd,
+                                           status, payload, len);
+  mux_write(kMuxChannel_Bulk, s_tx_frame, frame_len);
+}
+
+void dbg_proto_send_event(eDbgProtoEvt evt, const void *payload, size_t len) {
+  if (len > DBG_PROTO_MAX_EVENT_PAYLOAD) {
+    len = DBG_PROTO_MAX_EVENT_PAYLOAD;
+  }
+
+  uint8_t packet[DBG_PROTO_MAX_EVENT_PAYLOAD + 5];
+  uint8_t frame[DBG_PROTO_FRAME_SIZE(DBG_PROTO_MAX_EVENT_PAYLOAD)];
+  const size_t frame_len = prv_build_frame(frame, packet, 0, evt,
+                                           kDbgProtoStatus_Ok, payload, len);
+  mux_write(console_log_channel(), frame, frame_len);
+}
+
+void dbg_proto_send_event_large(eDbgProtoEvt evt, const void *payload, size_t len) {
+  if (len > DBG_PROTO_MAX_PAYLOAD) {
+    len = DBG_PROTO_MAX_PAYLOAD;
+  }
+
+  const size_t frame_len = prv_build_frame(s_tx_frame, s_tx_packet, 0, evt,
+                                           kDbgProtoStatus_Ok, payload, len);
+  mux_write(console_log_channel(), s_tx_frame, frame_len);
+}
+
+static uint32_t prv_get_u32(const uint8_t *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint16_t prv_get_u16(const uint8_t *p) {
+  return p[0] | (p[1] << 8);
+}
+
+#if HOST_BUILD
+// a host process only has its own variables to offer
+static bool prv_host_vars(uint32_t addr, uint32_t len) {
+  extern uint32_t _sdata, _ebss;
+  const uint32_t start = (uint32_t)(uintptr_t)&_sdata;
+  const uint32_t end = (uint32_t)(uintptr_t)&_ebss;
+  return addr >= start && addr < end && len <= end - addr;
+}
+#else
+typedef struct {
+  uint32_t start;
+  uint32_t end;
+} sMemRegion;
+
+static bool prv_in_regions(const sMemRegion *regions, size_t count, uint32_t addr,
+                           uint32_t len) {
+  for (size_t i = 0; i < count; i++) {
+    if (addr >= regions[i].start && addr < regions[i].end &&
+        len <= regions[i].end - addr) {
+      return true;
+    }
+  }
+  return false;
+}
+#endif
+
+// Only let the host touch memory that exists so a typo doesn't end in a
+// BusFault
+bool dbg_proto_access_ok(uint32_t addr, uint32_t len) {
+#if HOST_BUILD
+  return prv_host_vars(addr, len);
+#else
+  static const sMemRegion s_regions[] = {
+#if QEMU_BUILD
+    // mps2-an385, laid out like the board, see Qemu/mps2_an385.ld
+    { 0x00000000, 0x00040000 }, // flash
+    { 0x20000000, 0x2000C000 }, // SRAM
+    { 0x40000000, 0x40010000 }, // APB peripherals
+    { 0xE000E000, 0xE000F000 }, // system control space
+#else
+    { 0x08000000, 0x08040000 }, // flash
+    { 0x1FFFF000, 0x1FFFF810 }, // system memory + option bytes
+    { 0x20000000, 0x2000C000 }, // SRAM
+    { 0x40000000, 0x40024400 }, // peripherals
+    // the PPB only where something answers, its holes BusFault
+    { 0xE0000000, 0xE0003000 }, // ITM, DWT, FPB
+    { 0xE000E000, 0xE000F000 }, // system control space
+    { 0xE0042000, 0xE0042008 }, // DBGMCU
+    { 0xE00FF000, 0xE0100000 }, // ROM table
+#endif
+  };
+  return prv_in_regions(s_regions, sizeof(s_regions) / sizeof(s_regions[0]), addr, len);
+#endif
+}
+
+// Flash only takes writes through its controller, a plain store there
+// BusFaults. The PPB goes through core_reg_write(), see prv_mem_write().
+bool dbg_proto_write_ok(uint32_t addr, uint32_t len) {
+#if HOST_BUILD
+  return prv_host_vars(addr, len);
+#else
+  static const sMemRegion s_regions[] = {
+#if QEMU_BUILD
+    { 0x20000000, 0x2000C000 }, // SRAM
+    { 0x40000000, 0x40010000 }, // APB peripherals
+#else
+    { 0x20000000, 0x2000C000 }, // SRAM
+    { 0x40000000, 0x40024400 }, // peripherals
+#endif
+  };
+  return prv_in_regions(s_regions, sizeof(s_regions) / sizeof(s_regions[0]), addr, len);
+#endif
+}
+
+// Whole words of core registers. They are simulated in the host and QEMU
+// builds, so the whole PPB is accepted there even where it isn't memory.
+static bool prv_ppb_ok(uint32_t addr, uint32_t len) {
+  if ((addr & 0x3) != 0 || (len & 0x3) != 0) {
+    return false;
+  }
+#if HOST_BUILD || QEMU_BUILD
+  return core_reg_is_ppb(addr) && len <= 0xE0100000 - addr;
+#else
+  return dbg_proto_access_ok(addr, len);
+#endif
+}
+
+static bool prv_reg_ok(uint32_t addr) {
+  return core_reg_is_ppb(addr) ? prv_ppb_ok(addr, 4) :
+      ((addr & 0x3) == 0 && dbg_proto_access_ok(addr, 4));
+}
+
+bool dbg_proto_read_ok(uint32_t addr, uint32_t len) {
+  return core_reg_is_ppb(addr) ? prv_ppb_ok(addr, len) : dbg_proto_access_ok(addr, len);
+}
+
+bool dbg_proto_mem_read(void *dst, uint32_t addr, uint32_t len) {
+  if (!dbg_proto_read_ok(addr, len)) {
+    return false;
+  }
+  if (core_reg_is_ppb(addr)) {
+    uint8_t *out = dst;
+    for (uint32_t off = 0; off < len; off += 4) {
+      const uint32_t word = core_reg_read(addr + off);
+      memcpy(&out[off], &word, sizeof(word));
+    }
+  } else {
+    memcpy(dst, (const void *)addr, len);
+  }
+  return true;
+}
+
+// Words into the PPB, or bytes anywhere dbg_proto_write_ok() allows
+static bool prv_mem_write(uint32_t addr, const uint8_t *data, uint32_t len) {
+  if (core_reg_is_ppb(addr)) {
+    if (!prv_ppb_ok(addr, len)) {
+      return false;
+    }
+    for (uint32_t off = 0; off < len; off += 4) {
+      core_reg_write(addr + off, prv_get_u32(&data[off]));
+    }
+    return true;
+  }
+  if (!dbg_proto_write_ok(addr, len)) {
+    return false;
+  }
+  memcpy((void *)addr, data, len);
+  return true;
+}
+
+// A stream goes out one chunk per dispatch of its task, so frames and shell
+// input that arrive meanwhile are handled between chunks
+static struct {
+  bool active;
+  uint8_t seq;
+  uint32_t addr;
+  uint32_t len;
+  uint32_t offset;
+} s_stream;
+
+#define DBG_PROTO_EVENT_STREAM (1 << 0)
+#define DBG_PROTO_EVENT_BAUD_TIMEOUT (1 << 1)
+
+static void prv_stream_handler(uint32_t events, void *ctx);
+
+// Also falls back to the old baud rate when SetBaud isn't confirmed
+static sSchedTask s_stream_task = {
+  .name = "stream",
+  .handler = prv_stream_handler,
+  .prio = 0,
+};
+
+static sSchedTimer s_baud_timer = {
+  .task = &s_stream_task,
+  .events = DBG_PROTO_EVENT_BAUD_TIMEOUT,
+};
+
+static void prv_stream_handler(uint32_t events, void *ctx) {
+  if ((events & DBG_PROTO_EVENT_BAUD_TIMEOUT) && s_baud_confirm_pending) {
+    s_baud_confirm_pending = false;
+    uart_set_baud(s_baud_old);
+  }
+  if ((events & DBG_PROTO_EVENT_STREAM) == 0 || !s_stream.active) {
+    return;
+  }
+  if (s_stream.offset >= s_stream.len) {
+    s_stream.active = false;
+    dbg_proto_send(s_stream.seq, kDbgProtoCmd_MemStream, kDbgProtoStatus_Ok, NULL, 0);
+    return;
+  }
+
+  uint8_t chunk[4 + DBG_PROTO_STREAM_CHUNK];
+  const uint32_t offset = s_stream.offset;
+  const uint32_t n = (s_stream.len - offset < DBG_PROTO_STREAM_CHUNK) ?
+      s_stream.len - offset : DBG_PROTO_STREAM_CHUNK;
+  memcpy(chunk, &offset, sizeof(offset));
+  // checked when the stream started, and the chunks keep PPB reads whole words
+  dbg_proto_mem_read(&chunk[4], s_stream.addr + offset, n);
+  dbg_proto_send(s_stream.seq, kDbgProtoCmd_MemStream, kDbgProtoStatus_More,
+                 chunk, n + 4);
+  s_stream.offset += n;
+  sched_post(&s_stream_task, DBG_PROTO_EVENT_STREAM);
+}
+
+static eDbgProtoStatus prv_mem_stream(uint8_t seq, uint32_t addr, uint32_t len) {
+  if (len == 0) {
+    // cancels the stream in progress, which then never sends its final frame
+    s_stream.active = false;
+    return kDbgProtoStatus_Ok;
+  }
+  if (s_stream.active) {
+    return kDbgProtoStatus_Failed;
+  }
+  s_stream.seq = seq;
+  s_stream.addr = addr;
+  s_stream.len = len;
+  s_stream.offset = 0;
+  s_stream.active = true;
+  sched_post(&s_stream_task, DBG_PROTO_EVENT_STREAM);
+  return kDbgProtoStatus_More;
+}
+
+void dbg_proto_init(void) {
+  sched_task_add(&s_stream_task);
+}
+
+static void prv_set_baud(uint8_t seq, uint32_t baud) {
+  if (baud == 0) {
+    baud = uart_get_max_baud();
+  }
+  if (baud < uart_get_min_baud() || baud > uart_get_max_baud()) {
+    dbg_proto_send(seq, kDbgProtoCmd_SetBaud, kDbgProtoStatus_Failed, NULL, 0);
+    return;
+  }
+
+  const uint32_t reply[2] = { baud, UART_BAUD_CONFIRM_TIMEOUT_MS };
+  dbg_proto_send(seq, kDbgProtoCmd_SetBaud, kDbgProtoStatus_Ok, reply, sizeof(reply));
+  s_baud_old = uart_get_baud();
+  uart_set_baud(baud);
+
+  // Until the host proves the link works by getting a Ping through at the
+  // new rate every other frame is dropped, see prv_dispatch(). The timer
+  // falls back if it doesn't, the shell and the other tasks run meanwhile.
+  s_baud_confirm_pending = true;
+  sched_timer_start(&s_baud_timer, UART_BAUD_CONFIRM_TIMEOUT_MS);
+}
+
+static void prv_dispatch(uint8_t seq, uint8_t cmd, uint8_t *payload, size_t len) {
+  eDbgProtoStatus status = kDbgProtoStatus_Ok;
+  const void *reply = NULL;
+  size_t reply_len = 0;
+  uint32_t word;
+
+  if (s_baud_confirm_pending && cmd != kDbgProtoCmd_Ping) {
+    return;
+  }
+
+  switch (cmd) {
+    case kDbgProtoCmd_Ping: {
+      if (s_baud_confirm_pending) {
+        s_baud_confirm_pending = false;
+        sched_timer_stop(&s_baud_timer);
+      }
+      static const uint8_t s_info[] = {
+        DBG_PROTO_VERSION, DBG_PROTO_MAX_PAYLOAD & 0xff, DBG_PROTO_MAX_PAYLOAD >> 8,
+      };
+      reply = s_info;
+      reply_len = sizeof(s_info);
+      break;
+    }
+    case kDbgProtoCmd_MemRead: {
+      if (len != 6) {
+        status = kDbgProtoStatus_BadLength;
+        break;
+      }
+      const uint32_t addr = prv_get_u32(payload);
+      const uint16_t n = prv_get_u16(&payload[4]);
+      if (n > DBG_PROTO_MAX_PAYLOAD) {
+        status = kDbgProtoStatus_BadLength;
+      } else if (!dbg_proto_mem_read(s_read_buf, addr, n)) {
+        status = kDbgProtoStatus_BadAddress;
+      } else {
+        reply = s_read_buf;
+        reply_len = n;
+      }
+      break;
+    }
+    case kDbgProtoCmd_MemWrite: {
+      if (len < 4) {
+        status = kDbgProtoStatus_BadLength;
+        break;
+      }
+      const uint32_t addr = prv_get_u32(payload);
+      if (!prv_mem_write(addr, &payload[4], len - 4)) {
+        status = kDbgProtoStatus_BadAddress;
+      }
+      break;
+    }
+    case kDbgProtoCmd_RegRead: {
+      const uint32_t addr = (len == 4) ? prv_get_u32(payload) : 0;
+      if (len != 4) {
+        status = kDbgProtoStatus_BadLength;
+      } else if (!prv_reg_ok(addr)) {
+        status = kDbgProtoStatus_BadAddress;
+      } else {
+        word = core_reg_read(addr);
+        reply = &word;
+        reply_len = sizeof(word);
+      }
+      break;
+    }
+    case kDbgProtoCmd_RegWrite: {
+      const uint32_t addr = (len == 8) ? prv_get_u32(payload) : 0;
+      if (len != 8) {
+        status = kDbgProtoStatus_BadLength;
+      } else if (!prv_reg_ok(addr)) {
+        status = kDbgProtoStatus_BadAddress;
+      } else {
+        core_reg_write(addr, prv_get_u32(&payload[4]));
+      }
+      break;
+    }
+    case kDbgProtoCmd_BkptSet:
+      if (len != 5) {
+        status = kDbgProtoStatus_BadLength;
+      } else if (!fpb_set_breakpoint(payload[0], prv_get_u32(&payload[1]))) {
+        status = kDbgProtoStatus_Failed;
+      }
+      break;
+    case kDbgProtoCmd_BkptClear:
+      if (len != 1) {
+        status = kDbgProtoStatus_BadLength;
+      } else if (!fpb_clear_breakpoint(payload[0])) {
+        status = kDbgProtoStatus_Failed;
+      }
+      break;
+    case kDbgProtoCmd_MemStream: {
+      if (len != 8) {
+        status = kDbgProtoStatus_BadLength;
+        break;
+      }
+      const uint32_t addr = prv_get_u32(payload);
+      const uint32_t n = prv_get_u32(&payload[4]);
+      if (!dbg_proto_read_ok(addr, n)) {
+        status = kDbgProtoStatus_BadAddress;
+        break;
+      }
+      status = prv_mem_stream(seq, addr, n);
+      if (status == kDbgProtoStatus_More) {
+        return; // the stream task answers
+      }
+      break;
+    }
+    case kDbgProtoCmd_SetBaud:
+      if (len != 4) {
+        status = kDbgProtoStatus_BadLength;
+        break;
+      }
+      prv_set_baud(seq, prv_get_u32(payload));
+      return;
+    default:
+      status = kDbgProtoStatus_UnknownCmd;
+      break;
+  }
+
+  dbg_proto_send(seq, cmd, status, reply, reply_len);
+}
+
+static void prv_process_frame(void) {
+  const size_t len = dbg_proto_cobs_decode(s_rx.buf, s_rx.len);
+  if (len < 4) {
+    return; // too short to even carry a sequence number
+  }
+
+  const uint8_t seq = s_rx.buf[0];
+  const uint8_t cmd = s_rx.buf[1];
+  const uint16_t crc = prv_get_u16(&s_rx.buf[len - 2]);
+  if (dbg_proto_crc16(0xffff, s_rx.buf, len - 2) != crc) {
+    dbg_proto_send(seq, cmd, kDbgProtoStatus_BadCrc, NULL, 0);
+    return;
+  }
+
+  prv_dispatch(seq, cmd, &s_rx.buf[2], len - 4);
+}
+
+bool dbg_proto_receive_char(uint8_t c) {
+  switch (s_rx.state) {
+    case kRxState_Idle:
+      if (c != 0) {
+        return false;
+      }
+      s_rx.state = kRxState_Frame;
+      s_rx.len = 0;
+      return true;
+    case kRxState_Frame:
+      if (c != 0) {
+        if (s_rx.len < sizeof(s_rx.buf)) {
+          s_rx.buf[s_rx.len++] = c;
+        } else {
+          s_rx.state = kRxState_Discard;
+        }
+        return true;
+      }
+      if (s_rx.len == 0) {
+        return true; // back to back delimiters, still waiting for the frame
+      }
+      // frames may be received while this one is being handled, see
+      // prv_set_baud()
+      s_rx.state = kRxState_Idle;
+      prv_process_frame();
+      return true;
+    case kRxState_Discard:
+    default:
+      if (c == 0) {
+        s_rx.state = kRxState_Idle;
+      }
+      return true;
+  }
+}
@@ -0,0 +1,266 @@
+#include "macro.h"
+#include "main.h"
+#include "console.h"
+#include "shell_cmd.h"
+#include "record.h"
+#include <string.h>
+
+// Defined by the linker script, one erasable page nothing else is linked into
+extern const uint8_t __macro_flash_start[];
+extern const uint8_t __macro_flash_end[];
+
+#define MACRO_ERASED (0xFFFFu)
+
+// Records follow each other from the start of the page, each one holding the
+// name and then the NUL terminated body, padded to a halfword. The first
+// size of MACRO_ERASED marks the free space. Deleting a record only clears
+// its live halfword: programming 0x0000 over a programmed halfword is the
+// one write the flash allows without an erase.
+typedef struct __attribute__((packed)) {
+  uint16_t size;
+  uint16_t live;
+  uint8_t flags;
+  uint8_t name_len;
+  char data[];
+} sMacroRecord;
+
+#define MACRO_RECORD_MAX \
+  ((sizeof(sMacroRecord) + MACRO_NAME_MAX + MACRO_BODY_MAX + 2) & ~1u)
+
+static const sMacroRecord *prv_first(void)
+{
+  return (const sMacroRecord *)__macro_flash_start;
+}
+
+// NULL at the free space or the end of the page
+static const sMacroRecord *prv_next(const sMacroRecord *rec)
+{
+  const uint8_t *next = (const uint8_t *)rec + rec->size;
+  return (next < __macro_flash_end) ? (const sMacroRecord *)next : NULL;
+}
+
+static bool prv_valid(const sMacroRecord *rec)
+{
+  const size_t left = (size_t)(__macro_flash_end - (const uint8_t *)rec);
+  return left >= sizeof(sMacroRecord) && rec->size != MACRO_ERASED &&
+      rec->size >= sizeof(sMacroRecord) && rec->size <= left;
+}
+
+#define MACRO_FOR_EACH(rec) \
+  for (const sMacroRecord *rec = prv_first(); rec != NULL && prv_valid(rec); \
+       rec = prv_next(rec))
+
+static const char *prv_body(const sMacroRecord *rec)
+{
+  return &rec->data[rec->name_len];
+}
+
+static const sMacroRecord *prv_find(const char *name)
+{
+  const size_t len = strlen(name);
+  MACRO_FOR_EACH(rec) {
+    if (rec->live != 0 && rec->name_len == len &&
+        memcmp(rec->data, name, len) == 0) {
+      return rec;
+    }
+  }
+  return NULL;
+}
+
+// Where the next record goes
+static uint8_t *prv_free_space(void)
+{
+  const uint8_t *end = __macro_flash_start;
+  MACRO_FOR_EACH(rec) {
+    end = (const uint8_t *)rec + rec->size;
+  }
+  return (uint8_t *)end;
+}
+
+const char *macro_find(const char *name, uint8_t *flags)
+{
+  const sMacroRecord *rec = prv_find(name);
+  if (rec == NULL) {
+    return NULL;
+  }
+  if (flags != NULL) {
+    *flags = rec->flags;
+  }
+  return prv_body(rec);
+}
+
+const char *macro_find_boot(const char **name)
+{
+  static char s_name[MACRO_NAME_MAX + 1];
+  MACRO_FOR_EACH(rec) {
+    if (rec->live != 0 && (rec->flags & MACRO_FLAG_BOOT)) {
+      memcpy(s_name, rec->data, rec->name_len);
+      s_name[rec->name_len] = '\0';
+      *name = s_name;
+      return prv_body(rec);
+    }
+  }
+  return NULL;
+}
+
+/* Flash ---------------------------------------------------------------------*/
+
+// len is even
+static bool prv_program(const uint8_t *dst, const void *src, size_t len)
+{
+  const uint8_t *bytes = src;
+  bool ok = true;
+  HAL_FLASH_Unlock();
+  for (size_t i = 0; i < len && ok; i += 2) {
+    const uint16_t halfword = (uint16_t)(bytes[i] | (bytes[i + 1] << 8));
+    ok = HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, (uint32_t)&dst[i],
+                           halfword) == HAL_OK;
+  }
+  HAL_FLASH_Lock();
+  return ok;
+}
+
+static bool prv_erase(void)
+{
+  FLASH_EraseInitTypeDef erase = {
+    .TypeErase = FLASH_TYPEERASE_PAGES,
+    .PageAddress = (uint32_t)__macro_flash_start,
+    .NbPages = 1,
+  };
+  uint32_t page_error;
+  HAL_FLASH_Unlock();
+  const bool ok = HAL_FLASHEx_Erase(&erase, &page_error) == HAL_OK;
+  HAL_FLASH_Lock();
+  return ok;
+}
+
+static bool prv_kill(const sMacroRecord *rec)
+{
+  static const uint16_t s_zero = 0;
+  return prv_program((const uint8_t *)&rec->live, &s_zero, sizeof(s_zero));
+}
+
+// Rewrites the page with only the live records but skip, plus extra if not
+// NULL. Nothing is erased unless it all fits.
+static bool prv_compact(const sMacroRecord *extra, const sMacroRecord *skip)
+{
+  static uint8_t s_page[FLASH_PAGE_SIZE];
+  size_t used = 0;
+  MACRO_FOR_EACH(rec) {
+    if (rec->live != 0 && rec != skip) {
+      memcpy(&s_page[used], rec, rec->size);
+      used += rec->size;
+    }
+  }
+  if (extra != NULL) {
+    if (used + extra->size > sizeof(s_page)) {
+      return false;
+    }
+    memcpy(&s_page[used], extra, extra->size);
+    used += extra->size;
+  }
+  return prv_erase() && prv_program(__macro_flash_start, s_page, used);
+}
+
+bool macro_define(const char *name, const char *body, uint8_t flags)
+{
+  const size_t name_len = strlen(name);
+  const size_t body_len = strlen(body);
+  if (name_len == 0 || name_len > MACRO_NAME_MAX || body_len > MACRO_BODY_MAX) {
+    return false;
+  }
+
+  static uint8_t s_buf[MACRO_RECORD_MAX];
+  sMacroRecord *rec = (sMacroRecord *)s_buf;
+  const size_t size = (sizeof(*rec) + name_len + body_len + 2) & ~1u;
+  memset(s_buf, 0, size);
+  rec->size = (uint16_t)size;
+  rec->live = MACRO_ERASED;
+  rec->flags = flags;
+  rec->name_len = (uint8_t)name_len;
+  memcpy(rec->data, name, name_len);
+  memcpy(&rec->data[name_len], body, body_len + 1);
+
+  // the old record stays until the new one is written, compacting leaves it
+  // out of the copy instead
+  const sMacroRecord *old = prv_find(name);
+  uint8_t *free_space = prv_free_space();
+  if ((size_t)(__macro_flash_end - free_space) >= size) {
+    return prv_program(free_space, rec, size) && (old == NULL || prv_kill(old));
+  }
+  return prv_compact(rec, old);
+}
+
+bool macro_delete(const char *name)
+{
+  const sMacroRecord *rec = prv_find(name);
+  return rec != NULL && prv_kill(rec);
+}
+
+/* Shell ---------------------------------------------------------------------*/
+
+static int prv_macro_list(void)
+{
+  size_t used = 0;
+  MACRO_FOR_EACH(rec) {
+    used += rec->size;
+    if (rec->live == 0) {
+      continue;
+    }
+    char name[MACRO_NAME_MAX + 1];
+    memcpy(name, rec->data, rec->name_len);
+    name[rec->name_len] = '\0';
+    record_begin("macro");
+    record_str("name", name);
+    record_bool("boot", (rec->flags & MACRO_FLAG_BOOT) != 0);
+    record_str("body", prv_body(rec));
+    record_end();
+  }
+  record_begin("macro_flash");
+  record_u32("used", used);
+  record_u32("size", __macro_flash_end - __macro_flash_start);
+  record_end();
+  return 0;
+}
+
+static int prv_macro(int argc, char *argv[])
+{
+  if (argc < 2 || strcmp(argv[1], "list") == 0) {
+    return prv_macro_list();
+  }
+
+  const char *op = argv[1];
+  const char *name = (argc > 2) ? argv[2] : "";
+  bool ok = false;
+  if (strcmp(op, "def") == 0 && argc == 4) {
+    if (shell_find_command(name) != NULL) {
+      logp("%s is a command", name);
+      return -1;
+    }
+    uint8_t flags = 0;
+    macro_find(name, &flags);
+    ok = macro_define(name, argv[3], flags);
+  } else if (strcmp(op, "del") == 0 && argc == 3) {
+    ok = macro_delete(name);
+  } else if (strcmp(op, "boot") == 0 && argc == 4) {
+    // a copy, the body moves when the page gets compacted
+    static char s_body[MACRO_BODY_MAX + 1];
+    uint8_t flags;
+    const char *body = macro_find(name, &flags);
+    if (body != NULL) {
+      strcpy(s_body, body);
+      flags = (strcmp(argv[3], "on") == 0) ? (flags | MACRO_FLAG_BOOT) :
+          (flags & ~MACRO_FLAG_BOOT);
+      ok = macro_define(name, s_body, flags);
+    }
+  } else {
+    logp("Expected list | def <name> \"<commands>\" | del <name> | boot <name> on|off");
+    return -1;
+  }
+
+  logp("macro %s %s: %s", op, name, ok ? "ok" : "failed");
+  return ok ? 0 : -1;
+}
+
+SHELL_COMMAND(macro, prv_macro,
+              "Manage command macros kept in flash: list | def <name> \"<commands>\" | del <name> | boot <name> on|off");
@@ -4,6 +4,8 @@
 #include "gpio.h"
 #include "shell.h"
 #include "console.h"
+#include "sampler.h"
+#include "dbg_proto.h"
 
 void SystemClock_Config(void);
 
@@ -39,6 +41,8 @@ int main(void)
 
   logp("==Booted==");
 
+  dbg_proto_init();
+  sampler_init();
   shell_processing_loop();
 }
 
@@ -0,0 +1,377 @@
+#include "mux.h"
+#include "usart.h"
+#include "dbg_proto.h"
+#include "main.h"
+#include <string.h>
+
+#define MUX_SHELL_BUF_SIZE (512)
+#define MUX_LOG_BUF_SIZE (1024)
+#define MUX_TRACE_BUF_SIZE (512)
+#define MUX_BULK_BUF_SIZE (1024)
+
+//! 0x00, COBS of tag + chunk (one code byte per 254), 0x00
+#define MUX_FRAME_SIZE (MUX_CHUNK_MAX + 4)
+
+typedef struct {
+  sRingBuf *ring;
+  eMuxPolicy policy;
+  uint8_t priority;
+  uint8_t weight;
+  //! Bytes this channel may still send in the current round
+  int32_t credit;
+  //! Between the delimiters of a dbg_proto frame, raw mode only
+  bool in_frame;
+  sMuxStats stats;
+} sMuxChannel;
+
+// Any number of producers (thread mode and ISRs) and one consumer per ring,
+// the TXE interrupt. Slack behind each ring keeps reservations contiguous.
+RING_DEFINE_WITH_SLACK(s_shell_ring, MUX_SHELL_BUF_SIZE, MUX_RESERVE_MAX);
+RING_DEFINE_WITH_SLACK(s_log_ring, MUX_LOG_BUF_SIZE, MUX_RESERVE_MAX);
+RING_DEFINE_WITH_SLACK(s_trace_ring, MUX_TRACE_BUF_SIZE, MUX_RESERVE_MAX);
+RING_DEFINE_WITH_SLACK(s_bulk_ring, MUX_BULK_BUF_SIZE, MUX_RESERVE_MAX);
+
+// The shell gets the link as soon as it has something to say, log and trace
+// share what is left 2:1 and bulk transfers fill the gaps
+static sMuxChannel s_channels[kMuxChannel_Count] = {
+  [kMuxChannel_Shell] = { .ring = &s_shell_ring, .policy = kMuxPolicy_Block,
+                          .priority = 2, .weight = 1 },
+  [kMuxChannel_Log] = { .ring = &s_log_ring, .policy = MUX_LOG_POLICY,
+                        .priority = 1, .weight = 2 },
+  [kMuxChannel_Trace] = { .ring = &s_trace_ring, .policy = kMuxPolicy_DropNewest,
+                          .priority = 1, .weight = 1 },
+  [kMuxChannel_Bulk] = { .ring = &s_bulk_ring, .policy = kMuxPolicy_Block,
+                         .priority = 0, .weight = 1 },
+};
+
+static const char *const s_channel_names[kMuxChannel_Count] = {
+  [kMuxChannel_Shell] = "shell",
+  [kMuxChannel_Log] = "log",
+  [kMuxChannel_Trace] = "trace",
+  [kMuxChannel_Bulk] = "bulk",
+};
+
+// reservations are formatted here in direct mode
+static uint8_t s_direct_buf[MUX_RESERVE_MAX];
+
+/* Scheduler -----------------------------------------------------------------*/
+// Only ever runs in one context at a time: the TXE interrupt, or whoever
+// polls while that interrupt can't run.
+
+// where the round robin scan starts, the channel being served until its
+// credit runs out
+static size_t s_rr;
+
+static bool prv_pending(const sMuxChannel *c)
+{
+  return ring_used(c->ring) != 0;
+}
+
+// Deficit round robin among the pending channels of the highest priority.
+// Returns -1 if nothing is queued.
+static int prv_pick(void)
+{
+  int prio = -1;
+  for (size_t i = 0; i < kMuxChannel_Count; i++) {
+    if (prv_pending(&s_channels[i]) && s_channels[i].priority > prio) {
+      prio = s_channels[i].priority;
+    }
+  }
+  if (prio < 0) {
+    return -1;
+  }
+
+  while (1) {
+    for (size_t n = 0; n < kMuxChannel_Count; n++) {
+      const size_t i = (s_rr + n) % kMuxChannel_Count;
+      const sMuxChannel *c = &s_channels[i];
+      if (c->priority == prio && c->credit > 0 && prv_pending(c)) {
+        s_rr = i;
+        return (int)i;
+      }
+    }
+    // everyone at this level used up their share, start the next round
+    for (size_t i = 0; i < kMuxChannel_Count; i++) {
+      sMuxChannel *c = &s_channels[i];
+      if (c->priority == prio && prv_pending(c)) {
+        c->credit += (int32_t)c->weight * MUX_QUANTUM;
+      }
+    }
+  }
+}
+
+static void prv_account(size_t i, size_t sent)
+{
+  sMuxChannel *c = &s_channels[i];
+  c->stats.sent += sent;
+  c->credit -= (int32_t)sent;
+  if (!prv_pending(c)) {
+    // an idle channel doesn't save up credit
+    c->credit = 0;
+  }
+  if (c->credit <= 0) {
+    s_rr = (i + 1) % kMuxChannel_Count;
+  }
+}
+
+#if MUX_FRAMED
+
+// chunk[0] is the tag, frame needs MUX_FRAME_SIZE bytes
+static size_t prv_encode(const uint8_t *chunk, size_t len, uint8_t *frame)
+{
+  frame[0] = 0;
+  const size_t encoded = dbg_proto_cobs_encode(chunk, len, &frame[1]);
+  frame[encoded + 1] = 0;
+  return encoded + 2;
+}
+
+static uint8_t s_frame[MUX_FRAME_SIZE];
+static size_t s_frame_len;
+static size_t s_frame_pos;
+
+bool uart_tx_next_byte_cb(uint8_t *byte)
+{
+  if (s_frame_pos == s_frame_len) {
+    const int i = prv_pick();
+    if (i < 0) {
+      return false;
+    }
+
+    uint8_t chunk[1 + MUX_CHUNK_MAX];
+    chunk[0] = MUX_FRAME_TAG | i;
+    const size_t n = ring_read_bulk(s_channels[i].ring, &chunk[1], MUX_CHUNK_MAX);
+    s_frame_len = prv_encode(chunk, n + 1, s_frame);
+    s_frame_pos = 0;
+    prv_account(i, n);
+  }
+
+  *byte = s_frame[s_frame_pos++];
+  return true;
+}
+
+static void prv_send_direct(eMuxChannel ch, const uint8_t *data, size_t len)
+{
+  while (len != 0) {
+    const size_t n = (len < MUX_CHUNK_MAX) ? len : MUX_CHUNK_MAX;
+    uint8_t chunk[1 + MUX_CHUNK_MAX];
+    uint8_t frame[MUX_FRAME_SIZE];
+    chunk[0] = MUX_FRAME_TAG | ch;
+    memcpy(&chunk[1], data, n);
+    const size_t frame_len = prv_encode(chunk, n + 1, frame);
+    for (size_t i = 0; i < frame_len; i++) {
+      uart_tx_poll_byte(frame[i]);
+    }
+    data += n;
+    len -= n;
+  }
+}
+
+#else
+
+// channel that owns the wire until it reaches a boundary or runs dry
+static int s_current = -1;
+
+bool uart_tx_next_byte_cb(uint8_t *byte)
+{
+  while (1) {
+    if (s_current < 0 && (s_current = prv_pick()) < 0) {
+      return false;
+    }
+    if (ring_get(s_channels[s_current].ring, byte)) {
+      break;
+    }
+    // dropped from under us
+    s_current = -1;
+  }
+
+  sMuxChannel *c = &s_channels[s_current];
+  if (*byte == 0) {
+    c->in_frame = !c->in_frame;
+  }
+  const bool boundary = !c->in_frame && (*byte == '\n' || *byte == 0);
+  prv_account(s_current, 1);
+  if (boundary || !prv_pending(c)) {
+    s_current = -1;
+  }
+  return true;
+}
+
+static void prv_send_direct(eMuxChannel ch, const uint8_t *data, size_t len)
+{
+  for (size_t i = 0; i < len; i++) {
+    uart_tx_poll_byte(data[i]);
+  }
+}
+
+#endif /* MUX_FRAMED */
+
+/* Producers -----------------------------------------------------------------*/
+
+// Returns how many of len bytes may be queued on c right now under its
+// policy, making room first if the policy says so.
+static size_t prv_make_room(sMuxChannel *c, size_t len)
+{
+  size_t avail = ring_free(c->ring);
+  if (avail >= len) {
+    return len;
+  }
+
+  switch (c->policy) {
+    case kMuxPolicy_Block:
+      // callers never ask for more than half the queue in this mode
+      if (uart_tx_irq_can_run()) {
+        uart_tx_kick();
+        while (ring_free(c->ring) < len) { }
+      } else {
+        // Bytes we can't reach stay behind a reservation we preempted, so
+        // give up once nothing committed is left to drain
+        while (ring_free(c->ring) < len && prv_pending(c)) {
+          uart_tx_poll_one();
+        }
+      }
+      return (ring_free(c->ring) < len) ? 0 : len;
+    case kMuxPolicy_DropOldest: {
+      if (len > ring_size(c->ring)) {
+        len = ring_size(c->ring);
+      }
+      // the consumer must not move while we take bytes away from it
+      const bool irq_enabled = NVIC_GetEnableIRQ(USART1_IRQn);
+      NVIC_DisableIRQ(USART1_IRQn);
+      avail = ring_free(c->ring);
+      if (avail < len) {
+        c->stats.dropped += ring_skip(c->ring, len - avail);
+      }
+      if (irq_enabled) {
+        NVIC_EnableIRQ(USART1_IRQn);
+      }
+      // only committed bytes can be dropped
+      avail = ring_free(c->ring);
+      return (avail < len) ? avail : len;
+    }
+    case kMuxPolicy_DropNewest:
+    default:
+      return avail;
+  }
+}
+
+size_t mux_write(eMuxChannel ch, const void *buf, size_t len)
+{
+  sMuxChannel *c = &s_channels[ch];
+  const uint8_t *data = buf;
+  size_t written = 0;
+
+  if (uart_tx_is_direct()) {
+    prv_send_direct(ch, data, len);
+    c->stats.queued += len;
+    c->stats.sent += len;
+    return len;
+  }
+
+  while (written < len) {
+    size_t chunk = len - written;
+    if (c->policy == kMuxPolicy_Block && chunk > ring_size(c->ring) / 2) {
+      chunk = ring_size(c->ring) / 2;
+    }
+    chunk = prv_make_room(c, chunk);
+    if (chunk == 0) {
+      break;
+    }
+
+    if (!ring_write_atomic(c->ring, &data[written], chunk)) {
+      // another producer took the room first
+      if (c->policy == kMuxPolicy_DropNewest) {
+        break;
+      }
+      continue;
+    }
+    written += chunk;
+    uart_tx_kick();
+
+    if (c->policy != kMuxPolicy_Block) {
+      break;
+    }
+  }
+
+  c->stats.queued += written;
+  c->stats.dropped += len - written;
+  return written;
+}
+
+uint8_t *mux_reserve(eMuxChannel ch, size_t min_len, size_t max_len,
+                     sRingReservation *res)
+{
+  sMuxChannel *c = &s_channels[ch];
+  const size_t limit = (ring_size(c->ring) / 2 < MUX_RESERVE_MAX) ?
+      ring_size(c->ring) / 2 : MUX_RESERVE_MAX;
+  if (max_len > limit) {
+    max_len = limit;
+  }
+  if (min_len > max_len) {
+    min_len = max_len;
+  }
+
+  if (uart_tx_is_direct()) {
+    *res = (sRingReservation) { .len = max_len };
+    return s_direct_buf;
+  }
+
+  while (1) {
+    const size_t len = prv_make_room(c, max_len);
+    if (len < min_len) {
+      c->stats.dropped += max_len;
+      return NULL;
+    }
+    if (ring_reserve(c->ring, len, res)) {
+      c->stats.dropped += max_len - len;
+      return ring_reservation_ptr(c->ring, res);
+    }
+    // another producer took the room first, try again
+  }
+}
+
+void mux_commit(eMuxChannel ch, sRingReservation *res)
+{
+  sMuxChannel *c = &s_channels[ch];
+  c->stats.queued += res->len;
+
+  if (uart_tx_is_direct()) {
+    prv_send_direct(ch, s_direct_buf, res->len);
+    c->stats.sent += res->len;
+    return;
+  }
+
+  ring_commit(c->ring, res);
+  uart_tx_kick();
+}
+
+void mux_set_policy(eMuxChannel ch, eMuxPolicy policy)
+{
+  s_channels[ch].policy = policy;
+}
+
+eMuxPolicy mux_get_policy(eMuxChannel ch)
+{
+  return s_channels[ch].policy;
+}
+
+void mux_set_sched(eMuxChannel ch, uint8_t priority, uint8_t weight)
+{
+  s_channels[ch].priority = priority;
+  s_channels[ch].weight = (weight != 0) ? weight : 1;
+}
+
+void mux_get_sched(eMuxChannel ch, uint8_t *priority, uint8_t *weight)
+{
+  *priority = s_channels[ch].priority;
+  *weight = s_channels[ch].weight;
+}
+
+void mux_get_stats(eMuxChannel ch, sMuxStats *stats)
+{
+  *stats = s_channels[ch].stats;
+}
+
+const char *mux_channel_name(eMuxChannel ch)
+{
+  return (ch < kMuxChannel_Count) ? s_channel_names[ch] : "?";
+}
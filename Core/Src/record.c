@@ -0,0 +1,326 @@
+#include "record.h"
+#include "console.h"
+#include "dbg_proto.h"
+#include "mux.h"
+#include "shell_cmd.h"
+#include <stdio.h>
+#include <string.h>
+
+// room kept for what record_end() appends
+#define RECORD_TAIL (24)
+
+static eRecordFormat s_format = kRecordFormat_Text;
+
+static struct {
+  uint8_t buf[RECORD_MAX + RECORD_TAIL];
+  size_t len;
+  bool first;
+  bool truncated;
+} s_rec;
+
+void record_set_format(eRecordFormat format)
+{
+  s_format = format;
+}
+
+eRecordFormat record_get_format(void)
+{
+  return s_format;
+}
+
+// Every field is written as a whole or not at all
+static size_t s_field_start;
+
+static void prv_field_begin(void)
+{
+  s_field_start = s_rec.len;
+}
+
+static void prv_put(const void *data, size_t len)
+{
+  if (s_rec.truncated || s_rec.len + len > RECORD_MAX) {
+    s_rec.truncated = true;
+    return;
+  }
+  memcpy(&s_rec.buf[s_rec.len], data, len);
+  s_rec.len += len;
+}
+
+static void prv_putc(char c)
+{
+  prv_put(&c, 1);
+}
+
+static void prv_puts(const char *s)
+{
+  prv_put(s, strlen(s));
+}
+
+static void prv_field_end(void)
+{
+  if (s_rec.truncated) {
+    s_rec.len = s_field_start;
+  }
+}
+
+/* CBOR ----------------------------------------------------------------------*/
+
+#define CBOR_MAJOR_UINT (0)
+#define CBOR_MAJOR_BYTES (2)
+#define CBOR_MAJOR_TEXT (3)
+#define CBOR_MAP_INDEFINITE (0xBF)
+#define CBOR_FALSE (0xF4)
+#define CBOR_TRUE (0xF5)
+#define CBOR_BREAK (0xFF)
+
+static void prv_cbor_head(uint8_t major, uint32_t value)
+{
+  uint8_t head[5];
+  size_t len;
+  major <<= 5;
+  if (value < 24) {
+    head[0] = major | value;
+    len = 1;
+  } else if (value <= 0xFF) {
+    head[0] = major | 24;
+    head[1] = (uint8_t)value;
+    len = 2;
+  } else if (value <= 0xFFFF) {
+    head[0] = major | 25;
+    head[1] = (uint8_t)(value >> 8);
+    head[2] = (uint8_t)value;
+    len = 3;
+  } else {
+    head[0] = major | 26;
+    head[1] = (uint8_t)(value >> 24);
+    head[2] = (uint8_t)(value >> 16);
+    head[3] = (uint8_t)(value >> 8);
+    head[4] = (uint8_t)value;
+    len = 5;
+  }
+  prv_put(head, len);
+}
+
+static void prv_cbor_text(const char *s)
+{
+  const size_t len = strlen(s);
+  prv_cbor_head(CBOR_MAJOR_TEXT, len);
+  prv_put(s, len);
+}
+
+/* JSON and text -------------------------------------------------------------*/
+
+static void prv_json_str(const char *s)
+{
+  prv_putc('"');
+  for (; *s != '\0'; s++) {
+    if (*s == '"' || *s == '\\') {
+      prv_putc('\\');
+      prv_putc(*s);
+    } else if ((uint8_t)*s < 0x20) {
+      char esc[8];
+      snprintf(esc, sizeof(esc), "\\u%04x", (int)*s);
+      prv_puts(esc);
+    } else {
+      prv_putc(*s);
+    }
+  }
+  prv_putc('"');
+}
+
+// the part before the value
+static void prv_key(const char *key)
+{
+  switch (s_format) {
+    case kRecordFormat_Text:
+      prv_putc(' ');
+      prv_puts(key);
+      prv_putc('=');
+      break;
+    case kRecordFormat_Json:
+      if (!s_rec.first) {
+        prv_putc(',');
+      }
+      prv_json_str(key);
+      prv_putc(':');
+      break;
+    case kRecordFormat_Cbor:
+      prv_cbor_text(key);
+      break;
+  }
+  s_rec.first = false;
+}
+
+static void prv_number(const char *fmt, uint32_t value)
+{
+  char num[12];
+  snprintf(num, sizeof(num), fmt, (unsigned int)value);
+  prv_puts(num);
+}
+
+/* API -----------------------------------------------------------------------*/
+
+void record_begin(const char *type)
+{
+  s_rec.len = 0;
+  s_rec.first = true;
+  s_rec.truncated = false;
+  switch (s_format) {
+    case kRecordFormat_Text:
+      prv_puts(type);
+      prv_putc(':');
+      break;
+    case kRecordFormat_Json:
+      prv_puts("{\"t\":");
+      prv_json_str(type);
+      s_rec.first = false;
+      break;
+    case kRecordFormat_Cbor: {
+      const uint8_t map = CBOR_MAP_INDEFINITE;
+      prv_put(&map, 1);
+      prv_cbor_text("t");
+      prv_cbor_text(type);
+      break;
+    }
+  }
+}
+
+static void prv_u32(const char *key, uint32_t value, const char *text_fmt)
+{
+  prv_field_begin();
+  prv_key(key);
+  if (s_format == kRecordFormat_Cbor) {
+    prv_cbor_head(CBOR_MAJOR_UINT, value);
+  } else {
+    prv_number((s_format == kRecordFormat_Text) ? text_fmt : "%u", value);
+  }
+  prv_field_end();
+}
+
+void record_u32(const char *key, uint32_t value)
+{
+  prv_u32(key, value, "%u");
+}
+
+void record_hex(const char *key, uint32_t value)
+{
+  prv_u32(key, value, "0x%08x");
+}
+
+void record_bool(const char *key, bool value)
+{
+  prv_field_begin();
+  prv_key(key);
+  switch (s_format) {
+    case kRecordFormat_Text:
+      prv_putc(value ? '1' : '0');
+      break;
+    case kRecordFormat_Json:
+      prv_puts(value ? "true" : "false");
+      break;
+    case kRecordFormat_Cbor: {
+      const uint8_t b = value ? CBOR_TRUE : CBOR_FALSE;
+      prv_put(&b, 1);
+      break;
+    }
+  }
+  prv_field_end();
+}
+
+void record_str(const char *key, const char *value)
+{
+  prv_field_begin();
+  prv_key(key);
+  switch (s_format) {
+    case kRecordFormat_Text:
+      prv_puts(value);
+      break;
+    case kRecordFormat_Json:
+      prv_json_str(value);
+      break;
+    case kRecordFormat_Cbor:
+      prv_cbor_text(value);
+      break;
+  }
+  prv_field_end();
+}
+
+void record_bytes(const char *key, const void *data, size_t len)
+{
+  const uint8_t *bytes = data;
+  prv_field_begin();
+  prv_key(key);
+  if (s_format == kRecordFormat_Cbor) {
+    prv_cbor_head(CBOR_MAJOR_BYTES, len);
+    prv_put(bytes, len);
+  } else {
+    if (s_format == kRecordFormat_Json) {
+      prv_putc('"');
+    }
+    for (size_t i = 0; i < len; i++) {
+      if (s_format == kRecordFormat_Text && i != 0) {
+        prv_putc(' ');
+      }
+      prv_number("%02x", bytes[i]);
+    }
+    if (s_format == kRecordFormat_Json) {
+      prv_putc('"');
+    }
+  }
+  prv_field_end();
+}
+
+void record_end(void)
+{
+  // what follows always fits in the tail
+  switch (s_format) {
+    case kRecordFormat_Text:
+      memcpy(&s_rec.buf[s_rec.len], s_rec.truncated ? " ...\r\n" : "\r\n",
+             s_rec.truncated ? 6 : 2);
+      s_rec.len += s_rec.truncated ? 6 : 2;
+      mux_write(console_log_channel(), s_rec.buf, s_rec.len);
+      break;
+    case kRecordFormat_Json: {
+      const char *end = s_rec.truncated ? ",\"truncated\":true}\r\n" : "}\r\n";
+      memcpy(&s_rec.buf[s_rec.len], end, strlen(end));
+      s_rec.len += strlen(end);
+      mux_write(console_log_channel(), s_rec.buf, s_rec.len);
+      break;
+    }
+    case kRecordFormat_Cbor:
+      if (s_rec.truncated) {
+        // text(9) "truncated", true
+        memcpy(&s_rec.buf[s_rec.len], "\x69truncated\xf5", 11);
+        s_rec.len += 11;
+      }
+      s_rec.buf[s_rec.len++] = CBOR_BREAK;
+      dbg_proto_send_event_large(kDbgProtoEvt_Record, s_rec.buf, s_rec.len);
+      break;
+  }
+}
+
+/* Shell ---------------------------------------------------------------------*/
+
+static const char *const s_format_names[] = {
+  [kRecordFormat_Text] = "text",
+  [kRecordFormat_Json] = "json",
+  [kRecordFormat_Cbor] = "cbor",
+};
+
+static int prv_format(int argc, char *argv[])
+{
+  if (argc < 2) {
+    logp("Output format: %s", s_format_names[s_format]);
+    return 0;
+  }
+  for (size_t i = 0; i < ARRAY_SIZE(s_format_names); i++) {
+    if (strcmp(argv[1], s_format_names[i]) == 0) {
+      s_format = (eRecordFormat)i;
+      return 0;
+    }
+  }
+  logp("Expected text, json or cbor");
+  return -1;
+}
+
+SHELL_COMMAND(format, prv_format, "Show or set how commands report results [text|json|cbor]");
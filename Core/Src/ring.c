@@ -0,0 +1,204 @@
+#include <string.h>
+#include "ring.h"
+
+// The producer must make the data visible before publishing head, and the
+// consumer must be done reading before publishing tail. On the Cortex-M3
+// these compile to a DMB.
+#define RING_PUBLISH() __atomic_thread_fence(__ATOMIC_RELEASE)
+#define RING_OBSERVE() __atomic_thread_fence(__ATOMIC_ACQUIRE)
+
+bool ring_init(sRingBuf *ring, void *buf, size_t size) {
+  if (size == 0 || (size & (size - 1)) != 0) {
+    return false;
+  }
+
+  *ring = (sRingBuf) {
+    .head = 0,
+    .tail = 0,
+    .mask = size - 1,
+    .buf = buf,
+  };
+  return true;
+}
+
+size_t ring_size(const sRingBuf *ring) {
+  return ring->mask + 1;
+}
+
+size_t ring_used(const sRingBuf *ring) {
+  return ring->head - ring->tail;
+}
+
+size_t ring_free(const sRingBuf *ring) {
+  return ring_size(ring) - (ring->reserve - ring->tail);
+}
+
+// Copies len bytes between the ring at free running index idx and buf,
+// splitting the copy where the ring wraps.
+static void prv_copy_in(sRingBuf *ring, uint32_t idx, const uint8_t *buf, size_t len) {
+  const size_t off = idx & ring->mask;
+  const size_t first = (len < ring_size(ring) - off) ? len : ring_size(ring) - off;
+  memcpy(&ring->buf[off], buf, first);
+  memcpy(&ring->buf[0], buf + first, len - first);
+}
+
+static void prv_copy_out(const sRingBuf *ring, uint32_t idx, uint8_t *buf, size_t len) {
+  const size_t off = idx & ring->mask;
+  const size_t first = (len < ring_size(ring) - off) ? len : ring_size(ring) - off;
+  memcpy(buf, &ring->buf[off], first);
+  memcpy(buf + first, &ring->buf[0], len - first);
+}
+
+size_t ring_write_bulk(sRingBuf *ring, const void *buf, size_t len) {
+  const uint32_t head = ring->head;
+  const uint32_t tail = ring->tail;
+  RING_OBSERVE();
+
+  const size_t avail = ring_size(ring) - (head - tail);
+  if (len > avail) {
+    len = avail;
+  }
+
+  prv_copy_in(ring, head, buf, len);
+  RING_PUBLISH();
+  ring->reserve = head + len;
+  ring->head = head + len;
+  return len;
+}
+
+bool ring_put(sRingBuf *ring, uint8_t byte) {
+  const uint32_t head = ring->head;
+  if (head - ring->tail >= ring_size(ring)) {
+    return false;
+  }
+
+  ring->buf[head & ring->mask] = byte;
+  RING_PUBLISH();
+  ring->reserve = head + 1;
+  ring->head = head + 1;
+  return true;
+}
+
+size_t ring_read_bulk(sRingBuf *ring, void *buf, size_t len) {
+  const uint32_t tail = ring->tail;
+  const uint32_t head = ring->head;
+  RING_OBSERVE();
+
+  const size_t used = head - tail;
+  if (len > used) {
+    len = used;
+  }
+
+  prv_copy_out(ring, tail, buf, len);
+  RING_PUBLISH();
+  ring->tail = tail + len;
+  return len;
+}
+
+bool ring_get(sRingBuf *ring, uint8_t *byte) {
+  const uint32_t tail = ring->tail;
+  if (ring->head == tail) {
+    return false;
+  }
+  RING_OBSERVE();
+
+  *byte = ring->buf[tail & ring->mask];
+  RING_PUBLISH();
+  ring->tail = tail + 1;
+  return true;
+}
+
+size_t ring_skip(sRingBuf *ring, size_t len) {
+  const uint32_t tail = ring->tail;
+  const size_t used = ring->head - tail;
+  if (len > used) {
+    len = used;
+  }
+
+  ring->tail = tail + len;
+  return len;
+}
+
+// The scheme below relies on producers only interrupting each other, never
+// running in parallel: a producer that preempts another one always commits
+// before the preempted one resumes. So when the count of busy writers drops
+// to zero, everything reserved so far has been written.
+
+// Called by every producer when it is done with its reservation
+static void prv_publish(sRingBuf *ring) {
+  if (__atomic_sub_fetch(&ring->writers, 1, __ATOMIC_ACQ_REL) != 0) {
+    return; // the outermost writer publishes for us
+  }
+
+  // A producer that preempted us right here may already have published
+  // further than we are about to, so never move head backwards.
+  const uint32_t reserve = ring->reserve;
+  uint32_t head = ring->head;
+  while ((int32_t)(reserve - head) > 0 &&
+         !__atomic_compare_exchange_n(&ring->head, &head, reserve, true,
+                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+  }
+}
+
+bool ring_reserve(sRingBuf *ring, size_t len, sRingReservation *res) {
+  __atomic_add_fetch(&ring->writers, 1, __ATOMIC_ACQ_REL);
+
+  uint32_t reserve = ring->reserve;
+  do {
+    if (len > ring_size(ring) - (reserve - ring->tail)) {
+      prv_publish(ring);
+      return false;
+    }
+  } while (!__atomic_compare_exchange_n(&ring->reserve, &reserve, reserve + len,
+                                        true, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+  *res = (sRingReservation) {
+    .idx = reserve,
+    .len = len,
+  };
+  return true;
+}
+
+uint8_t *ring_reservation_ptr(const sRingBuf *ring, const sRingReservation *res) {
+  return &ring->buf[res->idx & ring->mask];
+}
+
+void ring_commit(sRingBuf *ring, const sRingReservation *res) {
+  // move whatever was written into the slack back to the start of the ring
+  const size_t off = res->idx & ring->mask;
+  if (off + res->len > ring_size(ring)) {
+    const size_t wrapped = off + res->len - ring_size(ring);
+    memmove(&ring->buf[0], &ring->buf[ring_size(ring)],
+            (wrapped < ring->slack) ? wrapped : ring->slack);
+  }
+
+  prv_publish(ring);
+}
+
+bool ring_write_atomic(sRingBuf *ring, const void *buf, size_t len) {
+  sRingReservation res;
+  if (!ring_reserve(ring, len, &res)) {
+    return false;
+  }
+
+  // copies around the end itself, so the slack isn't involved
+  prv_copy_in(ring, res.idx, buf, len);
+  prv_publish(ring);
+  return true;
+}
+
+bool ring_get_atomic(sRingBuf *ring, uint8_t *byte) {
+  uint32_t tail = ring->tail;
+  uint8_t value;
+  do {
+    if (ring->head == tail) {
+      return false;
+    }
+    RING_OBSERVE();
+    // if another consumer takes it first, this copy is discarded
+    value = ring->buf[tail & ring->mask];
+  } while (!__atomic_compare_exchange_n(&ring->tail, &tail, tail + 1, true,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+  *byte = value;
+  return true;
+}
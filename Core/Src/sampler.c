@@ -0,0 +1,84 @@
+#include "sampler.h"
+#include "sched.h"
+#include "mux.h"
+#include "dbg_proto.h"
+#include "console.h"
+#include "core_regs.h"
+#include "shell_cmd.h"
+#include "shell_args.h"
+#include "main.h"
+#include <stdio.h>
+
+#define SAMPLER_EVENT_TIMER (1 << 0)
+
+static void prv_sampler_task(uint32_t events, void *ctx);
+
+static sSchedTask s_sampler_task = {
+  .name = "sampler",
+  .handler = prv_sampler_task,
+  .prio = 2,
+};
+
+static sSchedTimer s_sampler_timer = {
+  .task = &s_sampler_task,
+  .events = SAMPLER_EVENT_TIMER,
+};
+
+static uint32_t s_sample_addr;
+
+static void prv_sampler_task(uint32_t events, void *ctx)
+{
+  if ((events & SAMPLER_EVENT_TIMER) == 0) {
+    return;
+  }
+  const uint32_t value = core_reg_read(s_sample_addr);
+  char line[48];
+  const int len = snprintf(line, sizeof(line), "sample %d 0x%08x 0x%08x\n",
+                           (int)HAL_GetTick(), (int)s_sample_addr, (int)value);
+  if (len > 0) {
+    // trace drops rather than blocks when the link can't keep up
+    mux_write(kMuxChannel_Trace, line, (size_t)len);
+  }
+}
+
+static int prv_sample(int argc, char *argv[])
+{
+  uint32_t addr = 0;
+  if (argc > 1 && !shell_arg_addr(argv[1], &addr)) {
+    logp("Expected <addr> [period ms]");
+    return -1;
+  }
+  if (addr == 0) {
+    sched_timer_stop(&s_sampler_timer);
+    logp("Sampling stopped");
+    return 0;
+  }
+
+  uint32_t period_ms = 100;
+  if (argc > 2 && !shell_arg_u32(argv[2], &period_ms)) {
+    logp("Expected <addr> [period ms]");
+    return -1;
+  }
+  if ((addr & 0x3) != 0 || !dbg_proto_read_ok(addr, sizeof(uint32_t))) {
+    logp("Can't sample 0x%x", (int)addr);
+    return -1;
+  }
+  if (period_ms == 0) {
+    logp("Period must be at least 1 ms");
+    return -1;
+  }
+
+  sched_timer_stop(&s_sampler_timer);
+  s_sample_addr = addr;
+  s_sampler_timer.period_ms = period_ms;
+  sched_timer_start(&s_sampler_timer, period_ms);
+  logp("Sampling 0x%x every %d ms on the trace channel", (int)addr, (int)period_ms);
+  return 0;
+}
+
+SHELL_COMMAND(sample, prv_sample, "Report a word on the trace channel periodically <addr> [period ms], no addr stops");
+
+void sampler_init(void)
+{
+  sched_task_add(&s_sampler_task);
+}
@@ -0,0 +1,277 @@
+#include "sched.h"
+#include "main.h"
+#include "dbg.h"
+#include "console.h"
+#include "shell_cmd.h"
+#include "record.h"
+#include <string.h>
+
+static sSchedTask *s_tasks[SCHED_MAX_TASKS];
+//! Bit n set: s_tasks[n] has events pending
+static volatile uint32_t s_ready;
+
+//! Armed timers, earliest expiry first
+static sSchedTimer *s_timers;
+
+static sSchedStats s_stats;
+// CYCCNT when the core last woke up. CYCCNT stops while the core sleeps
+// unless a debugger set DBGMCU_CR.DBG_SLEEP, so only the cycles between
+// waking up and going back to sleep are added up and the window length
+// comes from the tick.
+static uint32_t s_awake_since;
+static uint32_t s_window_start_ms;
+
+static uint32_t prv_lock(void)
+{
+  const uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  return primask;
+}
+
+static void prv_unlock(uint32_t primask)
+{
+  __set_PRIMASK(primask);
+}
+
+bool sched_task_add(sSchedTask *task)
+{
+  if (task->prio >= SCHED_MAX_TASKS || s_tasks[task->prio] != NULL) {
+    return false;
+  }
+  s_tasks[task->prio] = task;
+  return true;
+}
+
+void sched_post(sSchedTask *task, uint32_t events)
+{
+  const uint32_t primask = prv_lock();
+  task->events |= events;
+  s_ready |= (1u << task->prio);
+  prv_unlock(primask);
+}
+
+/* Timers --------------------------------------------------------------------*/
+
+static bool prv_expired(uint32_t now, uint32_t expiry)
+{
+  return (int32_t)(now - expiry) >= 0;
+}
+
+// with the lock held
+static void prv_timer_insert(sSchedTimer *timer)
+{
+  sSchedTimer **link = &s_timers;
+  while (*link != NULL && !prv_expired((*link)->expiry - 1, timer->expiry)) {
+    link = &(*link)->next;
+  }
+  timer->next = *link;
+  *link = timer;
+  timer->active = true;
+}
+
+// with the lock held
+static void prv_timer_remove(sSchedTimer *timer)
+{
+  for (sSchedTimer **link = &s_timers; *link != NULL; link = &(*link)->next) {
+    if (*link == timer) {
+      *link = timer->next;
+      break;
+    }
+  }
+  timer->active = false;
+}
+
+void sched_timer_start(sSchedTimer *timer, uint32_t delay_ms)
+{
+  const uint32_t primask = prv_lock();
+  if (timer->active) {
+    prv_timer_remove(timer);
+  }
+  timer->expiry = HAL_GetTick() + delay_ms;
+  prv_timer_insert(timer);
+  prv_unlock(primask);
+}
+
+void sched_timer_stop(sSchedTimer *timer)
+{
+  const uint32_t primask = prv_lock();
+  if (timer->active) {
+    prv_timer_remove(timer);
+  }
+  prv_unlock(primask);
+}
+
+void sched_tick(void)
+{
+  // constant time, the list is only walked in PendSV
+  const sSchedTimer *first = s_timers;
+  if (first != NULL && prv_expired(HAL_GetTick(), first->expiry)) {
+    SCB->ICSR = SCB_ICSR_PENDSVSET_Msk;
+  }
+}
+
+void sched_timer_irq(void)
+{
+  const uint32_t now = HAL_GetTick();
+
+  while (1) {
+    const uint32_t primask = prv_lock();
+    sSchedTimer *timer = s_timers;
+    if (timer == NULL || !prv_expired(now, timer->expiry)) {
+      prv_unlock(primask);
+      break;
+    }
+
+    s_timers = timer->next;
+    timer->active = false;
+    if (timer->period_ms != 0) {
+      timer->expiry += timer->period_ms;
+      if (prv_expired(now, timer->expiry)) {
+        // fell behind, skip the periods that were missed
+        timer->expiry = now + timer->period_ms;
+      }
+      prv_timer_insert(timer);
+    }
+    prv_unlock(primask);
+
+    sched_post(timer->task, timer->events);
+    s_stats.timer_runs++;
+  }
+}
+
+/* Dispatcher ----------------------------------------------------------------*/
+
+// Called with interrupts masked, returns with them masked
+static void prv_sleep(void)
+{
+  // With PRIMASK set a post that races with the check before still ends the
+  // WFI, its interrupt handler runs once PRIMASK is cleared again
+  s_stats.active_cycles += dwt_cyccnt_read() - s_awake_since;
+#if SCHED_SLEEP
+  __WFI();
+#endif
+  s_awake_since = dwt_cyccnt_read();
+  s_stats.wakeups++;
+}
+
+static void prv_account(sSchedTask *task, uint32_t overhead, uint32_t cycles)
+{
+  s_stats.dispatches++;
+  s_stats.overhead_total += overhead;
+  if (overhead < s_stats.overhead_min) {
+    s_stats.overhead_min = overhead;
+  }
+  if (overhead > s_stats.overhead_max) {
+    s_stats.overhead_max = overhead;
+  }
+
+  task->runs++;
+  task->cycles += cycles;
+  if (cycles > task->max_cycles) {
+    task->max_cycles = cycles;
+  }
+}
+
+void sched_run(void)
+{
+  // the timer service must never hold off a real interrupt
+  NVIC_SetPriority(PendSV_IRQn, (1 << __NVIC_PRIO_BITS) - 1);
+  dwt_cyccnt_enable();
+  sched_reset_stats();
+
+  while (1) {
+    const uint32_t start = dwt_cyccnt_read();
+
+    __disable_irq();
+    const uint32_t ready = s_ready;
+    if (ready == 0) {
+      prv_sleep();
+      __enable_irq();
+      continue;
+    }
+    const uint32_t prio = 31 - __CLZ(ready);
+    sSchedTask *task = s_tasks[prio];
+    s_ready = ready & ~(1u << prio);
+    const uint32_t events = (task != NULL) ? task->events : 0;
+    if (task != NULL) {
+      task->events = 0;
+    }
+    __enable_irq();
+
+    if (task == NULL) {
+      continue; // posted to a task that was never added
+    }
+
+    const uint32_t dispatched = dwt_cyccnt_read();
+    task->handler(events, task->ctx);
+    prv_account(task, dispatched - start, dwt_cyccnt_read() - dispatched);
+  }
+}
+
+void sched_get_stats(sSchedStats *stats)
+{
+  *stats = s_stats;
+  stats->active_cycles += dwt_cyccnt_read() - s_awake_since;
+  stats->elapsed_ms = HAL_GetTick() - s_window_start_ms;
+}
+
+void sched_reset_stats(void)
+{
+  s_stats = (sSchedStats) { .overhead_min = UINT32_MAX };
+  s_awake_since = dwt_cyccnt_read();
+  s_window_start_ms = HAL_GetTick();
+  for (size_t i = 0; i < SCHED_MAX_TASKS; i++) {
+    if (s_tasks[i] != NULL) {
+      s_tasks[i]->runs = 0;
+      s_tasks[i]->cycles = 0;
+      s_tasks[i]->max_cycles = 0;
+    }
+  }
+}
+
+static int prv_sched(int argc, char *argv[])
+{
+  if (argc > 1 && strcmp(argv[1], "stats") != 0) {
+    logp("Expected stats [reset]");
+    return -1;
+  }
+  if (argc > 2 && strcmp(argv[2], "reset") == 0) {
+    sched_reset_stats();
+    return 0;
+  }
+
+  sSchedStats stats;
+  sched_get_stats(&stats);
+  const uint64_t total = (uint64_t)stats.elapsed_ms * (SystemCoreClock / 1000);
+  const uint64_t active = (stats.active_cycles < total) ? stats.active_cycles : total;
+  const uint32_t idle_permille = total ? (uint32_t)(1000 - active * 1000 / total) : 0;
+  record_begin("sched");
+  record_u32("idle_permille", idle_permille);
+  record_u32("ms", stats.elapsed_ms);
+  record_u32("wakeups", stats.wakeups);
+  record_u32("dispatches", stats.dispatches);
+  record_u32("timer_runs", stats.timer_runs);
+  if (stats.dispatches != 0) {
+    record_u32("overhead_min", stats.overhead_min);
+    record_u32("overhead_avg", (uint32_t)(stats.overhead_total / stats.dispatches));
+    record_u32("overhead_max", stats.overhead_max);
+  }
+  record_end();
+
+  for (int i = SCHED_MAX_TASKS - 1; i >= 0; i--) {
+    const sSchedTask *task = s_tasks[i];
+    if (task == NULL) {
+      continue;
+    }
+    record_begin("sched_task");
+    record_str("name", task->name);
+    record_u32("prio", i);
+    record_u32("runs", task->runs);
+    record_u32("avg", task->runs ? (uint32_t)(task->cycles / task->runs) : 0);
+    record_u32("max", task->max_cycles);
+    record_end();
+  }
+  return 0;
+}
+
+SHELL_COMMAND(sched, prv_sched, "Scheduler and per task statistics: stats [reset]");
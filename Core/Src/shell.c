@@ -4,57 +4,197 @@
 #include "dbg.h"
 #include "console.h"
 #include "shell_cmd.h"
-
-#define SHELL_RX_BUFFER_SIZE (256)
-#define SHELL_MAX_ARGS (16)
+#include "ring.h"
+#include "dbg_proto.h"
+#include "sched.h"
+#include "shell_args.h"
+#include "macro.h"
+#include "record.h"
+
+#define SHELL_TYPEAHEAD_SIZE (128)
 #define SHELL_PROMPT "shell> "
+#define SHELL_UART_RX_RING_SIZE (512)
+// Above the high watermark the host is asked to pause, below the low one to
+// resume. The headroom covers what is already on its way: up to half the
+// DMA buffer is published at once, plus what the adapter still sends after
+// RTS drops or a USB packet's worth after XOFF.
+#define SHELL_UART_RX_HIGH_WATER \
+  (SHELL_UART_RX_RING_SIZE - UART_RX_DMA_BUF_SIZE / 2 - 64)
+#define SHELL_UART_RX_LOW_WATER (SHELL_UART_RX_RING_SIZE / 4)
+#define SHELL_CTRL_C '\x03'
+#define SHELL_CTRL_T '\x14'
+
+#define SHELL_EVENT_RX (1 << 0)
+#define SHELL_EVENT_BOOT (1 << 1)
+
+#define SHELL_JOB_EVENT_STEP (1 << 0)
+#define SHELL_JOB_EVENT_TIMEOUT (1 << 1)
+
 
 
+static void prv_shell_rx_handler(uint32_t events, void *ctx);
 
-static volatile struct {
-  size_t read_idx;
-  size_t num_bytes;
-  char buf[64];
-} s_uart_buffer = {
-  .num_bytes = 0,
+// Above the sampler so typing stays responsive while it runs
+static sSchedTask s_shell_task = {
+  .name = "shell",
+  .handler = prv_shell_rx_handler,
+  .prio = 4,
 };
 
-void uart_byte_received_cb(uint8_t* buf, uint16_t size)
+static void prv_job_handler(uint32_t events, void *ctx);
+
+// Below everything else, a job only gets the time left over
+static sSchedTask s_job_task = {
+  .name = "job",
+  .handler = prv_job_handler,
+  .prio = 1,
+};
+
+// Filled from the UART receive interrupt. Drained by the shell loop, and by
+// the debug monitor waiting for 'c' or 's', which can preempt the shell in
+// the middle of a read when stepping through it. So two consumers, see
+// shell_getchar().
+RING_DEFINE(s_uart_rx_ring, SHELL_UART_RX_RING_SIZE);
+
+static void prv_update_rx_flow(void)
 {
-  if (s_uart_buffer.num_bytes >= sizeof(s_uart_buffer.buf)) {
-    return; // drop, out of space
+  // the fill level must not change between looking at it and signalling
+  const uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  const size_t used = ring_used(&s_uart_rx_ring);
+  if (used >= SHELL_UART_RX_HIGH_WATER) {
+    uart_rx_throttle(true);
+  } else if (used <= SHELL_UART_RX_LOW_WATER) {
+    uart_rx_throttle(false);
   }
+  __set_PRIMASK(primask);
+}
 
-  int i=0, j = s_uart_buffer.read_idx;
-  while (i<size) {
-	s_uart_buffer.buf[j++]= buf[i++];
+size_t uart_byte_received_cb(const uint8_t *buf, size_t size)
+{
+  // anything that doesn't fit is dropped, out of space
+  const size_t written = ring_write_bulk(&s_uart_rx_ring, buf, size);
+  if (ring_used(&s_uart_rx_ring) >= SHELL_UART_RX_HIGH_WATER) {
+    prv_update_rx_flow();
   }
-
-  s_uart_buffer.num_bytes += size;
+  sched_post(&s_shell_task, SHELL_EVENT_RX);
+  return written;
 }
 
 bool shell_getchar(char *c_out) 
 {
-  if (s_uart_buffer.num_bytes == 0) {
+  if (!ring_get_atomic(&s_uart_rx_ring, (uint8_t *)c_out)) {
     return false;
   }
-
-  char c = s_uart_buffer.buf[s_uart_buffer.read_idx];
-
-  __disable_irq();
-  s_uart_buffer.read_idx = (s_uart_buffer.read_idx + 1) % sizeof(s_uart_buffer.buf);
-  s_uart_buffer.num_bytes--;
-  __enable_irq();
-  *c_out = c;
+  if (uart_rx_throttled()) {
+    prv_update_rx_flow();
+  }
   return true;
 }
 
+typedef enum {
+  kShellTokState_Space,
+  kShellTokState_Word,
+  kShellTokState_Quoted,
+  //! after a backslash within quotes
+  kShellTokState_Escape,
+} eShellTokState;
+
+// Arguments split off as the characters arrive, quotes and escapes already
+// resolved and each one NUL terminated. A NULL in argv stands for a `;`
+// between two commands. The buffer never needs more than one byte per
+// input character plus one.
+typedef struct {
+  eShellTokState state;
+  size_t size;
+  char *buffer;
+  size_t capacity;
+  //! the input needed more than capacity, the rest was dropped
+  bool overflow;
+  //! counts past SHELL_MAX_ARGS, only the first ones are kept in argv
+  int argc;
+  char **argv;
+} sShellTokens;
+
+// One command line being run, a typed one or the body of a macro it calls
+typedef struct {
+  sShellTokens *tok;
+  //! argv index of the next command
+  int next;
+  uint32_t repeat_left;
+  int repeat_first;
+  int repeat_argc;
+} sShellFrame;
+
+static char s_line_tok_buffer[SHELL_LINE_MAX + 1];
+static char *s_line_argv[SHELL_MAX_ARGS];
+static sShellTokens s_line_tok = {
+  .buffer = s_line_tok_buffer, .capacity = sizeof(s_line_tok_buffer), .argv = s_line_argv,
+};
+
+static char s_macro_tok_buffer[MACRO_BODY_MAX + 1];
+static char *s_macro_argv[SHELL_MAX_ARGS];
+static sShellTokens s_macro_tok = {
+  .buffer = s_macro_tok_buffer, .capacity = sizeof(s_macro_tok_buffer), .argv = s_macro_argv,
+};
+
 static struct ShellContext {
   int (*send_char)(char c);
+  // the line as typed, kept for backspace
   size_t rx_size;
-  char rx_buffer[SHELL_RX_BUFFER_SIZE];
+  char rx_buffer[SHELL_LINE_MAX];
+  // input typed while a line runs, replayed once it is done
+  size_t typeahead_size;
+  char typeahead[SHELL_TYPEAHEAD_SIZE];
 } s_shell;
 
+// Commands of a line run one per dispatch of the job task. A macro is a
+// second frame on top.
+static struct ShellExec {
+  bool active;
+  volatile bool cancel;
+  int depth;
+  sShellFrame frames[2];
+} s_exec;
+
+// A command, or a macro, being measured. One per frame, as a macro being
+// timed runs commands of its own.
+typedef struct {
+  bool pending;
+  //! print the result, `time` was in front
+  bool report;
+  //! held by `time repeat` until its last run, the commands it runs aren't
+  //! measured on their own meanwhile
+  bool repeat;
+  const char *name;
+  sShellCmdStats *stats;
+  uint32_t start_cycles;
+  uint32_t start_bytes;
+} sShellTiming;
+
+static sShellTiming s_timing[ARRAY_SIZE(s_exec.frames)];
+
+static struct ShellJob {
+  const char *name;
+  ShellJobStep step;
+  void *ctx;
+  uint32_t done;
+  uint32_t total;
+} s_job;
+
+// A job waiting for Enter, see shell_await_enter(). Only Enter, Ctrl-C or
+// the timer wake it.
+static struct ShellAwait {
+  ShellAwaitDone done;
+  bool entered;
+  bool timed_out;
+} s_await;
+
+static sSchedTimer s_await_timer = {
+  .task = &s_job_task,
+  .events = SHELL_JOB_EVENT_TIMEOUT,
+};
+
 static bool prv_booted(void) {
   return s_shell.send_char != NULL;
 }
@@ -79,17 +219,125 @@ void prv_echo(char c) {
   }
 }
 
-static char prv_last_char(void) {
-  return s_shell.rx_buffer[s_shell.rx_size - 1];
+static bool prv_is_rx_buffer_full(void) {
+  return s_shell.rx_size >= SHELL_LINE_MAX;
 }
 
-static bool prv_is_rx_buffer_full(void) {
-  return s_shell.rx_size >= SHELL_RX_BUFFER_SIZE;
+static void prv_tok_reset(sShellTokens *tok) {
+  tok->state = kShellTokState_Space;
+  tok->size = 0;
+  tok->overflow = false;
+  tok->argc = 0;
 }
 
 static void prv_reset_rx_buffer(void) {
-  memset(s_shell.rx_buffer, 0, sizeof(s_shell.rx_buffer));
   s_shell.rx_size = 0;
+  prv_tok_reset(&s_line_tok);
+}
+
+static void prv_tok_append(sShellTokens *tok, char c) {
+  if (tok->size < tok->capacity) {
+    tok->buffer[tok->size++] = c;
+  } else {
+    tok->overflow = true;
+  }
+}
+
+static void prv_tok_push(sShellTokens *tok, char *arg) {
+  if (tok->argc < SHELL_MAX_ARGS) {
+    tok->argv[tok->argc] = arg;
+  }
+  tok->argc++;
+}
+
+static void prv_tok_start(sShellTokens *tok) {
+  prv_tok_push(tok, &tok->buffer[tok->size]);
+  tok->state = kShellTokState_Word;
+}
+
+static void prv_tok_end(sShellTokens *tok) {
+  prv_tok_append(tok, '\0');
+  tok->state = kShellTokState_Space;
+}
+
+// Splits arguments at spaces and tabs and commands at `;`. "..." groups,
+// also in the middle of an argument, and within quotes \" \\ \n and \t are
+// escapes.
+static void prv_tok_feed(sShellTokens *tok, char c) {
+  const bool is_space = (c == ' ' || c == '\t');
+  switch (tok->state) {
+    case kShellTokState_Space:
+      if (is_space) {
+        break;
+      }
+      if (c == ';') {
+        prv_tok_push(tok, NULL);
+        break;
+      }
+      prv_tok_start(tok);
+      if (c == '"') {
+        tok->state = kShellTokState_Quoted;
+      } else {
+        prv_tok_append(tok, c);
+      }
+      break;
+    case kShellTokState_Word:
+      if (is_space) {
+        prv_tok_end(tok);
+      } else if (c == ';') {
+        prv_tok_end(tok);
+        prv_tok_push(tok, NULL);
+      } else if (c == '"') {
+        tok->state = kShellTokState_Quoted;
+      } else {
+        prv_tok_append(tok, c);
+      }
+      break;
+    case kShellTokState_Quoted:
+      if (c == '"') {
+        tok->state = kShellTokState_Word;
+      } else if (c == '\\') {
+        tok->state = kShellTokState_Escape;
+      } else {
+        prv_tok_append(tok, c);
+      }
+      break;
+    case kShellTokState_Escape:
+      prv_tok_append(tok, (c == 'n') ? '\n' : (c == 't') ? '\t' : c);
+      tok->state = kShellTokState_Quoted;
+      break;
+  }
+}
+
+// Closes the last argument. Returns false, after saying why, if the input
+// can't run.
+static bool prv_tok_finish(sShellTokens *tok) {
+  const bool unterminated = (tok->state == kShellTokState_Quoted ||
+                             tok->state == kShellTokState_Escape);
+  if (tok->state == kShellTokState_Word) {
+    prv_tok_end(tok);
+  }
+  if (unterminated) {
+    prv_echo_str("Unterminated quote\n");
+    return false;
+  }
+  if (tok->overflow) {
+    prv_echo_str("Line too long\n");
+    return false;
+  }
+  if (tok->argc > SHELL_MAX_ARGS) {
+    prv_echo_str("Too many arguments\n");
+    return false;
+  }
+  return true;
+}
+
+// Only after a backspace, the state can't be unwound one character
+static void prv_tok_rescan(void) {
+  prv_tok_reset(&s_line_tok);
+  for (size_t i = 0; i < s_shell.rx_size; i++) {
+    prv_tok_feed(&s_line_tok, s_shell.rx_buffer[i]);
+  }
 }
 
 void prv_echo_str(const char *str) {
@@ -102,77 +350,421 @@ static void prv_send_prompt(void) {
   prv_echo_str(SHELL_PROMPT);
 }
 
-static const sShellCommand *prv_find_command(const char *name) {
-  SHELL_FOR_EACH_COMMAND(command) {
-    if (strcmp(command->command, name) == 0) {
-      return command;
+// table is sorted by name, see SHELL_COMMAND()
+static const sShellCommand *prv_search(const sShellCommand *table, size_t count,
+                                       const char *name) {
+  size_t lo = 0;
+  size_t hi = count;
+  while (lo < hi) {
+    const size_t mid = lo + (hi - lo) / 2;
+    const int cmp = strcmp(name, table[mid].command);
+    if (cmp == 0) {
+      return &table[mid];
+    }
+    if (cmp < 0) {
+      hi = mid;
+    } else {
+      lo = mid + 1;
     }
   }
   return NULL;
 }
 
-static void prv_process(void)
+static const sShellCommand *prv_search_linear(const sShellCommand *table, size_t count,
+                                              const char *name) {
+  for (size_t i = 0; i < count; i++) {
+    if (strcmp(table[i].command, name) == 0) {
+      return &table[i];
+    }
+  }
+  return NULL;
+}
+
+static size_t prv_num_commands(void) {
+  return (size_t)(__shell_cmds_end - __shell_cmds_start);
+}
+
+const sShellCommand *shell_find_command(const char *name) {
+  return prv_search(__shell_cmds_start, prv_num_commands(), name);
+}
+
+// Everything queued for the UART, on any channel
+static uint32_t prv_bytes_out(void)
+{
+  uint32_t total = 0;
+  for (int ch = 0; ch < kMuxChannel_Count; ch++) {
+    sMuxStats stats;
+    mux_get_stats((eMuxChannel)ch, &stats);
+    total += stats.queued;
+  }
+  return total;
+}
+
+static void prv_timing_start(const char *name, sShellCmdStats *stats, bool report)
 {
-  if (prv_last_char() != '\n' && !prv_is_rx_buffer_full()) {
+  if (s_timing[s_exec.depth - 1].pending && s_timing[s_exec.depth - 1].repeat) {
     return;
   }
+  s_timing[s_exec.depth - 1] = (sShellTiming) {
+    .pending = true,
+    .report = report,
+    .name = name,
+    .stats = stats,
+    .start_bytes = prv_bytes_out(),
+    .start_cycles = dwt_cyccnt_read(),
+  };
+}
+
+// frame is the one the command or macro was started from
+static void prv_timing_stop(int frame)
+{
+  sShellTiming *t = &s_timing[frame];
+  const uint32_t cycles = dwt_cyccnt_read() - t->start_cycles;
+  if (!t->pending || t->repeat) {
+    return;
+  }
+  t->pending = false;
+
+  sShellCmdStats *stats = t->stats;
+  if (stats != NULL) {
+    if (stats->runs == 0 || cycles < stats->min_cycles) {
+      stats->min_cycles = cycles;
+    }
+    if (cycles > stats->max_cycles) {
+      stats->max_cycles = cycles;
+    }
+    stats->total_cycles += cycles;
+    stats->runs++;
+  }
+
+  if (t->report) {
+    const uint32_t us = (uint32_t)((uint64_t)cycles * 1000000 / SystemCoreClock);
+    record_begin("time");
+    record_str("name", t->name);
+    record_u32("cycles", cycles);
+    record_u32("us", us);
+    record_u32("hz", SystemCoreClock);
+    record_u32("bytes", prv_bytes_out() - t->start_bytes);
+    record_end();
+  }
+}
+
+// Next command of the innermost frame, false once all of them ran
+static bool prv_exec_fetch(int *argc, char ***argv)
+{
+  while (s_exec.depth > 0) {
+    sShellFrame *f = &s_exec.frames[s_exec.depth - 1];
+    if (f->repeat_left > 0) {
+      f->repeat_left--;
+      *argc = f->repeat_argc;
+      *argv = &f->tok->argv[f->repeat_first];
+      return true;
+    }
+    if (s_timing[s_exec.depth - 1].repeat) {
+      s_timing[s_exec.depth - 1].repeat = false;
+      prv_timing_stop(s_exec.depth - 1); // the repeat that just ended
+    }
+    if (f->next >= f->tok->argc) {
+      s_exec.depth--;
+      if (s_exec.depth > 0) {
+        prv_timing_stop(s_exec.depth - 1); // the macro that just ended
+      }
+      continue;
+    }
 
-  char *argv[SHELL_MAX_ARGS] = {0};
-  int argc = 0;
+    const int first = f->next;
+    int end = first;
+    while (end < f->tok->argc && f->tok->argv[end] != NULL) {
+      end++;
+    }
+    f->next = end + 1;
+    if (end == first) {
+      continue; // empty command, e.g. ";;"
+    }
 
-  char *next_arg = NULL;
-  for (size_t i = 0; i < s_shell.rx_size && argc < SHELL_MAX_ARGS; ++i) {
-    char *const c = &s_shell.rx_buffer[i];
-    if (*c == ' ' || *c == '\n' || i == s_shell.rx_size - 1) {
-      *c = '\0';
-      if (next_arg) {
-        argv[argc++] = next_arg;
-        next_arg = NULL;
+    char **args = &f->tok->argv[first];
+    int n = end - first;
+    // prv_exec_command() takes `time` off anything else
+    const bool timed = n > 1 && strcmp(args[0], "time") == 0 &&
+        strcmp(args[1], "repeat") == 0;
+    if (timed) {
+      args++;
+      n--;
+    }
+    if (strcmp(args[0], "repeat") == 0) {
+      uint32_t times;
+      if (n < 3 || !shell_arg_u32(args[1], &times)) {
+        prv_echo_str("Expected repeat <count> <command>\n");
+        continue;
       }
-    } else if (!next_arg) {
-      next_arg = c;
+      f->repeat_left = times;
+      f->repeat_first = (int)(args - f->tok->argv) + 2;
+      f->repeat_argc = n - 2;
+      if (timed) {
+        prv_timing_start("repeat", NULL, true);
+        s_timing[s_exec.depth - 1].repeat = true;
+      }
+      continue;
     }
+
+    *argc = n;
+    *argv = args;
+    return true;
   }
+  return false;
+}
 
-  if (s_shell.rx_size == SHELL_RX_BUFFER_SIZE) {
-    prv_echo('\n');
+static void prv_exec_macro(const char *body)
+{
+  if (s_exec.depth >= (int)ARRAY_SIZE(s_exec.frames)) {
+    prv_echo_str("Macros can't run macros\n");
+    return;
+  }
+  prv_tok_reset(&s_macro_tok);
+  for (const char *c = body; *c != '\0'; c++) {
+    prv_tok_feed(&s_macro_tok, *c);
   }
+  if (!prv_tok_finish(&s_macro_tok)) {
+    return;
+  }
+  s_exec.frames[s_exec.depth++] = (sShellFrame) { .tok = &s_macro_tok };
+}
 
-  if (argc >= 1) {
-    const sShellCommand *command = prv_find_command(argv[0]);
-    if (!command) {
-      prv_echo_str("Unknown command: ");
-      prv_echo_str(argv[0]);
-      prv_echo('\n');
-      prv_echo_str("Type 'help' to list all commands\n");
-    } else {
-      command->handler(argc, argv);
+static void prv_exec_command(int argc, char *argv[])
+{
+  bool report = false;
+  if (strcmp(argv[0], "time") == 0 && argc > 1) {
+    report = true;
+    argc--;
+    argv++;
+  }
+
+  const sShellCommand *command = shell_find_command(argv[0]);
+  if (command != NULL) {
+    prv_timing_start(command->command, command->stats, report);
+    console_set_command_active(true);
+    command->handler(argc, argv);
+    console_set_command_active(false);
+    if (!shell_job_active()) {
+      prv_timing_stop(s_exec.depth - 1);
     }
+    return;
+  }
+
+  const char *body = macro_find(argv[0], NULL);
+  if (body != NULL) {
+    const int depth = s_exec.depth;
+    prv_timing_start(argv[0], NULL, report);
+    prv_exec_macro(body);
+    if (s_exec.depth == depth) {
+      prv_timing_stop(depth - 1); // didn't start
+    }
+    return;
+  }
+
+  prv_echo_str("Unknown command: ");
+  prv_echo_str(argv[0]);
+  prv_echo('\n');
+  prv_echo_str("Type 'help' to list all commands\n");
+}
+
+static void prv_exec_finish(void)
+{
+  if (s_exec.cancel) {
+    prv_echo_str("^C\n");
+  }
+  s_exec.active = false;
+  for (size_t i = 0; i < ARRAY_SIZE(s_timing); i++) {
+    s_timing[i].pending = false; // cancelled, doesn't count
   }
   prv_reset_rx_buffer();
   prv_send_prompt();
+
+  // what was typed meanwhile may start the next line, keep the rest for later
+  while (s_shell.typeahead_size != 0 && !s_exec.active) {
+    const char c = s_shell.typeahead[0];
+    memmove(s_shell.typeahead, &s_shell.typeahead[1], --s_shell.typeahead_size);
+    shell_receive_char(c);
+  }
+}
+
+// Runs one command, then yields so input and every other task get a turn
+// before the next one
+static void prv_exec_step(void)
+{
+  int argc;
+  char **argv;
+  if (s_exec.cancel || !prv_exec_fetch(&argc, &argv)) {
+    prv_exec_finish();
+    return;
+  }
+  prv_exec_command(argc, argv);
+  if (!shell_job_active()) {
+    sched_post(&s_job_task, SHELL_JOB_EVENT_STEP);
+  }
+}
+
+static void prv_process(void)
+{
+  if (!prv_tok_finish(&s_line_tok)) {
+    prv_reset_rx_buffer();
+    prv_send_prompt();
+    return;
+  }
+  s_exec = (struct ShellExec) {
+    .active = true,
+    .depth = 1,
+    .frames[0] = { .tok = &s_line_tok },
+  };
+  sched_post(&s_job_task, SHELL_JOB_EVENT_STEP);
+}
+
+static void prv_busy_input(char c)
+{
+  if (c == SHELL_CTRL_C) {
+    s_exec.cancel = true;
+    if (s_await.done != NULL) {
+      sched_post(&s_job_task, SHELL_JOB_EVENT_STEP);
+    }
+  } else if (s_await.done != NULL) {
+    // anything else is noise from a link not yet working
+    if (c == '\r' || c == '\n') {
+      s_await.entered = true;
+      sched_post(&s_job_task, SHELL_JOB_EVENT_STEP);
+    }
+  } else if (c == SHELL_CTRL_T) {
+    if (!shell_job_active()) {
+      return;
+    }
+    char line[64];
+    const uint32_t percent = s_job.total ?
+        (uint32_t)((uint64_t)s_job.done * 100 / s_job.total) : 0;
+    snprintf(line, sizeof(line), "\n%s: %d/%d (%d%%)\n", s_job.name,
+             (int)s_job.done, (int)s_job.total, (int)percent);
+    prv_echo_str(line);
+  } else if (s_shell.typeahead_size < sizeof(s_shell.typeahead)) {
+    s_shell.typeahead[s_shell.typeahead_size++] = c;
+  }
+}
+
+static void prv_job_handler(uint32_t events, void *ctx)
+{
+  if (events & SHELL_JOB_EVENT_TIMEOUT) {
+    s_await.timed_out = true;
+  }
+  if (shell_job_active()) {
+    int rv = 0;
+    // a cancelled await still has to hear about it
+    if (!s_exec.cancel || s_await.done != NULL) {
+      console_set_command_active(true);
+      rv = s_job.step(s_job.ctx);
+      console_set_command_active(false);
+    }
+    if (rv == SHELL_CMD_PENDING && !s_exec.cancel) {
+      if (s_await.done == NULL) {
+        sched_post(&s_job_task, SHELL_JOB_EVENT_STEP);
+      }
+      return;
+    }
+    s_job.step = NULL;
+    if (!s_exec.cancel) {
+      prv_timing_stop(s_exec.depth - 1);
+    }
+  }
+  if (s_exec.active) {
+    prv_exec_step();
+  }
+}
+
+int shell_job_start(const char *name, ShellJobStep step, void *ctx)
+{
+  if (shell_job_active()) {
+    return -1;
+  }
+  s_job = (struct ShellJob) { .name = name, .step = step, .ctx = ctx };
+  sched_post(&s_job_task, SHELL_JOB_EVENT_STEP);
+  return SHELL_CMD_PENDING;
+}
+
+void shell_job_progress(uint32_t done, uint32_t total)
+{
+  s_job.done = done;
+  s_job.total = total;
+}
+
+bool shell_job_active(void)
+{
+  return s_job.step != NULL;
+}
+
+static int prv_await_step(void *ctx)
+{
+  if (!s_await.entered && !s_await.timed_out && !s_exec.cancel) {
+    return SHELL_CMD_PENDING;
+  }
+  sched_timer_stop(&s_await_timer);
+  const ShellAwaitDone done = s_await.done;
+  const bool entered = s_await.entered;
+  s_await = (struct ShellAwait) { 0 };
+  return done(entered);
+}
+
+int shell_await_enter(const char *name, ShellAwaitDone done, uint32_t timeout_ms)
+{
+  if (shell_job_start(name, prv_await_step, NULL) < 0) {
+    return -1;
+  }
+  s_await = (struct ShellAwait) { .done = done };
+  sched_timer_start(&s_await_timer, timeout_ms);
+  return SHELL_CMD_PENDING;
 }
 
 void shell_receive_char(char c)
 {
-  if (c == '\r' || prv_is_rx_buffer_full() || !prv_booted()) {
+  if (!prv_booted()) {
+    return;
+  }
+  if (s_exec.active) {
+    prv_busy_input(c);
     return;
   }
+  if (c == SHELL_CTRL_C) {
+    // drop the line typed so far
+    prv_echo_str("^C\n");
+    prv_reset_rx_buffer();
+    prv_send_prompt();
+    return;
+  }
+  if (c == '\r') {
+    return;
+  }
+  if (s_line_tok.overflow && c != '\n') {
+    return; // dropped up to the end of the line, prv_tok_finish() refuses it
+  }
   const bool is_backspace = (c == '\b' || c == '\x7f');
   if (is_backspace && s_shell.rx_size == 0) {
     return; // nothing left to delete so don't echo the backspace
   }
+  if (!is_backspace && c != '\n' && prv_is_rx_buffer_full()) {
+    // running what fits would run a different command, mw a partial blob
+    s_line_tok.overflow = true;
+    return;
+  }
 
   prv_echo(c);
 
   if (is_backspace) {
-    s_shell.rx_buffer[--s_shell.rx_size] = '\0';
+    s_shell.rx_size--;
+    prv_tok_rescan();
+    return;
+  }
+  if (c == '\n') {
+    prv_process();
     return;
   }
 
   s_shell.rx_buffer[s_shell.rx_size++] = c;
-
-  prv_process();
+  prv_tok_feed(&s_line_tok, c);
 }
 
 void shell_put_line(const char *str)
@@ -192,6 +784,38 @@ void shell_boot(const sShellImpl *impl)
   prv_echo_str("\n" SHELL_PROMPT);
 }
 
+static void prv_run_boot_macro(void)
+{
+  const char *name;
+  const char *body = macro_find_boot(&name);
+  if (body == NULL) {
+    return;
+  }
+  // as if typed, Ctrl-C stops it between two commands
+  prv_echo_str(name);
+  prv_echo('\n');
+  // a body may be longer than a typed line, prv_tok_finish() turns it down
+  for (const char *c = body; *c != '\0'; c++) {
+    prv_tok_feed(&s_line_tok, *c);
+  }
+  prv_process();
+}
+
+// Runs whatever arrived, commands execute here once their line is complete
+static void prv_shell_rx_handler(uint32_t events, void *ctx)
+{
+  if (events & SHELL_EVENT_BOOT) {
+    prv_run_boot_macro();
+  }
+
+  char c;
+  while (shell_getchar(&c)) {
+    if (!dbg_proto_receive_char((uint8_t)c)) {
+      shell_receive_char(c);
+    }
+  }
+}
+
 void shell_processing_loop(void)
 {
   const sShellImpl shell_impl = {
@@ -199,11 +823,101 @@ void shell_processing_loop(void)
   };
   shell_boot(&shell_impl);
 
-  while (1) {
-    char c;
-    if (shell_getchar(&c)) {
-      shell_receive_char(c);
+  sched_task_add(&s_shell_task);
+  sched_task_add(&s_job_task);
+  sched_post(&s_shell_task, SHELL_EVENT_BOOT);
+  sched_run();
+}
+
+int shell_help_handler(int argc, char *argv[])
+{
+  SHELL_FOR_EACH_COMMAND(command) {
+    prv_echo_str(command->command);
+    prv_echo_str(": ");
+    prv_echo_str(command->help);
+    prv_echo('\n');
+  }
+  return 0;
+}
+
+SHELL_COMMAND(help, shell_help_handler, "Lists all commands");
+
+// Only reached for a repeat within a repeat, the executor handles the rest
+static int prv_repeat(int argc, char *argv[])
+{
+  logp("repeat can't be nested");
+  return -1;
+}
+
+SHELL_COMMAND(repeat, prv_repeat, "Run a command <count> times: repeat <count> <command>");
+
+// Only reached without a command after it, the executor handles the rest
+static int prv_time(int argc, char *argv[])
+{
+  logp("Expected time <command>");
+  return -1;
+}
+
+SHELL_COMMAND(time, prv_time,
+              "Run a command and report its cycles, time and output bytes: time <command>");
+
+static int prv_cmdstats(int argc, char *argv[])
+{
+  const bool reset = (argc > 1 && strcmp(argv[1], "reset") == 0);
+  SHELL_FOR_EACH_COMMAND(command) {
+    sShellCmdStats *stats = command->stats;
+    if (reset) {
+      *stats = (sShellCmdStats) { 0 };
+    } else if (stats->runs != 0) {
+      record_begin("cmdstats");
+      record_str("name", command->command);
+      record_u32("runs", stats->runs);
+      record_u32("min", stats->min_cycles);
+      record_u32("avg", (uint32_t)(stats->total_cycles / stats->runs));
+      record_u32("max", stats->max_cycles);
+      record_end();
+    }
+  }
+  return 0;
+}
+
+SHELL_COMMAND(cmdstats, prv_cmdstats, "Show cycles per command since boot [reset]");
+
+// Average cycles to look up every command of the first n table entries, by
+// binary search and by the linear scan it replaced, for n doubling up to
+// the whole table. make SHELL_BENCH_CMDS=<n> pads the table.
+static int prv_shell_bench(int argc, char *argv[])
+{
+  const size_t total = prv_num_commands();
+  // keeps the lookups from being optimized away
+  const sShellCommand *volatile found;
+
+  dwt_cyccnt_enable();
+  for (size_t n = 1; ; n *= 2) {
+    if (n > total) {
+      n = total;
+    }
+
+    uint32_t binary = 0;
+    uint32_t linear = 0;
+    for (size_t i = 0; i < n; i++) {
+      const char *name = __shell_cmds_start[i].command;
+      uint32_t start = dwt_cyccnt_read();
+      found = prv_search(__shell_cmds_start, n, name);
+      binary += dwt_cyccnt_read() - start;
+      start = dwt_cyccnt_read();
+      found = prv_search_linear(__shell_cmds_start, n, name);
+      linear += dwt_cyccnt_read() - start;
+    }
+    (void)found;
+    logp("shell_bench: %d commands, %d cycles per lookup (linear scan %d)",
+         (int)n, (int)(binary / n), (int)(linear / n));
+
+    if (n == total) {
+      break;
     }
   }
+  return 0;
 }
 
+SHELL_COMMAND(shell_bench, prv_shell_bench, "Measure command lookup cost against table size");
@@ -0,0 +1,156 @@
+#include "shell_args.h"
+#include "dummy.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Defined by the linker script
+extern uint32_t _sdata, _edata, _sbss, _ebss, _estack;
+
+static const struct {
+  const char *name;
+  const void *addr;
+} s_linker_symbols[] = {
+  { "_sdata", &_sdata },
+  { "_edata", &_edata },
+  { "_sbss", &_sbss },
+  { "_ebss", &_ebss },
+  { "_estack", &_estack },
+};
+
+bool shell_arg_u32(const char *arg, uint32_t *out)
+{
+  // strtoul() would take leading blanks and a sign, negating the value
+  if (arg == NULL || *arg < '0' || *arg > '9') {
+    return false;
+  }
+  char *end;
+  errno = 0;
+  const unsigned long value = strtoul(arg, &end, 0);
+  // unsigned long is 64 bits on the host
+  if (*end != '\0' || errno == ERANGE || value > UINT32_MAX) {
+    return false;
+  }
+  *out = (uint32_t)value;
+  return true;
+}
+
+// name is not NUL terminated, it is the first len chars
+static bool prv_lookup_symbol(const char *name, size_t len, uint32_t *out)
+{
+  for (size_t i = 0; i < dummy_num; i++) {
+    const char *sym = s_dummy_funcs[i].name;
+    if (strlen(sym) == len && strncmp(sym, name, len) == 0) {
+      *out = (uint32_t)s_dummy_funcs[i].func & ~0x1u;
+      return true;
+    }
+  }
+  for (size_t i = 0; i < sizeof(s_linker_symbols) / sizeof(s_linker_symbols[0]); i++) {
+    const char *sym = s_linker_symbols[i].name;
+    if (strlen(sym) == len && strncmp(sym, name, len) == 0) {
+      *out = (uint32_t)s_linker_symbols[i].addr;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool shell_arg_addr(const char *arg, uint32_t *out)
+{
+  if (arg == NULL) {
+    return false;
+  }
+  if (shell_arg_u32(arg, out)) {
+    return true;
+  }
+
+  const char *plus = strchr(arg, '+');
+  const size_t name_len = (plus != NULL) ? (size_t)(plus - arg) : strlen(arg);
+  uint32_t base;
+  if (!prv_lookup_symbol(arg, name_len, &base)) {
+    return false;
+  }
+  uint32_t offset = 0;
+  if (plus != NULL && !shell_arg_u32(plus + 1, &offset)) {
+    return false;
+  }
+  *out = base + offset;
+  return true;
+}
+
+bool shell_arg_range(const char *arg, uint32_t *addr, uint32_t *len)
+{
+  if (arg == NULL) {
+    return false;
+  }
+  // the address may hold a symbol+offset itself, so split at the last '+'
+  const char *sep = strstr(arg, "..");
+  const size_t sep_len = (sep != NULL) ? 2 : 1;
+  if (sep == NULL) {
+    sep = strrchr(arg, '+');
+  }
+  if (sep == NULL || sep == arg) {
+    return false;
+  }
+
+  char start_arg[48];
+  const size_t start_len = (size_t)(sep - arg);
+  if (start_len >= sizeof(start_arg)) {
+    return false;
+  }
+  memcpy(start_arg, arg, start_len);
+  start_arg[start_len] = '\0';
+
+  uint32_t start;
+  uint32_t value;
+  if (!shell_arg_addr(start_arg, &start) || !shell_arg_addr(sep + sep_len, &value)) {
+    return false;
+  }
+  if (sep_len == 2) {
+    if (value < start) {
+      return false;
+    }
+    value -= start;
+  }
+  *addr = start;
+  *len = value;
+  return true;
+}
+
+static int prv_hex_digit(char c)
+{
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+bool shell_arg_hex(const char *arg, uint8_t *buf, size_t size, size_t *len)
+{
+  if (arg == NULL) {
+    return false;
+  }
+  if (arg[0] == '0' && (arg[1] == 'x' || arg[1] == 'X')) {
+    arg += 2;
+  }
+  const size_t digits = strlen(arg);
+  if (digits == 0 || (digits % 2) != 0 || digits / 2 > size) {
+    return false;
+  }
+  for (size_t i = 0; i < digits / 2; i++) {
+    const int hi = prv_hex_digit(arg[2 * i]);
+    const int lo = prv_hex_digit(arg[2 * i + 1]);
+    if (hi < 0 || lo < 0) {
+      return false;
+    }
+    buf[i] = (uint8_t)((hi << 4) | lo);
+  }
+  *len = digits / 2;
+  return true;
+}
@@ -1,28 +1,37 @@
 #include "shell_cmd.h"
 #include "main.h"
 #include "dummy.h"
+#include "usart.h"
+#include "mux.h"
+#include "console.h"
+#include "dbg.h"
+#include "dbg_proto.h"
+#include "shell.h"
+#include "shell_args.h"
+#include "record.h"
 #include <stdbool.h>
 
 
 
-static int prv_issue_breakpoint(int argc, char *argv[]) {
-  __asm("bkpt 1");
-  return 0;
-}
-
 static int prv_dump_fpb_config(int argc, char *argv[]) {
   fpb_dump_breakpoint_config();
   return 0;
 }
 
+SHELL_COMMAND(fpb_dump, prv_dump_fpb_config, "Dump Active FPB Settings");
+
 static int prv_fpb_set_breakpoint(int argc, char *argv[]) {
   if (argc < 3) {
     logp("Expected [Comp Id] [Address]");
     return -1;
   }
 
-  size_t comp_id = strtoul(argv[1], NULL, 0x0);
-  uint32_t addr = strtoul(argv[2], NULL, 0x0);
+  uint32_t comp_id;
+  uint32_t addr;
+  if (!shell_arg_u32(argv[1], &comp_id) || !shell_arg_addr(argv[2], &addr)) {
+    logp("Expected [Comp Id] [Address]");
+    return -1;
+  }
 
   bool success = fpb_set_breakpoint(comp_id, addr);
   logp("Set breakpoint on address 0x%x in FP_COMP[%d] %s", addr,
@@ -31,55 +40,463 @@ static int prv_fpb_set_breakpoint(int argc, char *argv[]) {
   return success ? 0 : -1;
 }
 
+SHELL_COMMAND(fpb_set_breakpoint, prv_fpb_set_breakpoint,
+              "Set Breakpoint [Comp Id] [Address]");
+
 static int prv_debug_monitor_enable(int argc, char *argv[]) {
   debug_monitor_enable();
   return 0;
 }
 
+SHELL_COMMAND(debug_mon_en, prv_debug_monitor_enable, "Enable Monitor Debug Mode");
+
 static int prv_debug_monitor_disable(int argc, char *argv[]) {
   debug_monitor_disable();
   return 0;
 }
 
+SHELL_COMMAND(debug_mon_off, prv_debug_monitor_disable, "Disable Monitor Debug Mode");
+
+// one function per slice, so a breakpoint in one doesn't stall the others
+static int prv_call_dummy_step(void *ctx) {
+  size_t *next = ctx;
+  s_dummy_funcs[*next].func();
+  shell_job_progress(++*next, dummy_num);
+  return (*next < dummy_num) ? SHELL_CMD_PENDING : 0;
+}
+
 static int prv_call_dummy_funcs(int argc, char *argv[]) {
-  for (size_t i = 0; i < dummy_num; i++) {
-    s_dummy_funcs[i].func();
-  }
-  return 0;
+  static size_t s_next;
+  s_next = 0;
+  return shell_job_start("call_dummy_funcs", prv_call_dummy_step, &s_next);
 }
 
+SHELL_COMMAND(call_dummy_funcs, prv_call_dummy_funcs, "Invoke dummy functions");
+
 static int prv_dump_dummy_funcs(int argc, char *argv[]) {
   for (size_t i = 0; i < dummy_num; i++) {
     const sDummyFunction *d = &s_dummy_funcs[i];
     // physical address is function address with thumb bit removed
     volatile uint32_t *addr = (uint32_t *)(((uint32_t)d->func) & ~0x1);
-    logp("%s: Starts at 0x%x. First Instruction = 0x%x", d->name, addr, *addr);
+    record_begin("dummy_func");
+    record_str("name", d->name);
+    record_hex("addr", (uint32_t)addr);
+    record_hex("insn", *addr);
+    record_end();
+  }
+
+  return 0;
+}
+
+SHELL_COMMAND(dump_dummy_funcs, prv_dump_dummy_funcs,
+              "Print first instruction of each dummy function");
+
+static int prv_rx_stats(int argc, char *argv[]) {
+  if (argc > 1 && strcmp(argv[1], "reset") == 0) {
+    uart_rx_reset_stats();
+    return 0;
+  }
+
+  sUartRxStats stats;
+  uart_rx_get_stats(&stats);
+  record_begin("rx");
+  record_u32("bytes", stats.rx_bytes);
+  record_u32("dropped", stats.dropped);
+  record_u32("errors", stats.errors);
+  record_u32("publish_events", stats.publish_events);
+  record_u32("throttled", stats.throttled);
+  record_str("mode", UART_RX_DMA ? "dma" : "byte");
+  record_end();
+  return 0;
+}
+
+SHELL_COMMAND(rx_stats, prv_rx_stats, "Show UART receive counters [reset]");
+
+static int prv_rx_bench(int argc, char *argv[]) {
+  uint32_t timeout_s = 5;
+  // pretend to be a slow consumer, to see flow control at work
+  uint32_t stall_ms = 0;
+  if ((argc > 1 && !shell_arg_u32(argv[1], &timeout_s)) ||
+      (argc > 2 && !shell_arg_u32(argv[2], &stall_ms))) {
+    logp("Expected [timeout s] [stall ms per 64 bytes]");
+    return -1;
+  }
+  const uint32_t timeout_ms = timeout_s * 1000;
+  // end of measurement once the host has been quiet this long
+  const uint32_t idle_ms = 500;
+
+  logp("rx_bench: send data now (%d ms)", (int)timeout_ms);
+
+  sUartRxStats before;
+  uart_rx_get_stats(&before);
+
+  uint32_t consumed = 0;
+  uint32_t first_rx = 0;
+  uint32_t last_rx = 0;
+  const uint32_t start = HAL_GetTick();
+  while (1) {
+    const uint32_t now = HAL_GetTick();
+    char c;
+    if (shell_getchar(&c)) {
+      if (consumed++ == 0) {
+        first_rx = now;
+      }
+      last_rx = now;
+      if (stall_ms != 0 && (consumed % 64) == 0) {
+        HAL_Delay(stall_ms);
+      }
+      continue;
+    }
+
+    if (consumed == 0 ? (now - start >= timeout_ms) : (now - last_rx >= idle_ms)) {
+      break;
+    }
   }
 
+  sUartRxStats after;
+  uart_rx_get_stats(&after);
+
+  const uint32_t elapsed_ms = last_rx - first_rx;
+  const uint32_t rate = elapsed_ms ? (uint32_t)((uint64_t)consumed * 1000 / elapsed_ms) : 0;
+  logp("rx_bench: %d bytes in %d ms, %d bytes/s, dropped %d, errors %d",
+       (int)consumed, (int)elapsed_ms, (int)rate,
+       (int)(after.dropped - before.dropped), (int)(after.errors - before.errors));
   return 0;
 }
 
-static int shell_help_handler(int argc, char *argv[])
-{
-  SHELL_FOR_EACH_COMMAND(command) {
-    prv_echo_str(command->command);
-    prv_echo_str(": ");
-    prv_echo_str(command->help);
-    prv_echo('\n');
+SHELL_COMMAND(rx_bench, prv_rx_bench,
+              "Count incoming bytes until the line goes idle [timeout s] [stall ms per 64 bytes]");
+
+static const char *const s_tx_policy_names[] = {
+  [kMuxPolicy_Block] = "block",
+  [kMuxPolicy_DropOldest] = "drop_oldest",
+  [kMuxPolicy_DropNewest] = "drop_newest",
+};
+
+static bool prv_parse_channel(const char *name, eMuxChannel *ch) {
+  for (size_t i = 0; i < kMuxChannel_Count; i++) {
+    if (strcmp(name, mux_channel_name((eMuxChannel)i)) == 0) {
+      *ch = (eMuxChannel)i;
+      return true;
+    }
   }
+  logp("Unknown channel '%s'", name);
+  return false;
+}
+
+static int prv_tx_stats(int argc, char *argv[]) {
+  for (size_t i = 0; i < kMuxChannel_Count; i++) {
+    sMuxStats stats;
+    uint8_t priority, weight;
+    mux_get_stats((eMuxChannel)i, &stats);
+    mux_get_sched((eMuxChannel)i, &priority, &weight);
+    record_begin("tx");
+    record_str("channel", mux_channel_name((eMuxChannel)i));
+    record_u32("queued", stats.queued);
+    record_u32("sent", stats.sent);
+    record_u32("dropped", stats.dropped);
+    record_str("policy", s_tx_policy_names[mux_get_policy((eMuxChannel)i)]);
+    record_u32("prio", priority);
+    record_u32("weight", weight);
+    record_end();
+  }
+  record_begin("tx_wire");
+  record_u32("bytes", uart_tx_get_sent());
+  record_str("mode", MUX_FRAMED ? "framed" : "raw");
+  record_end();
   return 0;
 }
 
-static const sShellCommand s_shell_commands[] = {
-  {"bkpt", prv_issue_breakpoint, "Issue a Breakpoint Instruction" },
-  {"debug_mon_en", prv_debug_monitor_enable, "Enable Monitor Debug Mode" },
-  {"debug_mon_off", prv_debug_monitor_disable, "Disable Monitor Debug Mode" },
-  {"fpb_dump", prv_dump_fpb_config, "Dump Active FPB Settings"},
-  {"fpb_set_breakpoint", prv_fpb_set_breakpoint, "Set Breakpoint [Comp Id] [Address]"},
-  {"call_dummy_funcs", prv_call_dummy_funcs, "Invoke dummy functions"},
-  {"dump_dummy_funcs", prv_dump_dummy_funcs, "Print first instruction of each dummy function"},
-  {"help", shell_help_handler, "Lists all commands"},
+SHELL_COMMAND(tx_stats, prv_tx_stats, "Show per channel transmit queue counters");
+
+static int prv_tx_policy(int argc, char *argv[]) {
+  eMuxChannel ch;
+  if (argc < 3) {
+    logp("Expected [channel] [block|drop_oldest|drop_newest]");
+    return -1;
+  }
+  if (!prv_parse_channel(argv[1], &ch)) {
+    return -1;
+  }
+
+  for (size_t i = 0; i < ARRAY_SIZE(s_tx_policy_names); i++) {
+    if (strcmp(argv[2], s_tx_policy_names[i]) == 0) {
+      mux_set_policy(ch, (eMuxPolicy)i);
+      return 0;
+    }
+  }
+  logp("Unknown policy '%s'", argv[2]);
+  return -1;
+}
+
+SHELL_COMMAND(tx_policy, prv_tx_policy,
+              "Set a channel's back-pressure policy [channel] [block|drop_oldest|drop_newest]");
+
+static int prv_tx_sched(int argc, char *argv[]) {
+  eMuxChannel ch;
+  if (argc < 4) {
+    logp("Expected [channel] [priority] [weight]");
+    return -1;
+  }
+  if (!prv_parse_channel(argv[1], &ch)) {
+    return -1;
+  }
+
+  uint32_t prio;
+  uint32_t weight;
+  if (!shell_arg_u32(argv[2], &prio) || !shell_arg_u32(argv[3], &weight) ||
+      prio > UINT8_MAX || weight > UINT8_MAX) {
+    logp("Expected [channel] [priority] [weight]");
+    return -1;
+  }
+
+  mux_set_sched(ch, (uint8_t)prio, (uint8_t)weight);
+  return 0;
+}
+
+SHELL_COMMAND(tx_sched, prv_tx_sched,
+              "Set a channel's priority and weight [channel] [priority] [weight]");
+
+static const char *const s_flow_names[] = {
+  [kUartFlow_None] = "none",
+  [kUartFlow_RtsCts] = "rtscts",
+  [kUartFlow_XonXoff] = "xonxoff",
 };
 
-const sShellCommand *const g_shell_commands = s_shell_commands;
-const size_t g_num_shell_commands = ARRAY_SIZE(s_shell_commands);
+static int prv_flow(int argc, char *argv[]) {
+  if (argc < 2) {
+    logp("Flow control: %s%s", s_flow_names[uart_get_flow()],
+         uart_rx_throttled() ? " (throttled)" : "");
+    return 0;
+  }
+
+  for (size_t i = 0; i < ARRAY_SIZE(s_flow_names); i++) {
+    if (strcmp(argv[1], s_flow_names[i]) == 0) {
+      uart_set_flow((eUartFlow)i);
+      return 0;
+    }
+  }
+  logp("Unknown flow control '%s'", argv[1]);
+  return -1;
+}
+
+SHELL_COMMAND(flow, prv_flow, "Show or set UART flow control [none|rtscts|xonxoff]");
+
+// the rate to go back to unless Enter arrives at the new one
+static uint32_t s_baud_old;
+static uint32_t s_baud_new;
+
+static int prv_baud_done(bool entered) {
+  if (entered) {
+    logp("Baud now %d", (int)s_baud_new);
+    return 0;
+  }
+  uart_set_baud(s_baud_old);
+  logp("No answer, back to %d baud", (int)s_baud_old);
+  return -1;
+}
+
+static int prv_baud(int argc, char *argv[]) {
+  const uint32_t old_baud = uart_get_baud();
+  if (argc < 2) {
+    logp("Baud: %d (min %d, max %d at PCLK2 %d Hz)", (int)old_baud,
+         (int)uart_get_min_baud(), (int)uart_get_max_baud(), (int)HAL_RCC_GetPCLK2Freq());
+    return 0;
+  }
+
+  uint32_t baud = 0;
+  if (strcmp(argv[1], "max") == 0) {
+    baud = uart_get_max_baud();
+  } else if (!shell_arg_u32(argv[1], &baud)) {
+    logp("Expected [rate|max]");
+    return -1;
+  }
+  if (baud < uart_get_min_baud() || baud > uart_get_max_baud()) {
+    logp("Baud %d out of range, %d to %d", (int)baud, (int)uart_get_min_baud(),
+         (int)uart_get_max_baud());
+    return -1;
+  }
+
+  const uint32_t actual = uart_get_actual_baud(baud);
+  logp("Switching to %d baud (actual %d), press Enter within %d ms to keep it",
+       (int)baud, (int)actual, UART_BAUD_CONFIRM_TIMEOUT_MS);
+  s_baud_old = old_baud;
+  s_baud_new = baud;
+  uart_set_baud(baud);
+
+  // Only a clean CR/LF counts, garbage from a host still on the old rate
+  // doesn't. The other tasks keep running while it waits.
+  return shell_await_enter("baud", prv_baud_done, UART_BAUD_CONFIRM_TIMEOUT_MS);
+}
+
+SHELL_COMMAND(baud, prv_baud, "Show or switch the UART baud rate [rate|max]");
+
+static int prv_linktest(int argc, char *argv[]) {
+  uint32_t total = 4096;
+  if (argc > 1 && !shell_arg_u32(argv[1], &total)) {
+    logp("Expected [bytes]");
+    return -1;
+  }
+  static const char s_line[] =
+      "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ\r\n";
+
+  uart_tx_flush();
+  const uint32_t start = HAL_GetTick();
+  for (uint32_t sent = 0; sent < total; ) {
+    const uint32_t n = (total - sent < sizeof(s_line) - 1) ? total - sent :
+        sizeof(s_line) - 1;
+    sent += mux_write(kMuxChannel_Bulk, s_line, n);
+  }
+  uart_tx_flush();
+  const uint32_t elapsed_ms = HAL_GetTick() - start;
+
+  const uint32_t baud = uart_get_baud();
+  const uint32_t rate = elapsed_ms ? (uint32_t)((uint64_t)total * 1000 / elapsed_ms) : 0;
+  // 8N1 puts 10 bits on the wire for every byte
+  logp("\r\nlinktest: %d bytes in %d ms, %d bytes/s at %d baud (%d%% of line rate)",
+       (int)total, (int)elapsed_ms, (int)rate, (int)baud,
+       (int)((uint64_t)rate * 1000 / baud));
+  return 0;
+}
+
+SHELL_COMMAND(linktest, prv_linktest, "Measure effective TX throughput [bytes]");
+
+// CPU cycles the USART1 interrupt spends getting len bytes onto the wire
+static void prv_uart_bench_irq(const char *what, uint32_t len) {
+  static const uint8_t s_burst[256] = { 0 };
+
+  uart_tx_flush();
+  uart_reset_irq_profile();
+  mux_write(kMuxChannel_Bulk, s_burst, len);
+  uart_tx_flush();
+
+  uint32_t cycles, count;
+  uart_get_irq_profile(&cycles, &count);
+  logp("uart_bench: %s: %d cycles in %d interrupts, %d per byte", what,
+       (int)cycles, (int)count, (int)(cycles / len));
+}
+
+static int prv_uart_bench(int argc, char *argv[]) {
+  dwt_cyccnt_enable();
+  logp("uart_bench: %s backend, %d baud, SYSCLK %d Hz", UART_LL ? "register" : "HAL",
+       (int)uart_get_baud(), (int)HAL_RCC_GetSysClockFreq());
+
+  prv_uart_bench_irq("1 byte", 1);
+  prv_uart_bench_irq("256 byte burst", 256);
+
+  // what a blocking write of one byte costs the caller with the data
+  // register already empty
+  const uint8_t byte = 0;
+  uart_tx_flush();
+  uint32_t start = dwt_cyccnt_read();
+  uart_tx_poll_byte(byte);
+  const uint32_t poll = dwt_cyccnt_read() - start;
+#if !UART_LL
+  uart_tx_flush();
+  start = dwt_cyccnt_read();
+  // returns only once the byte has left the shift register (TC)
+  HAL_UART_Transmit(&huart1, (uint8_t *)&byte, 1, 10);
+  const uint32_t hal = dwt_cyccnt_read() - start;
+  uart_tx_flush();
+  logp("uart_bench: polled byte %d cycles, HAL_UART_Transmit() %d cycles",
+       (int)poll, (int)hal);
+#else
+  uart_tx_flush();
+  logp("uart_bench: polled byte %d cycles", (int)poll);
+#endif
+  return 0;
+}
+
+SHELL_COMMAND(uart_bench, prv_uart_bench,
+              "Measure USART1 driver cycles per byte and per burst");
+
+static int prv_logbench(int argc, char *argv[]) {
+  const uint32_t iterations = 8;
+
+  dwt_cyccnt_enable();
+  uart_tx_flush();
+  const uint32_t start = dwt_cyccnt_read();
+  for (uint32_t i = 0; i < iterations; i++) {
+    logp("logbench %d 0x%08x %s", (int)i, (int)i, __func__);
+  }
+  const uint32_t cycles = dwt_cyccnt_read() - start;
+
+  uart_tx_flush();
+  logp("logbench: %d cycles per logp() (%s)", (int)(cycles / iterations),
+       LOG_DEFERRED ? "deferred" : "vsnprintf");
+  return 0;
+}
+
+SHELL_COMMAND(logbench, prv_logbench, "Measure the cost of one logp() call in cycles");
+
+// per record, machine formats take bigger bites to save on framing
+#define MD_BYTES_PER_LINE (16)
+#define MD_BYTES_PER_RECORD (64)
+#define MD_RECORDS_PER_STEP (4)
+
+static struct {
+  uint32_t addr;
+  uint32_t len;
+  uint32_t offset;
+} s_md;
+
+static int prv_md_step(void *ctx) {
+  const uint32_t chunk = (record_get_format() == kRecordFormat_Text) ?
+      MD_BYTES_PER_LINE : MD_BYTES_PER_RECORD;
+  for (int r = 0; r < MD_RECORDS_PER_STEP && s_md.offset < s_md.len; r++) {
+    const uint32_t n = (s_md.len - s_md.offset < chunk) ? s_md.len - s_md.offset : chunk;
+    record_begin("mem");
+    record_hex("addr", s_md.addr + s_md.offset);
+    uint8_t data[MD_BYTES_PER_RECORD];
+    dbg_proto_mem_read(data, s_md.addr + s_md.offset, n);
+    record_bytes("data", data, n);
+    record_end();
+    s_md.offset += n;
+  }
+  shell_job_progress(s_md.offset, s_md.len);
+  return (s_md.offset < s_md.len) ? SHELL_CMD_PENDING : 0;
+}
+
+static int prv_md(int argc, char *argv[]) {
+  uint32_t addr;
+  uint32_t len;
+  const bool ok = (argc == 2) ? shell_arg_range(argv[1], &addr, &len) :
+      (argc == 3 && shell_arg_addr(argv[1], &addr) && shell_arg_u32(argv[2], &len));
+  if (!ok) {
+    logp("Expected <addr> <len> or <addr>+<len> or <addr>..<end>");
+    return -1;
+  }
+  if (!dbg_proto_read_ok(addr, len)) {
+    logp("Can't read 0x%x bytes at 0x%x", (int)len, (int)addr);
+    return -1;
+  }
+  s_md.addr = addr;
+  s_md.len = len;
+  s_md.offset = 0;
+  return shell_job_start("md", prv_md_step, NULL);
+}
+
+SHELL_COMMAND(md, prv_md, "Hex dump memory <addr> <len> or <range>, Ctrl-C stops, Ctrl-T shows progress");
+
+#define MW_MAX_BYTES (SHELL_LINE_MAX / 2)
+
+static int prv_mw(int argc, char *argv[]) {
+  static uint8_t s_data[MW_MAX_BYTES];
+  uint32_t addr;
+  size_t len;
+  if (argc < 3 || !shell_arg_addr(argv[1], &addr) ||
+      !shell_arg_hex(argv[2], s_data, sizeof(s_data), &len)) {
+    logp("Expected <addr> <hex bytes>");
+    return -1;
+  }
+  // not flash, a plain store there HardFaults
+  if (!dbg_proto_write_ok(addr, len)) {
+    logp("Can't write 0x%x bytes at 0x%x", (int)len, (int)addr);
+    return -1;
+  }
+  memcpy((void *)addr, s_data, len);
+  logp("Wrote %d bytes at 0x%x", (int)len, (int)addr);
+  return 0;
+}
+
+SHELL_COMMAND(mw, prv_mw, "Write bytes to memory <addr> <hex bytes>, e.g. mw _sdata 0011aabb");
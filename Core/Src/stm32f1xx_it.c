@@ -3,10 +3,11 @@
 #include "stm32f1xx_it.h"
 #include "shell.h"
 #include "dbg.h"
+#include "usart.h"
+#include "sched.h"
 /* Private includes ----------------------------------------------------------*/
 
 /* External variables --------------------------------------------------------*/
-extern UART_HandleTypeDef huart1;
 /******************************************************************************/
 /*           Cortex-M3 Processor Interruption and Exception Handlers          */
 /******************************************************************************/
@@ -67,8 +68,17 @@ void SVC_Handler(void)
 {
 }
 
+// The QEMU build goes through qemu_debug_mon() first, see Qemu/Src/qemu_regs.c
+#ifndef DEBUG_MON_HANDLER_C
+#define DEBUG_MON_HANDLER_C debug_monitor_handler_c
+#endif
+#define DEBUG_MON_STR(_x) DEBUG_MON_STR_(_x)
+#define DEBUG_MON_STR_(_x) #_x
+
 /**
   * @brief This function handles Debug monitor.
+  *        Saves what the core doesn't stack into g_debug_context, and puts
+  *        it back afterwards, with whatever the monitor changed.
   */
 __attribute__((naked))
 void DebugMon_Handler(void)
@@ -78,7 +88,21 @@ void DebugMon_Handler(void)
       "ite eq \n"
       "mrseq r0, msp \n"
       "mrsne r0, psp \n"
-      "b debug_monitor_handler_c \n");
+      "ldr r1, =g_debug_context \n"
+      "stmia r1!, {r4-r11} \n"
+      "mrs r2, primask \n"
+      "mrs r3, basepri \n"
+      "mrs r12, control \n"
+      "stmia r1, {r2, r3, r12, lr} \n"
+      "bl " DEBUG_MON_STR(DEBUG_MON_HANDLER_C) " \n"
+      "ldr r1, =g_debug_context \n"
+      "ldmia r1!, {r4-r11} \n"
+      "ldmia r1, {r2, r3, r12, lr} \n"
+      "msr primask, r2 \n"
+      "msr basepri, r3 \n"
+      "msr control, r12 \n"
+      "isb \n"
+      "bx lr \n");
 }
 
 /**
@@ -86,6 +110,7 @@ void DebugMon_Handler(void)
   */
 void PendSV_Handler(void)
 {
+  sched_timer_irq();
 }
 
 /**
@@ -94,6 +119,7 @@ void PendSV_Handler(void)
 void SysTick_Handler(void)
 {
   HAL_IncTick();
+  sched_tick();
 }
 
 /******************************************************************************/
@@ -108,5 +134,15 @@ void SysTick_Handler(void)
   */
 void USART1_IRQHandler(void)
 {
-  HAL_UART_IRQHandler(&huart1);
+  uart_irq();
+}
+
+#if UART_RX_DMA
+/**
+  * @brief This function handles DMA1 channel5 global interrupt (USART1_RX).
+  */
+void DMA1_Channel5_IRQHandler(void)
+{
+  uart_rx_dma_irq();
 }
+#endif
@@ -0,0 +1,312 @@
+#include "trace.h"
+#include "bkpt.h"
+#include "console.h"
+#include "core_regs.h"
+#include "dbg_proto.h"
+#include "main.h"
+#include "record.h"
+#include "ring.h"
+#include "shell_args.h"
+#include "shell_cmd.h"
+#include <string.h>
+
+typedef struct {
+  uint32_t addr;
+  // 1 << eDebugReg
+  uint32_t regs;
+  uint32_t words[TRACE_WORDS_MAX];
+  uint8_t num_words;
+  bool used;
+} sTracepoint;
+
+// Ahead of the values of every hit in the ring: the registers in eDebugReg
+// order, then the words
+typedef struct {
+  uint32_t cyccnt;
+  uint32_t regs;
+  uint8_t id;
+  uint8_t num_values;
+  uint16_t reserved;
+} sTraceHeader;
+
+typedef struct {
+  sTraceHeader header;
+  uint32_t values[TRACE_VALUES_MAX];
+} sTraceRecord;
+
+_Static_assert(kDebugReg_Count <= 32, "registers have to fit the mask");
+_Static_assert(TRACE_RING_SIZE >= sizeof(sTraceRecord), "the ring has to take a hit");
+
+RING_DEFINE(s_trace_ring, TRACE_RING_SIZE);
+
+static sTracepoint s_tps[TRACE_MAX];
+
+// Cycles from entering the monitor on the hit to leaving it after the step
+static struct {
+  uint32_t hits;
+  // the ring was full
+  uint32_t dropped;
+  uint32_t steps;
+  uint32_t cost_min;
+  uint32_t cost_max;
+  uint64_t cost_total;
+} s_stats;
+
+// CYCCNT on entry for the hit being stepped over
+static uint32_t s_started;
+
+int trace_set(uint32_t addr, uint32_t regs, const uint32_t *words, size_t num_words)
+{
+  addr &= ~0x1u;
+  if (num_words > TRACE_WORDS_MAX ||
+      (size_t)__builtin_popcount(regs) + num_words > TRACE_VALUES_MAX) {
+    logp("A tracepoint takes at most %d words, and %d values in all", TRACE_WORDS_MAX,
+         TRACE_VALUES_MAX);
+    return -1;
+  }
+  for (size_t i = 0; i < num_words; i++) {
+    if ((words[i] & 0x3) != 0 || !dbg_proto_read_ok(words[i], sizeof(uint32_t))) {
+      logp("Can't trace 0x%x", (int)words[i]);
+      return -1;
+    }
+  }
+
+  int id;
+  for (id = 0; id < TRACE_MAX && !(s_tps[id].used && s_tps[id].addr == addr); id++) { }
+  if (id == TRACE_MAX) {
+    for (id = 0; id < TRACE_MAX && s_tps[id].used; id++) { }
+  }
+  if (id == TRACE_MAX) {
+    logp("All %d tracepoints are in use", TRACE_MAX);
+    return -1;
+  }
+
+  // configured before the breakpoint goes in, the first hit may be right away
+  sTracepoint *tp = &s_tps[id];
+  *tp = (sTracepoint) {
+    .addr = addr,
+    .regs = regs,
+    .num_words = (uint8_t)num_words,
+    .used = true,
+  };
+  memcpy(tp->words, words, num_words * sizeof(uint32_t));
+  dwt_cyccnt_enable();
+  if (bkpt_set(addr, kBkptOwner_Trace) < 0) {
+    *tp = (sTracepoint) { 0 };
+    return -1;
+  }
+
+  if ((core_reg_read(CORE_REG_DEMCR) & CORE_REG_DEMCR_MON_EN) == 0) {
+    logp("Hits need the debug monitor, see debug_mon_en");
+  }
+  return id;
+}
+
+bool trace_clear(int id)
+{
+  if (id < 0 || id >= TRACE_MAX || !s_tps[id].used) {
+    return false;
+  }
+  bkpt_delete(bkpt_find(s_tps[id].addr));
+  s_tps[id] = (sTracepoint) { 0 };
+  return true;
+}
+
+void trace_clear_all(void)
+{
+  for (int i = 0; i < TRACE_MAX; i++) {
+    trace_clear(i);
+  }
+}
+
+bool trace_hit(const sContextStateFrame *frame, uint32_t started)
+{
+  const uint32_t pc = frame->return_address;
+  int id;
+  for (id = 0; id < TRACE_MAX && !(s_tps[id].used && s_tps[id].addr == pc); id++) { }
+  if (id == TRACE_MAX) {
+    return false;
+  }
+
+  const sTracepoint *tp = &s_tps[id];
+  sTraceRecord rec;
+  size_t n = 0;
+  for (uint32_t regs = tp->regs; regs != 0; regs &= regs - 1) {
+    rec.values[n++] = debug_reg_read((eDebugReg)__builtin_ctz(regs));
+  }
+  for (size_t i = 0; i < tp->num_words; i++) {
+    rec.values[n++] = core_reg_read(tp->words[i]);
+  }
+  rec.header = (sTraceHeader) {
+    .cyccnt = started,
+    .regs = tp->regs,
+    .id = (uint8_t)id,
+    .num_values = (uint8_t)n,
+  };
+
+  s_stats.hits++;
+  if (!ring_write_atomic(&s_trace_ring, &rec, sizeof(rec.header) + n * sizeof(uint32_t))) {
+    s_stats.dropped++;
+  }
+  s_started = started;
+  return true;
+}
+
+void trace_step_done(void)
+{
+  const uint32_t cost = dwt_cyccnt_read() - s_started;
+  if (s_stats.steps == 0 || cost < s_stats.cost_min) {
+    s_stats.cost_min = cost;
+  }
+  if (cost > s_stats.cost_max) {
+    s_stats.cost_max = cost;
+  }
+  s_stats.cost_total += cost;
+  s_stats.steps++;
+}
+
+/* Shell ---------------------------------------------------------------------*/
+
+static const char *const s_word_keys[] = { "w0", "w1", "w2", "w3" };
+_Static_assert(ARRAY_SIZE(s_word_keys) == TRACE_WORDS_MAX, "a key for every word");
+
+static int prv_trace_list(void)
+{
+  for (int i = 0; i < TRACE_MAX; i++) {
+    const sTracepoint *tp = &s_tps[i];
+    if (!tp->used) {
+      continue;
+    }
+    record_begin("tracepoint");
+    record_u32("id", i);
+    record_hex("addr", tp->addr);
+    const int bkpt = bkpt_find(tp->addr);
+    if (bkpt >= 0) {
+      record_u32("bkpt", bkpt);
+    }
+    char regs[64] = "";
+    for (size_t reg = 0; reg < kDebugReg_Count; reg++) {
+      if (tp->regs & (1u << reg)) {
+        if (regs[0] != '\0') {
+          strncat(regs, ",", sizeof(regs) - strlen(regs) - 1);
+        }
+        strncat(regs, debug_reg_name((eDebugReg)reg), sizeof(regs) - strlen(regs) - 1);
+      }
+    }
+    if (regs[0] != '\0') {
+      record_str("regs", regs);
+    }
+    for (size_t w = 0; w < tp->num_words; w++) {
+      record_hex(s_word_keys[w], tp->words[w]);
+    }
+    record_end();
+  }
+  return 0;
+}
+
+// Drains the ring, the values named as trace list names them
+static int prv_trace_dump(void)
+{
+  sTraceRecord rec;
+  while (ring_read_bulk(&s_trace_ring, &rec.header, sizeof(rec.header)) == sizeof(rec.header)) {
+    const size_t n = rec.header.num_values;
+    ring_read_bulk(&s_trace_ring, rec.values, n * sizeof(uint32_t));
+
+    record_begin("trace");
+    record_u32("id", rec.header.id);
+    record_u32("cyccnt", rec.header.cyccnt);
+    size_t v = 0;
+    for (size_t reg = 0; reg < kDebugReg_Count && v < n; reg++) {
+      if (rec.header.regs & (1u << reg)) {
+        record_hex(debug_reg_name((eDebugReg)reg), rec.values[v++]);
+      }
+    }
+    for (size_t w = 0; v < n; w++) {
+      record_hex(s_word_keys[w], rec.values[v++]);
+    }
+    record_end();
+  }
+  return 0;
+}
+
+static int prv_trace_stats(void)
+{
+  const uint32_t avg = s_stats.steps ? (uint32_t)(s_stats.cost_total / s_stats.steps) : 0;
+  record_begin("trace_stats");
+  record_u32("hits", s_stats.hits);
+  record_u32("dropped", s_stats.dropped);
+  record_u32("queued", ring_used(&s_trace_ring));
+  record_u32("cost_min", s_stats.cost_min);
+  record_u32("cost_avg", avg);
+  record_u32("cost_max", s_stats.cost_max);
+  record_u32("cost_avg_ns", (uint32_t)((uint64_t)avg * 1000000000u / SystemCoreClock));
+  record_end();
+  return 0;
+}
+
+// <addr> [<reg>...] [@<addr>...]
+static int prv_trace_set(int argc, char *argv[])
+{
+  uint32_t addr;
+  if (!shell_arg_addr(argv[2], &addr)) {
+    return -2;
+  }
+  uint32_t regs = 0;
+  uint32_t words[TRACE_WORDS_MAX];
+  size_t num_words = 0;
+  for (int i = 3; i < argc; i++) {
+    eDebugReg reg;
+    if (argv[i][0] == '@') {
+      if (num_words == TRACE_WORDS_MAX || !shell_arg_addr(&argv[i][1], &words[num_words])) {
+        return -2;
+      }
+      num_words++;
+    } else if (debug_reg_lookup(argv[i], &reg)) {
+      regs |= 1u << reg;
+    } else {
+      return -2;
+    }
+  }
+
+  const int id = trace_set(addr, regs, words, num_words);
+  if (id < 0) {
+    return -1;
+  }
+  logp("trace set %d: 0x%x", id, (int)(addr & ~0x1u));
+  return 0;
+}
+
+static int prv_trace(int argc, char *argv[])
+{
+  if (argc < 2 || strcmp(argv[1], "list") == 0) {
+    return prv_trace_list();
+  }
+
+  int rv = -2;
+  if (strcmp(argv[1], "dump") == 0 && argc == 2) {
+    rv = prv_trace_dump();
+  } else if (strcmp(argv[1], "stats") == 0 && argc == 2) {
+    rv = prv_trace_stats();
+  } else if (strcmp(argv[1], "set") == 0 && argc >= 3) {
+    rv = prv_trace_set(argc, argv);
+  } else if (strcmp(argv[1], "clear") == 0 && argc == 3) {
+    uint32_t id;
+    bool ok = true;
+    if (strcmp(argv[2], "all") == 0) {
+      trace_clear_all();
+    } else {
+      ok = shell_arg_u32(argv[2], &id) && trace_clear((int)id);
+    }
+    logp("trace clear %s: %s", argv[2], ok ? "ok" : "failed");
+    rv = ok ? 0 : -1;
+  }
+  if (rv == -2) {
+    logp("Expected list | set <addr> [<reg>...] [@<addr>...] | clear <id>|all | dump | stats");
+    return -1;
+  }
+  return rv;
+}
+
+SHELL_COMMAND(trace, prv_trace,
+              "Tracepoints, record and resume: list | set <addr> [<reg>...] [@<addr>...] | "
+              "clear <id>|all | dump | stats");
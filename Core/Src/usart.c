@@ -1,21 +1,491 @@
 /* Includes ------------------------------------------------------------------*/
 #include "usart.h"
+#include "dbg.h"
+#include <stdbool.h>
 
 UART_HandleTypeDef huart1;
-uint8_t uart1_buf[4];
+DMA_HandleTypeDef hdma_usart1_rx;
+
+static sUartRxStats s_rx_stats;
+
+static eUartFlow s_flow = UART_FLOW;
+static bool s_rx_throttled;
+// XOFF from the host holds back the TX interrupt
+static volatile bool s_tx_paused;
+// XON/XOFF waiting to go out ahead of everything queued
+static volatile uint8_t s_tx_ctrl;
+
+static void prv_tx_irq(void);
+
+static void prv_publish_data(const uint8_t *buf, size_t size)
+{
+  if (size == 0) {
+    return;
+  }
+  const size_t accepted = uart_byte_received_cb(buf, size);
+  s_rx_stats.rx_bytes += size;
+  s_rx_stats.dropped += size - accepted;
+  s_rx_stats.publish_events++;
+}
+
+static void prv_publish(const uint8_t *buf, size_t size)
+{
+  if (s_flow == kUartFlow_XonXoff) {
+    // the host's XON/XOFF are meant for our transmitter, not the consumer
+    size_t start = 0;
+    for (size_t i = 0; i < size; i++) {
+      if (buf[i] == UART_XON || buf[i] == UART_XOFF) {
+        prv_publish_data(&buf[start], i - start);
+        start = i + 1;
+        s_tx_paused = (buf[i] == UART_XOFF);
+        if (!s_tx_paused) {
+          uart_tx_kick();
+        }
+      }
+    }
+    buf += start;
+    size -= start;
+  }
+  prv_publish_data(buf, size);
+}
+
+// CPU time spent in uart_irq(), see uart_get_irq_profile()
+static uint32_t s_irq_cycles;
+static uint32_t s_irq_count;
+
+#if UART_RX_DMA
+
+static uint8_t s_rx_dma_buf[UART_RX_DMA_BUF_SIZE];
+// index in s_rx_dma_buf up to which data has been handed to the consumer
+static size_t s_rx_dma_pos;
+
+static size_t prv_rx_dma_remaining(void)
+{
+#if UART_LL
+  return DMA1_Channel5->CNDTR;
+#else
+  return __HAL_DMA_GET_COUNTER(huart1.hdmarx);
+#endif
+}
+
+// Publish everything the DMA has written since the last call. Runs from the
+// USART1 IDLE interrupt and the DMA half/full transfer interrupts, which share
+// the same priority so they never preempt each other.
+static void prv_rx_dma_publish(void)
+{
+  const size_t pos = UART_RX_DMA_BUF_SIZE - prv_rx_dma_remaining();
+
+  if (pos == s_rx_dma_pos) {
+    return;
+  }
+
+  if (pos > s_rx_dma_pos) {
+    prv_publish(&s_rx_dma_buf[s_rx_dma_pos], pos - s_rx_dma_pos);
+  } else {
+    // DMA wrapped around the end of the buffer
+    prv_publish(&s_rx_dma_buf[s_rx_dma_pos], UART_RX_DMA_BUF_SIZE - s_rx_dma_pos);
+    prv_publish(&s_rx_dma_buf[0], pos);
+  }
+
+  s_rx_dma_pos = (pos == UART_RX_DMA_BUF_SIZE) ? 0 : pos;
+}
+
+#endif /* UART_RX_DMA */
+
+#if UART_LL
+
+/* Register level backend ----------------------------------------------------*/
+
+static void uart_start_receive(void)
+{
+#if UART_RX_DMA
+  DMA1_Channel5->CCR = 0;
+  s_rx_dma_pos = 0;
+  DMA1->IFCR = DMA_IFCR_CGIF5;
+  DMA1_Channel5->CPAR = (uint32_t)&USART1->DR;
+  DMA1_Channel5->CMAR = (uint32_t)s_rx_dma_buf;
+  DMA1_Channel5->CNDTR = UART_RX_DMA_BUF_SIZE;
+  DMA1_Channel5->CCR = DMA_CCR_PL_1 | DMA_CCR_MINC | DMA_CCR_CIRC |
+      DMA_CCR_HTIE | DMA_CCR_TCIE | DMA_CCR_TEIE | DMA_CCR_EN;
+  USART1->CR3 |= USART_CR3_DMAR;
+  USART1->CR1 |= USART_CR1_IDLEIE;
+#else
+  USART1->CR1 |= USART_CR1_RXNEIE;
+#endif
+}
+
+void uart_irq(void)
+{
+  const uint32_t start = dwt_cyccnt_read();
+  const uint32_t sr = USART1->SR;
+
+  const bool error = (sr & (USART_SR_ORE | USART_SR_NE | USART_SR_FE)) != 0;
+  if (error) {
+    // cleared by reading SR then DR, the byte is lost either way
+    (void)USART1->DR;
+    s_rx_stats.errors++;
+  }
+#if UART_RX_DMA
+  // From sr, the DR read above clears IDLE too. A line that ends on an error
+  // still has its last bytes in the DMA buffer.
+  if ((sr & USART_SR_IDLE) && (USART1->CR1 & USART_CR1_IDLEIE)) {
+    if (!error) {
+      (void)USART1->DR;
+    }
+    prv_rx_dma_publish();
+  }
+#else
+  else if (sr & USART_SR_RXNE) {
+    const uint8_t byte = USART1->DR;
+    prv_publish(&byte, 1);
+  }
+#endif
+
+  prv_tx_irq();
+  s_irq_cycles += dwt_cyccnt_read() - start;
+  s_irq_count++;
+}
+
+void uart_rx_dma_irq(void)
+{
+#if UART_RX_DMA
+  const uint32_t isr = DMA1->ISR;
+  DMA1->IFCR = DMA_IFCR_CGIF5;
+  if (isr & DMA_ISR_TEIF5) {
+    // the channel disables itself on a transfer error
+    s_rx_stats.errors++;
+    uart_start_receive();
+    return;
+  }
+  prv_rx_dma_publish();
+#endif
+}
+
+#else
+
+/* HAL backend ---------------------------------------------------------------*/
+
+#if UART_RX_DMA
+
+static void uart_start_receive(void)
+{
+  s_rx_dma_pos = 0;
+  HAL_UART_Receive_DMA(&huart1, s_rx_dma_buf, sizeof(s_rx_dma_buf));
+  // errors are counted and the transfer restarted in HAL_UART_ErrorCallback
+  __HAL_UART_ENABLE_IT(&huart1, UART_IT_IDLE);
+}
+
+static void prv_rx_idle_irq(void)
+{
+  if (__HAL_UART_GET_FLAG(&huart1, UART_FLAG_IDLE) &&
+      __HAL_UART_GET_IT_SOURCE(&huart1, UART_IT_IDLE)) {
+    __HAL_UART_CLEAR_IDLEFLAG(&huart1);
+    prv_rx_dma_publish();
+  }
+}
+
+void HAL_UART_RxHalfCpltCallback(UART_HandleTypeDef *huart)
+{
+  prv_rx_dma_publish();
+}
+
+void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart)
+{
+  // circular mode, the DMA keeps running
+  prv_rx_dma_publish();
+}
+
+#else
+
+static uint8_t uart1_buf[4];
 
 static void uart_start_receive(void)
 {
   HAL_UART_Receive_IT(&huart1, &uart1_buf[0], sizeof(uint8_t));
 }
 
+static void prv_rx_idle_irq(void)
+{
+}
+
 void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart)
 {
-	uart_byte_received_cb(&uart1_buf[0], huart->RxXferSize);
+	prv_publish(&uart1_buf[0], huart->RxXferSize);
 	// start next receive
 	uart_start_receive();
 }
 
+#endif /* UART_RX_DMA */
+
+void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart)
+{
+  // The HAL aborts reception on overrun (and on any error in DMA mode), so
+  // account for it and start over
+  s_rx_stats.errors++;
+#if UART_RX_DMA
+  prv_rx_dma_publish();
+#endif
+  uart_start_receive();
+}
+
+void uart_irq(void)
+{
+  const uint32_t start = dwt_cyccnt_read();
+  prv_rx_idle_irq();
+  prv_tx_irq();
+  HAL_UART_IRQHandler(&huart1);
+  s_irq_cycles += dwt_cyccnt_read() - start;
+  s_irq_count++;
+}
+
+void uart_rx_dma_irq(void)
+{
+#if UART_RX_DMA
+  HAL_DMA_IRQHandler(&hdma_usart1_rx);
+#endif
+}
+
+#endif /* UART_LL */
+
+void uart_get_irq_profile(uint32_t *cycles, uint32_t *count)
+{
+  *cycles = s_irq_cycles;
+  *count = s_irq_count;
+}
+
+void uart_reset_irq_profile(void)
+{
+  s_irq_cycles = 0;
+  s_irq_count = 0;
+}
+
+void uart_rx_get_stats(sUartRxStats *stats)
+{
+  *stats = s_rx_stats;
+}
+
+void uart_rx_reset_stats(void)
+{
+  s_rx_stats = (sUartRxStats) { 0 };
+}
+
+/* Transmit ------------------------------------------------------------------*/
+// The queues live with the producer, see uart_tx_next_byte_cb()
+
+static uint32_t s_tx_sent;
+static bool s_tx_direct;
+
+void uart_tx_kick(void)
+{
+  if (!s_tx_direct) {
+    __HAL_UART_ENABLE_IT(&huart1, UART_IT_TXE);
+  }
+}
+
+bool uart_tx_irq_can_run(void)
+{
+  if (s_tx_direct || __get_PRIMASK() != 0) {
+    return false;
+  }
+
+  const uint32_t ipsr = __get_IPSR();
+  if (ipsr == 0) {
+    return true; // thread mode
+  }
+  if (ipsr < 4) {
+    return false; // NMI / HardFault
+  }
+  const IRQn_Type active = (IRQn_Type)((int32_t)ipsr - 16);
+  return NVIC_GetPriority(active) > NVIC_GetPriority(USART1_IRQn);
+}
+
+void uart_tx_poll_byte(uint8_t byte)
+{
+  while ((huart1.Instance->SR & USART_SR_TXE) == 0) { }
+  huart1.Instance->DR = byte;
+  s_tx_sent++;
+}
+
+bool uart_tx_poll_one(void)
+{
+  uint8_t byte;
+  if (!uart_tx_next_byte_cb(&byte)) {
+    return false;
+  }
+  uart_tx_poll_byte(byte);
+  return true;
+}
+
+bool uart_tx_is_direct(void)
+{
+  return s_tx_direct;
+}
+
+void uart_tx_set_direct(bool direct)
+{
+  if (direct) {
+    // take over from the interrupt and push out what is already committed
+    __HAL_UART_DISABLE_IT(&huart1, UART_IT_TXE);
+    s_tx_direct = true;
+    while (uart_tx_poll_one()) { }
+  } else {
+    s_tx_direct = false;
+    uart_tx_kick();
+  }
+}
+
+static void prv_tx_irq(void)
+{
+  if (!__HAL_UART_GET_FLAG(&huart1, UART_FLAG_TXE) ||
+      !__HAL_UART_GET_IT_SOURCE(&huart1, UART_IT_TXE)) {
+    return;
+  }
+
+  uint8_t byte = s_tx_ctrl;
+  if (byte != 0) {
+    s_tx_ctrl = 0;
+  } else if (s_tx_paused || !uart_tx_next_byte_cb(&byte)) {
+    __HAL_UART_DISABLE_IT(&huart1, UART_IT_TXE);
+    return;
+  }
+
+  huart1.Instance->DR = byte;
+  s_tx_sent++;
+}
+
+void uart_tx_flush(void)
+{
+  if (uart_tx_irq_can_run()) {
+    uart_tx_kick();
+    // the interrupt switches itself off once there is nothing left
+    while (__HAL_UART_GET_IT_SOURCE(&huart1, UART_IT_TXE)) { }
+  } else {
+    while (uart_tx_poll_one()) { }
+  }
+  while (!__HAL_UART_GET_FLAG(&huart1, UART_FLAG_TC)) { }
+}
+
+uint32_t uart_tx_get_sent(void)
+{
+  return s_tx_sent;
+}
+
+/* Flow control --------------------------------------------------------------*/
+
+// RTS is active low: low lets the host send
+static void prv_rts_set(bool ready)
+{
+  GPIOA->BSRR = ready ? GPIO_BSRR_BR12 : GPIO_BSRR_BS12;
+}
+
+void uart_set_flow(eUartFlow flow)
+{
+  const uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+
+  s_flow = flow;
+  s_tx_paused = false;
+  s_tx_ctrl = 0;
+
+  if (flow == kUartFlow_RtsCts) {
+    // PA11 CTS floating input, PA12 RTS push-pull output driven from the
+    // RX ring watermarks rather than by the USART itself, whose RTS only
+    // looks at the single byte data register
+    prv_rts_set(!s_rx_throttled);
+    GPIOA->CRH = (GPIOA->CRH & ~(GPIO_CRH_CNF11 | GPIO_CRH_MODE11 |
+                                 GPIO_CRH_CNF12 | GPIO_CRH_MODE12)) |
+        GPIO_CRH_CNF11_0 | GPIO_CRH_MODE12_1;
+    huart1.Instance->CR3 |= USART_CR3_CTSE;
+  } else {
+    huart1.Instance->CR3 &= ~USART_CR3_CTSE;
+    GPIOA->CRH = (GPIOA->CRH & ~(GPIO_CRH_CNF12 | GPIO_CRH_MODE12)) | GPIO_CRH_CNF12_0;
+    if (flow == kUartFlow_XonXoff && s_rx_throttled) {
+      s_tx_ctrl = UART_XOFF;
+    }
+  }
+
+  __set_PRIMASK(primask);
+  uart_tx_kick();
+}
+
+eUartFlow uart_get_flow(void)
+{
+  return s_flow;
+}
+
+void uart_rx_throttle(bool stop)
+{
+  if (stop == s_rx_throttled) {
+    return;
+  }
+  s_rx_throttled = stop;
+  if (stop) {
+    s_rx_stats.throttled++;
+  }
+
+  switch (s_flow) {
+    case kUartFlow_RtsCts:
+      prv_rts_set(!stop);
+      break;
+    case kUartFlow_XonXoff:
+      if (s_tx_direct) {
+        uart_tx_poll_byte(stop ? UART_XOFF : UART_XON);
+      } else {
+        s_tx_ctrl = stop ? UART_XOFF : UART_XON;
+        uart_tx_kick();
+      }
+      break;
+    case kUartFlow_None:
+    default:
+      break;
+  }
+}
+
+bool uart_rx_throttled(void)
+{
+  return s_rx_throttled;
+}
+
+/* Baud rate -----------------------------------------------------------------*/
+
+uint32_t uart_get_baud(void)
+{
+  return huart1.Init.BaudRate;
+}
+
+uint32_t uart_get_max_baud(void)
+{
+  return HAL_RCC_GetPCLK2Freq() / 16;
+}
+
+uint32_t uart_get_min_baud(void)
+{
+  // rounded up, the mantissa of PCLK2 / (16 * baud) can't exceed 0xfff
+  return (HAL_RCC_GetPCLK2Freq() + 16 * 0xfff - 1) / (16 * 0xfff);
+}
+
+uint32_t uart_get_actual_baud(uint32_t baud)
+{
+  const uint32_t pclk = HAL_RCC_GetPCLK2Freq();
+  return pclk / UART_BRR_SAMPLING16(pclk, baud);
+}
+
+bool uart_set_baud(uint32_t baud)
+{
+  if (baud < uart_get_min_baud() || baud > uart_get_max_baud()) {
+    return false;
+  }
+
+  // let everything queued at the old rate go out first
+  uart_tx_flush();
+
+  __HAL_UART_DISABLE(&huart1);
+  huart1.Instance->BRR = UART_BRR_SAMPLING16(HAL_RCC_GetPCLK2Freq(), baud);
+  huart1.Init.BaudRate = baud;
+  __HAL_UART_ENABLE(&huart1);
+  return true;
+}
+
 /* USART1 init function */
 
 void MX_USART1_UART_Init(void)
@@ -29,13 +499,35 @@ void MX_USART1_UART_Init(void)
   huart1.Init.Mode = UART_MODE_TX_RX;
   huart1.Init.HwFlowCtl = UART_HWCONTROL_NONE;
   huart1.Init.OverSampling = UART_OVERSAMPLING_16;
+#if UART_LL
+  // Same clocks, pins and priorities HAL_UART_MspInit() sets up, 8N1
+  RCC->APB2ENR |= RCC_APB2ENR_USART1EN | RCC_APB2ENR_IOPAEN;
+#if UART_RX_DMA
+  RCC->AHBENR |= RCC_AHBENR_DMA1EN;
+  HAL_NVIC_SetPriority(DMA1_Channel5_IRQn, 0, 0);
+  HAL_NVIC_EnableIRQ(DMA1_Channel5_IRQn);
+#endif
+  // PA9 alternate function push-pull 50 MHz, PA10 floating input
+  GPIOA->CRH = (GPIOA->CRH & ~(GPIO_CRH_CNF9 | GPIO_CRH_MODE9 |
+                               GPIO_CRH_CNF10 | GPIO_CRH_MODE10)) |
+      GPIO_CRH_CNF9_1 | GPIO_CRH_MODE9 | GPIO_CRH_CNF10_0;
+  USART1->BRR = UART_BRR_SAMPLING16(HAL_RCC_GetPCLK2Freq(), huart1.Init.BaudRate);
+  // EIE reports overrun/noise/framing errors while DMA receives
+  USART1->CR3 = USART_CR3_EIE;
+  USART1->CR1 = USART_CR1_UE | USART_CR1_TE | USART_CR1_RE;
+  HAL_NVIC_SetPriority(USART1_IRQn, 0, 0);
+  HAL_NVIC_EnableIRQ(USART1_IRQn);
+#else
   if (HAL_UART_Init(&huart1) != HAL_OK)
   {
     Error_Handler();
   }
+#endif
+  uart_set_flow(s_flow);
 
-  // start uart receive, buf size must set to 1 byte because there are no
-  // time out in asyn uart mode in the HAL lib.
+  // In byte mode the buf size must set to 1 byte because there are no
+  // time out in asyn uart mode in the HAL lib. DMA mode uses the IDLE line
+  // interrupt as the time out instead.
   uart_start_receive();
 }
 
@@ -63,6 +555,30 @@ void HAL_UART_MspInit(UART_HandleTypeDef* uartHandle)
     GPIO_InitStruct.Pull = GPIO_NOPULL;
     HAL_GPIO_Init(GPIOA, &GPIO_InitStruct);
 
+#if UART_RX_DMA
+    /* USART1 DMA Init */
+    /* USART1_RX Init */
+    __HAL_RCC_DMA1_CLK_ENABLE();
+    hdma_usart1_rx.Instance = DMA1_Channel5;
+    hdma_usart1_rx.Init.Direction = DMA_PERIPH_TO_MEMORY;
+    hdma_usart1_rx.Init.PeriphInc = DMA_PINC_DISABLE;
+    hdma_usart1_rx.Init.MemInc = DMA_MINC_ENABLE;
+    hdma_usart1_rx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+    hdma_usart1_rx.Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+    hdma_usart1_rx.Init.Mode = DMA_CIRCULAR;
+    hdma_usart1_rx.Init.Priority = DMA_PRIORITY_HIGH;
+    if (HAL_DMA_Init(&hdma_usart1_rx) != HAL_OK)
+    {
+      Error_Handler();
+    }
+
+    __HAL_LINKDMA(uartHandle, hdmarx, hdma_usart1_rx);
+
+    /* DMA interrupt init, same priority as USART1 so publishing never nests */
+    HAL_NVIC_SetPriority(DMA1_Channel5_IRQn, 0, 0);
+    HAL_NVIC_EnableIRQ(DMA1_Channel5_IRQn);
+#endif
+
     /* USART1 interrupt Init */
     HAL_NVIC_SetPriority(USART1_IRQn, 0, 0);
     HAL_NVIC_EnableIRQ(USART1_IRQn);
@@ -83,6 +599,12 @@ void HAL_UART_MspDeInit(UART_HandleTypeDef* uartHandle)
     */
     HAL_GPIO_DeInit(GPIOA, GPIO_PIN_9|GPIO_PIN_10);
 
+#if UART_RX_DMA
+    /* USART1 DMA DeInit */
+    HAL_DMA_DeInit(uartHandle->hdmarx);
+    HAL_NVIC_DisableIRQ(DMA1_Channel5_IRQn);
+#endif
+
     /* USART1 interrupt Deinit */
     HAL_NVIC_DisableIRQ(USART1_IRQn);
   }
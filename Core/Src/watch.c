@@ -0,0 +1,399 @@
+#include "watch.h"
+#include "core_regs.h"
+#include "console.h"
+#include "dbg_proto.h"
+#include "record.h"
+#include "shell_args.h"
+#include "shell_cmd.h"
+#include <string.h>
+
+// DWT_FUNCTION fields
+#define WATCH_FUNC_READ (0x5)
+#define WATCH_FUNC_WRITE (0x6)
+#define WATCH_FUNC_RW (0x7)
+#define WATCH_DATAVSIZE_SHIFT (10)
+#define WATCH_DATAVADDR0_SHIFT (12)
+#define WATCH_DATAVADDR1_SHIFT (16)
+
+// The one comparator of a Cortex-M3 that matches data values
+#define WATCH_VALUE_COMP (1)
+
+typedef struct {
+  bool active;
+  bool match_value;
+  eWatchAccess access;
+  // the address comparator comparator 1 links to, for a value watch
+  uint8_t link;
+  uint32_t addr;
+  uint32_t size;
+  uint32_t value;
+  uint32_t hits;
+  // how much of the range is copied to shadow, 0 for peripherals
+  uint8_t shadow_len;
+  uint8_t shadow[WATCH_SHADOW_BYTES];
+} sWatch;
+
+// Indexed by the comparator that reports the match, which is also the id
+static sWatch s_watch[WATCH_MAX];
+// Comparators in use, a value watch takes two
+static uint32_t s_comp_busy;
+
+static sWatchConfig s_config;
+static bool s_config_probed;
+
+static const char *const s_access_names[] = {
+  [kWatchAccess_Read] = "r",
+  [kWatchAccess_Write] = "w",
+  [kWatchAccess_ReadWrite] = "rw",
+};
+
+static const uint32_t s_access_functions[] = {
+  [kWatchAccess_Read] = WATCH_FUNC_READ,
+  [kWatchAccess_Write] = WATCH_FUNC_WRITE,
+  [kWatchAccess_ReadWrite] = WATCH_FUNC_RW,
+};
+
+// Fields a core doesn't implement read as zero
+static void prv_probe(void)
+{
+  core_reg_modify(CORE_REG_DEMCR, 0, CORE_REG_DEMCR_TRCENA);
+
+  const uint32_t num = core_reg_read(CORE_REG_DWT_CTRL) >> CORE_REG_DWT_CTRL_NUMCOMP_SHIFT;
+  s_config.num_comparators = (num < WATCH_MAX) ? num : WATCH_MAX;
+  if (num > 0) {
+    core_reg_write(CORE_REG_DWT_MASK(0), 0x1F);
+    s_config.max_mask = core_reg_read(CORE_REG_DWT_MASK(0));
+    core_reg_write(CORE_REG_DWT_MASK(0), 0);
+  }
+  if (num > WATCH_VALUE_COMP) {
+    core_reg_write(CORE_REG_DWT_FUNCTION(WATCH_VALUE_COMP), CORE_REG_DWT_FUNCTION_DATAVMATCH);
+    s_config.value_match = (core_reg_read(CORE_REG_DWT_FUNCTION(WATCH_VALUE_COMP)) &
+                            CORE_REG_DWT_FUNCTION_DATAVMATCH) != 0;
+    core_reg_write(CORE_REG_DWT_FUNCTION(WATCH_VALUE_COMP), 0);
+  }
+  s_config_probed = true;
+}
+
+void watch_get_config(sWatchConfig *config)
+{
+  if (!s_config_probed) {
+    prv_probe();
+  }
+  *config = s_config;
+}
+
+static bool prv_comp_free(uint32_t comp)
+{
+  return comp < s_config.num_comparators && (s_comp_busy & (1u << comp)) == 0;
+}
+
+// Lowest free comparator. Comparator 1 goes last, value watches need it.
+static int prv_comp_alloc(bool allow_value_comp)
+{
+  for (uint32_t i = 0; i < s_config.num_comparators; i++) {
+    if (i != WATCH_VALUE_COMP && prv_comp_free(i)) {
+      return (int)i;
+    }
+  }
+  if (allow_value_comp && prv_comp_free(WATCH_VALUE_COMP)) {
+    return WATCH_VALUE_COMP;
+  }
+  logp("No free DWT comparator");
+  return -1;
+}
+
+static void prv_comp_program(uint32_t comp, uint32_t value, uint32_t mask, uint32_t function)
+{
+  s_comp_busy |= 1u << comp;
+  core_reg_write(CORE_REG_DWT_COMP(comp), value);
+  core_reg_write(CORE_REG_DWT_MASK(comp), mask);
+  core_reg_write(CORE_REG_DWT_FUNCTION(comp), function);
+}
+
+static void prv_comp_release(uint32_t comp)
+{
+  core_reg_write(CORE_REG_DWT_FUNCTION(comp), 0);
+  core_reg_write(CORE_REG_DWT_COMP(comp), 0);
+  core_reg_write(CORE_REG_DWT_MASK(comp), 0);
+  s_comp_busy &= ~(1u << comp);
+}
+
+static bool prv_range_ok(uint32_t addr, uint32_t size)
+{
+  if (size == 0 || (size & (size - 1)) != 0 || (addr & (size - 1)) != 0) {
+    logp("0x%x+%d is not a power of two sized range aligned to its size", (int)addr, (int)size);
+    return false;
+  }
+  if ((uint32_t)__builtin_ctz(size) > s_config.max_mask) {
+    logp("The DWT watches at most %d bytes", (int)(1u << s_config.max_mask));
+    return false;
+  }
+  return true;
+}
+
+static sWatch *prv_watch_init(uint32_t id, uint32_t addr, uint32_t size, eWatchAccess access)
+{
+  sWatch *w = &s_watch[id];
+  *w = (sWatch) {
+    .active = true,
+    .access = access,
+    .addr = addr,
+    .size = size,
+  };
+
+  // the old values come from here, peripherals aren't read behind the
+  // program's back
+  const uint32_t len = (size < WATCH_SHADOW_BYTES) ? size : WATCH_SHADOW_BYTES;
+  if (addr < 0x40000000 && dbg_proto_access_ok(addr, len)) {
+    memcpy(w->shadow, (const void *)(uintptr_t)addr, len);
+    w->shadow_len = (uint8_t)len;
+  }
+
+  if ((core_reg_read(CORE_REG_DEMCR) & CORE_REG_DEMCR_MON_EN) == 0) {
+    logp("Hits need the debug monitor, see debug_mon_en");
+  }
+  return w;
+}
+
+int watch_set(uint32_t addr, uint32_t size, eWatchAccess access)
+{
+  sWatchConfig config;
+  watch_get_config(&config);
+  if (!prv_range_ok(addr, size)) {
+    return -1;
+  }
+  const int comp = prv_comp_alloc(true);
+  if (comp < 0) {
+    return -1;
+  }
+
+  prv_watch_init(comp, addr, size, access);
+  prv_comp_program(comp, addr, __builtin_ctz(size), s_access_functions[access]);
+  return comp;
+}
+
+int watch_set_value(uint32_t addr, uint32_t size, eWatchAccess access, uint32_t value)
+{
+  sWatchConfig config;
+  watch_get_config(&config);
+  if (!config.value_match) {
+    logp("This DWT can't match data values");
+    return -1;
+  }
+  if (size > 4) {
+    logp("Values are 1, 2 or 4 bytes");
+    return -1;
+  }
+  if (!prv_range_ok(addr, size)) {
+    return -1;
+  }
+  if (!prv_comp_free(WATCH_VALUE_COMP)) {
+    logp("Comparator %d, the only one matching values, is taken", WATCH_VALUE_COMP);
+    return -1;
+  }
+  const int link = prv_comp_alloc(false);
+  if (link < 0) {
+    return -1;
+  }
+
+  sWatch *w = prv_watch_init(WATCH_VALUE_COMP, addr, size, access);
+  w->match_value = true;
+  w->link = (uint8_t)link;
+  w->value = value;
+  // accesses of other values don't stop the core to keep the copy current,
+  // so a hit can't tell what was there before
+  w->shadow_len = 0;
+
+  // The value comparator wants the value in every byte lane of its size
+  uint32_t lanes = value;
+  if (size == 1) {
+    lanes = (value & 0xFF) * 0x01010101u;
+  } else if (size == 2) {
+    lanes = (value & 0xFFFF) * 0x00010001u;
+  }
+
+  // FUNCTION 0 on the address comparator, it only serves the link
+  const uint32_t size_log2 = __builtin_ctz(size);
+  prv_comp_program(link, addr, size_log2, 0);
+  prv_comp_program(WATCH_VALUE_COMP, lanes, 0,
+                   s_access_functions[access] | CORE_REG_DWT_FUNCTION_DATAVMATCH |
+                   (size_log2 << WATCH_DATAVSIZE_SHIFT) |
+                   ((uint32_t)link << WATCH_DATAVADDR0_SHIFT) |
+                   ((uint32_t)link << WATCH_DATAVADDR1_SHIFT));
+  return WATCH_VALUE_COMP;
+}
+
+bool watch_clear(int id)
+{
+  if (id < 0 || id >= WATCH_MAX || !s_watch[id].active) {
+    return false;
+  }
+  sWatch *w = &s_watch[id];
+  prv_comp_release(id);
+  if (w->match_value) {
+    prv_comp_release(w->link);
+  }
+  *w = (sWatch) { 0 };
+  return true;
+}
+
+void watch_clear_all(void)
+{
+  for (int i = 0; i < WATCH_MAX; i++) {
+    watch_clear(i);
+  }
+}
+
+// Handler mode, so logp() rather than records
+static void prv_report_values(sWatch *w)
+{
+  if (w->match_value) {
+    logp(" 0x%08x: 0x%x matched", w->addr, w->value);
+    return;
+  }
+  if (w->shadow_len == 0) {
+    return;
+  }
+  const uint32_t unit = (w->size < 4) ? w->size : 4;
+  bool changed = false;
+  for (uint32_t off = 0; off < w->shadow_len; off += unit) {
+    uint32_t old_value = 0;
+    uint32_t new_value = 0;
+    memcpy(&old_value, &w->shadow[off], unit);
+    memcpy(&new_value, (const void *)(uintptr_t)(w->addr + off), unit);
+    if (new_value != old_value) {
+      logp(" 0x%08x: 0x%x -> 0x%x", w->addr + off, old_value, new_value);
+      memcpy(&w->shadow[off], &new_value, unit);
+      changed = true;
+    }
+  }
+  if (!changed) {
+    uint32_t value = 0;
+    memcpy(&value, w->shadow, unit);
+    logp(" 0x%08x: 0x%x, unchanged", w->addr, value);
+  }
+}
+
+void watch_report_hits(const sContextStateFrame *frame)
+{
+  for (uint32_t i = 0; i < s_config.num_comparators; i++) {
+    // reading FUNCTION clears MATCHED for the next hit
+    const uint32_t function = core_reg_read(CORE_REG_DWT_FUNCTION(i));
+    sWatch *w = &s_watch[i];
+    if ((function & CORE_REG_DWT_FUNCTION_MATCHED) == 0 || !w->active) {
+      continue;
+    }
+    w->hits++;
+    // Watchpoints stop the core once the access is done, the access was
+    // made by the instruction before pc or, after a multi-cycle one, close
+    // before it
+    logp("Watchpoint %d hit: %s 0x%x+%d, stopped at pc=0x%x", (int)i,
+         s_access_names[w->access], w->addr, (int)w->size, frame->return_address);
+    prv_report_values(w);
+  }
+}
+
+/* Shell ---------------------------------------------------------------------*/
+
+static int prv_watch_list(void)
+{
+  sWatchConfig config;
+  watch_get_config(&config);
+  record_begin("dwt");
+  record_u32("comparators", config.num_comparators);
+  record_u32("max_range", 1u << config.max_mask);
+  record_bool("value_match", config.value_match);
+  record_end();
+
+  for (int i = 0; i < WATCH_MAX; i++) {
+    const sWatch *w = &s_watch[i];
+    if (!w->active) {
+      continue;
+    }
+    record_begin("watch");
+    record_u32("id", i);
+    record_hex("addr", w->addr);
+    record_u32("size", w->size);
+    record_str("access", s_access_names[w->access]);
+    if (w->match_value) {
+      record_hex("value", w->value);
+    }
+    record_u32("hits", w->hits);
+    record_end();
+  }
+  return 0;
+}
+
+static bool prv_parse_access(const char *arg, eWatchAccess *access)
+{
+  for (size_t i = 0; i < ARRAY_SIZE(s_access_names); i++) {
+    if (strcmp(arg, s_access_names[i]) == 0) {
+      *access = (eWatchAccess)i;
+      return true;
+    }
+  }
+  return false;
+}
+
+static int prv_watch_set(int argc, char *argv[])
+{
+  uint32_t addr;
+  uint32_t size;
+  // symbol+offset is an address here, ranges are <start>..<end>
+  if (shell_arg_addr(argv[2], &addr)) {
+    // the naturally aligned unit at addr
+    size = (addr & 0x1) ? 1 : ((addr & 0x2) ? 2 : 4);
+  } else if (!shell_arg_range(argv[2], &addr, &size)) {
+    return -2;
+  }
+  eWatchAccess access = kWatchAccess_Write;
+  if (argc > 3 && !prv_parse_access(argv[3], &access)) {
+    return -2;
+  }
+
+  int id;
+  if (argc > 4) {
+    uint32_t value;
+    if (!shell_arg_u32(argv[4], &value)) {
+      return -2;
+    }
+    id = watch_set_value(addr, size, access, value);
+  } else {
+    id = watch_set(addr, size, access);
+  }
+  if (id < 0) {
+    return -1;
+  }
+  logp("watch set %d: %s 0x%x+%d", id, s_access_names[access], (int)addr, (int)size);
+  return 0;
+}
+
+static int prv_watch(int argc, char *argv[])
+{
+  if (argc < 2 || strcmp(argv[1], "list") == 0) {
+    return prv_watch_list();
+  }
+
+  int rv = -2;
+  if (strcmp(argv[1], "set") == 0 && argc >= 3 && argc <= 5) {
+    rv = prv_watch_set(argc, argv);
+  } else if (strcmp(argv[1], "clear") == 0 && argc == 3) {
+    uint32_t id;
+    bool ok = true;
+    if (strcmp(argv[2], "all") == 0) {
+      watch_clear_all();
+    } else {
+      ok = shell_arg_u32(argv[2], &id) && watch_clear((int)id);
+    }
+    logp("watch clear %s: %s", argv[2], ok ? "ok" : "failed");
+    rv = ok ? 0 : -1;
+  }
+  if (rv == -2) {
+    logp("Expected list | set <addr>|<start>..<end> [r|w|rw] [value] | clear <id>|all");
+    return -1;
+  }
+  return rv;
+}
+
+SHELL_COMMAND(watch, prv_watch,
+              "Data watchpoints on the DWT: list | set <addr>|<start>..<end> [r|w|rw] [value] | clear <id>|all");
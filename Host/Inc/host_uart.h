@@ -0,0 +1,20 @@
+#pragma once
+
+#include <poll.h>
+#include <stdbool.h>
+
+//! USART1 of the host build: usart.h implemented over a pty or stdio
+
+//! Opens a pty and prints the name of its slave side. With link, also
+//! symlinks it there.
+bool host_uart_open_pty(const char *link);
+//! Uses stdin/stdout, the process exits once stdin ends and nothing has been
+//! sent for a while
+bool host_uart_open_stdio(void);
+
+//! Fills in what the interrupt thread has to wait for, returns how many
+//! (at most 2)
+int host_uart_poll_fds(struct pollfd *fds);
+//! USART1_IRQHandler: moves received bytes to the shell and queued bytes
+//! out, as far as both sides take them
+void host_uart_irq(void);
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "dbg.h"
+
+//! What the host build (make host) and the QEMU build (make qemu) share to
+//! stand in for the parts of the core neither of them has: the debug
+//! registers, and flash for the macro page.
+
+//! The simulated debug registers, see Host/Src/sim_regs.c: DFSR, DHCSR,
+//! DEMCR, the DWT and the FPB. Other addresses read as zero and ignore
+//! writes.
+uint32_t sim_reg_read(uint32_t addr);
+void sim_reg_write(uint32_t addr, uint32_t value);
+
+//! Takes DebugMonitor for a DFSR event, with frame as what the core would
+//! have stacked. Returns false, and does nothing, while DEMCR.MON_EN is
+//! clear.
+bool sim_debug_event(sContextStateFrame *frame, uint32_t dfsr_bit);
+
+//! Free running count of SystemCoreClock cycles that CYCCNT follows,
+//! implemented by each build
+uint32_t sim_cycles(void);
+
+//! Erases the macro page, at boot. Host/Src/sim_flash.c keeps the F1
+//! programming rules on it.
+void sim_flash_init(void);
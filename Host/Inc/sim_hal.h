@@ -0,0 +1,59 @@
+#pragma once
+
+// The part of the STM32 HAL that the portable sources use, for the host and
+// QEMU builds, which have no STM32 peripherals. Each build's
+// stm32f1xx_hal.h includes it next to its CMSIS.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum {
+  HAL_OK = 0x00U,
+  HAL_ERROR = 0x01U,
+  HAL_BUSY = 0x02U,
+  HAL_TIMEOUT = 0x03U,
+} HAL_StatusTypeDef;
+
+//! 1 GHz in the host build, so CYCCNT counts nanoseconds. 25 MHz in QEMU.
+extern uint32_t SystemCoreClock;
+
+uint32_t HAL_GetTick(void);
+void HAL_Delay(uint32_t delay_ms);
+uint32_t HAL_RCC_GetSysClockFreq(void);
+uint32_t HAL_RCC_GetPCLK2Freq(void);
+
+/* UART ----------------------------------------------------------------------*/
+
+typedef struct {
+  uint32_t BaudRate;
+} UART_InitTypeDef;
+
+typedef struct {
+  UART_InitTypeDef Init;
+} UART_HandleTypeDef;
+
+typedef struct {
+  uint32_t unused;
+} DMA_HandleTypeDef;
+
+HAL_StatusTypeDef HAL_UART_Transmit(UART_HandleTypeDef *huart, uint8_t *data, uint16_t size,
+                                    uint32_t timeout);
+
+/* Flash, a RAM page that keeps the programming rules ------------------------*/
+
+#define FLASH_PAGE_SIZE (0x800U)
+#define FLASH_TYPEPROGRAM_HALFWORD (0x01U)
+#define FLASH_TYPEERASE_PAGES (0x00U)
+
+typedef struct {
+  uint32_t TypeErase;
+  uint32_t Banks;
+  uint32_t PageAddress;
+  uint32_t NbPages;
+} FLASH_EraseInitTypeDef;
+
+HAL_StatusTypeDef HAL_FLASH_Unlock(void);
+HAL_StatusTypeDef HAL_FLASH_Lock(void);
+HAL_StatusTypeDef HAL_FLASH_Program(uint32_t type, uint32_t address, uint64_t data);
+HAL_StatusTypeDef HAL_FLASHEx_Erase(FLASH_EraseInitTypeDef *erase, uint32_t *page_error);
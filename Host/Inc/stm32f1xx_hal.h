@@ -0,0 +1,80 @@
+#ifndef __STM32F1xx_HAL_H
+#define __STM32F1xx_HAL_H
+
+// Stands in for the STM32 HAL and CMSIS in the host build (make host): just
+// the parts the portable sources use, implemented by Host/Src/host_main.c
+// on top of POSIX threads. The HAL half is shared with the QEMU build.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sim_hal.h"
+
+/* CMSIS ---------------------------------------------------------------------*/
+
+// Interrupts are run by one host thread. PRIMASK is a mutex it takes for
+// every handler, so masking keeps them out exactly as on the target, and
+// __WFI() waits for the next one.
+
+typedef enum {
+  PendSV_IRQn = -2,
+  SysTick_IRQn = -1,
+  USART1_IRQn = 37,
+} IRQn_Type;
+
+#define __NVIC_PRIO_BITS (4U)
+
+typedef struct {
+  volatile uint32_t ICSR;
+} SCB_Type;
+
+extern SCB_Type g_host_scb;
+#define SCB (&g_host_scb)
+#define SCB_ICSR_PENDSVSET_Msk (1UL << 28)
+
+void __disable_irq(void);
+void __enable_irq(void);
+uint32_t __get_PRIMASK(void);
+void __set_PRIMASK(uint32_t primask);
+//! Nonzero while an interrupt (or a simulated exception) runs
+uint32_t __get_IPSR(void);
+void __WFI(void);
+
+//! Raises DebugMonitor as a BKPT instruction would, see host_regs.c
+void host_bkpt(uint8_t value);
+#define __BKPT(_value) host_bkpt(_value)
+
+static inline void __DSB(void)
+{
+  __sync_synchronize();
+}
+
+//! Instructions are never fetched ahead of a store here
+static inline void __ISB(void)
+{
+  __sync_synchronize();
+}
+
+static inline uint32_t __CLZ(uint32_t value)
+{
+  return (value == 0) ? 32 : (uint32_t)__builtin_clz(value);
+}
+
+void NVIC_SetPriority(IRQn_Type irq, uint32_t priority);
+uint32_t NVIC_GetEnableIRQ(IRQn_Type irq);
+void NVIC_EnableIRQ(IRQn_Type irq);
+void NVIC_DisableIRQ(IRQn_Type irq);
+
+/* Host ----------------------------------------------------------------------*/
+
+//! Runs fn as if it were the exception with the given number: __get_IPSR()
+//! returns it meanwhile, but interrupts still preempt it
+void host_exception_run(uint32_t exc_num, void (*fn)(void *ctx), void *ctx);
+//! Wakes the interrupt thread to service the UART
+void host_irq_kick(void);
+//! True if the UART interrupt could run right now, i.e. neither masked nor
+//! already the interrupt thread
+bool host_irq_can_preempt(void);
+
+#endif /* __STM32F1xx_HAL_H */
@@ -0,0 +1,318 @@
+// Entry point of the host build (make host) and the part of the HAL and
+// CMSIS the portable sources need.
+//
+// One thread plays the interrupts: every millisecond, or sooner when the
+// UART has something to do, it takes s_irq_lock and runs SysTick, PendSV
+// and USART1 the way the vector table would. PRIMASK is that same lock, so
+// code that masks interrupts keeps them out exactly as on the target, and
+// __WFI() with PRIMASK set waits for the next pass of the thread.
+
+#include "main.h"
+#include "console.h"
+#include "dbg_proto.h"
+#include "host_uart.h"
+#include "sampler.h"
+#include "sched.h"
+#include "shell.h"
+#include "shell_cmd.h"
+#include "sim.h"
+#include "usart.h"
+
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+uint32_t SystemCoreClock = 1000000000;
+SCB_Type g_host_scb;
+
+static pthread_mutex_t s_irq_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_irq_done = PTHREAD_COND_INITIALIZER;
+static int s_wake_pipe[2];
+static volatile uint32_t s_tick_ms;
+static volatile bool s_usart_irq_enabled = true;
+
+// per thread CPU state
+static __thread bool s_primask;
+static __thread bool s_holds_lock;
+static __thread uint32_t s_ipsr;
+static __thread bool s_is_irq_thread;
+
+/* CMSIS ---------------------------------------------------------------------*/
+
+void __disable_irq(void)
+{
+  if (!s_holds_lock) {
+    pthread_mutex_lock(&s_irq_lock);
+    s_holds_lock = true;
+  }
+  s_primask = true;
+}
+
+void __enable_irq(void)
+{
+  s_primask = false;
+  // the interrupt thread keeps the lock until its handlers are done
+  if (s_holds_lock && !s_is_irq_thread) {
+    s_holds_lock = false;
+    pthread_mutex_unlock(&s_irq_lock);
+  }
+}
+
+uint32_t __get_PRIMASK(void)
+{
+  return s_primask;
+}
+
+void __set_PRIMASK(uint32_t primask)
+{
+  if (primask) {
+    __disable_irq();
+  } else {
+    __enable_irq();
+  }
+}
+
+uint32_t __get_IPSR(void)
+{
+  return s_ipsr;
+}
+
+void __WFI(void)
+{
+  if (s_is_irq_thread) {
+    return;
+  }
+  const bool held = s_holds_lock;
+  if (!held) {
+    pthread_mutex_lock(&s_irq_lock);
+  }
+  pthread_cond_wait(&s_irq_done, &s_irq_lock);
+  if (!held) {
+    pthread_mutex_unlock(&s_irq_lock);
+  }
+}
+
+void NVIC_SetPriority(IRQn_Type irq, uint32_t priority)
+{
+  // the interrupt thread runs handlers in a fixed order
+}
+
+uint32_t NVIC_GetEnableIRQ(IRQn_Type irq)
+{
+  return (irq == USART1_IRQn) ? s_usart_irq_enabled : 1;
+}
+
+void NVIC_EnableIRQ(IRQn_Type irq)
+{
+  if (irq == USART1_IRQn) {
+    s_usart_irq_enabled = true;
+  }
+}
+
+void NVIC_DisableIRQ(IRQn_Type irq)
+{
+  if (irq != USART1_IRQn) {
+    return;
+  }
+  // wait for a handler that already runs, as the NVIC would
+  if (!s_holds_lock) {
+    pthread_mutex_lock(&s_irq_lock);
+    s_usart_irq_enabled = false;
+    pthread_mutex_unlock(&s_irq_lock);
+  } else {
+    s_usart_irq_enabled = false;
+  }
+}
+
+bool host_irq_can_preempt(void)
+{
+  return !s_primask && !s_is_irq_thread && s_usart_irq_enabled;
+}
+
+void host_exception_run(uint32_t exc_num, void (*fn)(void *ctx), void *ctx)
+{
+  const uint32_t ipsr = s_ipsr;
+  s_ipsr = exc_num;
+  fn(ctx);
+  s_ipsr = ipsr;
+}
+
+void host_irq_kick(void)
+{
+  const uint8_t b = 0;
+  (void)!write(s_wake_pipe[1], &b, sizeof(b));
+}
+
+/* HAL -----------------------------------------------------------------------*/
+
+static uint64_t prv_now_ms(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint32_t HAL_GetTick(void)
+{
+  return s_tick_ms;
+}
+
+void HAL_Delay(uint32_t delay_ms)
+{
+  const uint32_t start = HAL_GetTick();
+  while (HAL_GetTick() - start < delay_ms) {
+    usleep(100);
+  }
+}
+
+uint32_t HAL_RCC_GetSysClockFreq(void)
+{
+  return SystemCoreClock;
+}
+
+uint32_t HAL_RCC_GetPCLK2Freq(void)
+{
+  // what the board runs at, so baud limits look familiar
+  return 72000000;
+}
+
+void Error_Handler(void)
+{
+  fprintf(stderr, "Error_Handler\n");
+  abort();
+}
+
+/* Simulation --------------------------------------------------------------*/
+
+// The macro page (see Host/host.ld), run by sim_flash.c
+uint8_t g_host_macro_flash[FLASH_PAGE_SIZE] __attribute__((aligned(FLASH_PAGE_SIZE)));
+
+uint32_t sim_cycles(void)
+{
+  // SystemCoreClock is 1 GHz, nanoseconds
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint32_t)((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+/* Interrupts ----------------------------------------------------------------*/
+
+#define HOST_EXC_PENDSV (14)
+#define HOST_EXC_SYSTICK (15)
+#define HOST_EXC_USART1 (16 + USART1_IRQn)
+
+static void *prv_irq_thread(void *arg)
+{
+  const uint64_t start_ms = prv_now_ms();
+  s_is_irq_thread = true;
+
+  while (1) {
+    struct pollfd fds[3] = {
+      { .fd = s_wake_pipe[0], .events = POLLIN },
+    };
+    const int nfds = 1 + host_uart_poll_fds(&fds[1]);
+    poll(fds, nfds, 1);
+    if (fds[0].revents & POLLIN) {
+      uint8_t drain[64];
+      (void)!read(s_wake_pipe[0], drain, sizeof(drain));
+    }
+
+    pthread_mutex_lock(&s_irq_lock);
+    s_holds_lock = true;
+
+    const uint32_t now = (uint32_t)(prv_now_ms() - start_ms);
+    s_ipsr = HOST_EXC_SYSTICK;
+    while (s_tick_ms != now) {
+      s_tick_ms++;
+      sched_tick();
+    }
+    if (SCB->ICSR & SCB_ICSR_PENDSVSET_Msk) {
+      SCB->ICSR &= ~SCB_ICSR_PENDSVSET_Msk;
+      s_ipsr = HOST_EXC_PENDSV;
+      sched_timer_irq();
+    }
+    if (s_usart_irq_enabled) {
+      s_ipsr = HOST_EXC_USART1;
+      host_uart_irq();
+    }
+    s_ipsr = 0;
+
+    pthread_cond_broadcast(&s_irq_done);
+    s_holds_lock = false;
+    s_primask = false;
+    pthread_mutex_unlock(&s_irq_lock);
+  }
+  return NULL;
+}
+
+static void prv_usage(const char *argv0)
+{
+  fprintf(stderr,
+          "usage: %s [-s] [-l link]\n"
+          "  -s       talk over stdin/stdout instead of a pty, exit once\n"
+          "           stdin ends and the output has settled\n"
+          "  -l link  symlink the pty to link\n", argv0);
+  exit(2);
+}
+
+// The target runs ram_func from SRAM, where software breakpoints patch it
+static void prv_ram_func_init(void)
+{
+  extern char __start_ram_func[], __stop_ram_func[];
+  const uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+  const uintptr_t start = (uintptr_t)__start_ram_func & ~(page - 1);
+  const uintptr_t end = (uintptr_t)__stop_ram_func;
+  if (mprotect((void *)start, end - start, PROT_READ | PROT_WRITE | PROT_EXEC) != 0) {
+    perror("mprotect ram_func");
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  bool use_stdio = false;
+  const char *link = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "sl:")) != -1) {
+    switch (opt) {
+      case 's':
+        use_stdio = true;
+        break;
+      case 'l':
+        link = optarg;
+        break;
+      default:
+        prv_usage(argv[0]);
+    }
+  }
+
+  sim_flash_init();
+  prv_ram_func_init();
+  if (!(use_stdio ? host_uart_open_stdio() : host_uart_open_pty(link))) {
+    return 1;
+  }
+  if (pipe(s_wake_pipe) != 0) {
+    perror("pipe");
+    return 1;
+  }
+  pthread_t irq_thread;
+  pthread_create(&irq_thread, NULL, prv_irq_thread, NULL);
+
+  logp("==Booted==");
+
+  dbg_proto_init();
+  sampler_init();
+  shell_processing_loop();
+  return 0;
+}
+
+static int prv_exit(int argc, char *argv[])
+{
+  uart_tx_flush();
+  exit(0);
+}
+
+SHELL_COMMAND(exit, prv_exit, "Leave the host build");
@@ -0,0 +1,66 @@
+// Core registers of the host build: the debug registers are simulated in
+// sim_regs.c, the rest of the SCS is plain storage so that read-modify-write
+// of e.g. SHPR3 behaves. Everything else on the PPB reads as zero.
+
+#include "core_regs.h"
+#include "sim.h"
+#include "main.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define HOST_SCS_BASE (0xE000E000)
+#define HOST_SCS_WORDS (0x1000 / 4)
+
+static volatile uint32_t s_scs[HOST_SCS_WORDS];
+
+static bool prv_is_debug_reg(uint32_t addr)
+{
+  return addr == CORE_REG_DFSR || addr == CORE_REG_DHCSR || addr == CORE_REG_DEMCR ||
+      (addr >= CORE_REG_DWT_CTRL && addr < CORE_REG_FP_CTRL + 0x1000);
+}
+
+uint32_t core_reg_read(uint32_t addr)
+{
+  if (!core_reg_is_ppb(addr)) {
+    return *(volatile uint32_t *)(uintptr_t)addr;
+  }
+  if (prv_is_debug_reg(addr)) {
+    return sim_reg_read(addr);
+  }
+  if (addr - HOST_SCS_BASE < sizeof(s_scs)) {
+    return s_scs[(addr - HOST_SCS_BASE) / 4];
+  }
+  return 0;
+}
+
+void core_reg_write(uint32_t addr, uint32_t value)
+{
+  if (!core_reg_is_ppb(addr)) {
+    *(volatile uint32_t *)(uintptr_t)addr = value;
+  } else if (prv_is_debug_reg(addr)) {
+    sim_reg_write(addr, value);
+  } else if (addr - HOST_SCS_BASE < sizeof(s_scs)) {
+    s_scs[(addr - HOST_SCS_BASE) / 4] = value;
+  }
+}
+
+void host_bkpt(uint8_t value)
+{
+  // the handler looks at the instruction to step over it
+  static uint16_t s_insn;
+  s_insn = 0xBE00 | value;
+  sContextStateFrame frame = {
+    .return_address = (uint32_t)(uintptr_t)&s_insn,
+    .xpsr = 0x01000000, // Thumb
+  };
+  if (!sim_debug_event(&frame, CORE_REG_DFSR_BKPT)) {
+    fprintf(stderr, "bkpt %d with the debug monitor off: HardFault\n", (int)value);
+    abort();
+  }
+  // steps for as long as the monitor asks, none of them runs anything
+  while (core_reg_read(CORE_REG_DEMCR) & CORE_REG_DEMCR_MON_STEP) {
+    frame.return_address += 2;
+    sim_debug_event(&frame, CORE_REG_DFSR_HALTED);
+  }
+}
@@ -0,0 +1,421 @@
+// usart.h for the host build: USART1 is a pty (or stdin/stdout) serviced by
+// the interrupt thread in host_main.c. Bytes the shell has no room for stay
+// in the pty, as if RTS held the sender off, and a reader that falls behind
+// holds our output back like CTS would.
+
+#define _GNU_SOURCE
+
+#include "usart.h"
+#include "host_uart.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <unistd.h>
+
+UART_HandleTypeDef huart1 = { .Init = { .BaudRate = 115200 } };
+DMA_HandleTypeDef hdma_usart1_rx;
+
+// exit this long after stdin ended and the last byte went out
+#define HOST_UART_EOF_SETTLE_MS (500)
+
+static int s_fd_in = -1;
+static int s_fd_out = -1;
+static bool s_is_stdio;
+static volatile bool s_eof;
+static volatile uint32_t s_last_activity_ms;
+
+static struct {
+  uint8_t buf[256];
+  size_t len;
+  size_t pos;
+} s_rx;
+static sUartRxStats s_rx_stats;
+static volatile bool s_rx_throttled;
+static eUartFlow s_flow = UART_FLOW;
+
+// bytes taken from the mux that the fd didn't take yet, only touched with
+// s_tx_lock held
+static pthread_mutex_t s_tx_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct {
+  uint8_t buf[256];
+  size_t len;
+  size_t pos;
+} s_tx;
+static volatile bool s_tx_active;
+static volatile bool s_tx_paused;
+static volatile bool s_tx_direct;
+static volatile uint32_t s_tx_sent;
+
+/* Setup ---------------------------------------------------------------------*/
+
+static struct termios s_saved_termios;
+static bool s_termios_saved;
+static int s_saved_fl_in;
+static int s_saved_fl_out;
+static const char *s_link;
+
+static void prv_restore(void)
+{
+  if (s_termios_saved) {
+    tcsetattr(s_fd_in, TCSANOW, &s_saved_termios);
+  }
+  if (s_is_stdio) {
+    fcntl(s_fd_in, F_SETFL, s_saved_fl_in);
+    fcntl(s_fd_out, F_SETFL, s_saved_fl_out);
+  }
+  if (s_link != NULL) {
+    unlink(s_link);
+  }
+}
+
+static bool prv_make_raw(int fd, bool save)
+{
+  struct termios t;
+  if (tcgetattr(fd, &t) != 0) {
+    perror("tcgetattr");
+    return false;
+  }
+  if (save) {
+    s_saved_termios = t;
+    s_termios_saved = true;
+  }
+  cfmakeraw(&t);
+  return tcsetattr(fd, TCSANOW, &t) == 0;
+}
+
+bool host_uart_open_pty(const char *link)
+{
+  const int master = posix_openpt(O_RDWR | O_NOCTTY);
+  if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) {
+    perror("posix_openpt");
+    return false;
+  }
+  const char *name = ptsname(master);
+  // Keeping the slave open ourselves means writes never fail while no
+  // terminal is attached, they just wait in the pty
+  const int slave = open(name, O_RDWR | O_NOCTTY);
+  if (slave < 0 || !prv_make_raw(slave, false)) {
+    perror(name);
+    return false;
+  }
+  fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+  s_fd_in = s_fd_out = master;
+
+  if (link != NULL) {
+    unlink(link);
+    if (symlink(name, link) != 0) {
+      perror(link);
+      return false;
+    }
+    s_link = link;
+  }
+  atexit(prv_restore);
+  printf("armdbg: shell on %s%s%s\n", name, link ? " -> " : "", link ? link : "");
+  fflush(stdout);
+  return true;
+}
+
+bool host_uart_open_stdio(void)
+{
+  s_fd_in = STDIN_FILENO;
+  s_fd_out = STDOUT_FILENO;
+  s_is_stdio = true;
+  if (isatty(s_fd_in) && !prv_make_raw(s_fd_in, true)) {
+    return false;
+  }
+  s_saved_fl_in = fcntl(s_fd_in, F_GETFL);
+  s_saved_fl_out = fcntl(s_fd_out, F_GETFL);
+  fcntl(s_fd_in, F_SETFL, s_saved_fl_in | O_NONBLOCK);
+  fcntl(s_fd_out, F_SETFL, s_saved_fl_out | O_NONBLOCK);
+  atexit(prv_restore);
+  return true;
+}
+
+void MX_USART1_UART_Init(void)
+{
+}
+
+/* Transmit ------------------------------------------------------------------*/
+
+// with s_tx_lock held
+static void prv_tx_pump(bool wait)
+{
+  while (1) {
+    if (s_tx.pos == s_tx.len) {
+      s_tx.pos = s_tx.len = 0;
+      while (!s_tx_paused && s_tx.len < sizeof(s_tx.buf) &&
+             uart_tx_next_byte_cb(&s_tx.buf[s_tx.len])) {
+        s_tx.len++;
+      }
+      if (s_tx.len == 0) {
+        s_tx_active = false;
+        return;
+      }
+    }
+
+    const ssize_t n = write(s_fd_out, &s_tx.buf[s_tx.pos], s_tx.len - s_tx.pos);
+    if (n > 0) {
+      s_tx.pos += n;
+      s_tx_sent += n;
+      s_last_activity_ms = HAL_GetTick();
+    } else if (n < 0 && errno == EAGAIN && wait) {
+      struct pollfd fd = { .fd = s_fd_out, .events = POLLOUT };
+      poll(&fd, 1, -1);
+    } else {
+      return;
+    }
+  }
+}
+
+// with s_tx_lock held
+static void prv_tx_write_all(const uint8_t *data, size_t len)
+{
+  while (len > 0) {
+    const ssize_t n = write(s_fd_out, data, len);
+    if (n > 0) {
+      data += n;
+      len -= n;
+      s_tx_sent += n;
+    } else if (n < 0 && errno == EAGAIN) {
+      struct pollfd fd = { .fd = s_fd_out, .events = POLLOUT };
+      poll(&fd, 1, -1);
+    } else {
+      return;
+    }
+  }
+  s_last_activity_ms = HAL_GetTick();
+}
+
+void uart_tx_kick(void)
+{
+  s_tx_active = true;
+  host_irq_kick();
+}
+
+bool uart_tx_irq_can_run(void)
+{
+  return host_irq_can_preempt();
+}
+
+void uart_tx_poll_byte(uint8_t byte)
+{
+  pthread_mutex_lock(&s_tx_lock);
+  // whatever the interrupt already took off the queue goes first
+  prv_tx_write_all(&s_tx.buf[s_tx.pos], s_tx.len - s_tx.pos);
+  s_tx.pos = s_tx.len = 0;
+  prv_tx_write_all(&byte, sizeof(byte));
+  pthread_mutex_unlock(&s_tx_lock);
+}
+
+bool uart_tx_poll_one(void)
+{
+  uint8_t byte;
+  if (!uart_tx_next_byte_cb(&byte)) {
+    return false;
+  }
+  uart_tx_poll_byte(byte);
+  return true;
+}
+
+void uart_tx_set_direct(bool direct)
+{
+  s_tx_direct = direct;
+}
+
+bool uart_tx_is_direct(void)
+{
+  return s_tx_direct;
+}
+
+void uart_tx_flush(void)
+{
+  if (uart_tx_irq_can_run()) {
+    uart_tx_kick();
+    while (s_tx_active) {
+      usleep(100);
+    }
+  } else {
+    while (uart_tx_poll_one()) { }
+    pthread_mutex_lock(&s_tx_lock);
+    prv_tx_pump(true);
+    pthread_mutex_unlock(&s_tx_lock);
+  }
+}
+
+uint32_t uart_tx_get_sent(void)
+{
+  return s_tx_sent;
+}
+
+HAL_StatusTypeDef HAL_UART_Transmit(UART_HandleTypeDef *huart, uint8_t *data, uint16_t size,
+                                    uint32_t timeout)
+{
+  pthread_mutex_lock(&s_tx_lock);
+  prv_tx_write_all(data, size);
+  pthread_mutex_unlock(&s_tx_lock);
+  return HAL_OK;
+}
+
+void uart_get_irq_profile(uint32_t *cycles, uint32_t *count)
+{
+  *cycles = 0;
+  *count = 0;
+}
+
+void uart_reset_irq_profile(void)
+{
+}
+
+/* Baud rate, meaningless on a pty but kept consistent -----------------------*/
+
+uint32_t uart_get_baud(void)
+{
+  return huart1.Init.BaudRate;
+}
+
+uint32_t uart_get_max_baud(void)
+{
+  return HAL_RCC_GetPCLK2Freq() / 16;
+}
+
+uint32_t uart_get_min_baud(void)
+{
+  return (HAL_RCC_GetPCLK2Freq() + 16 * 0xfff - 1) / (16 * 0xfff);
+}
+
+uint32_t uart_get_actual_baud(uint32_t baud)
+{
+  return baud;
+}
+
+bool uart_set_baud(uint32_t baud)
+{
+  if (baud < uart_get_min_baud() || baud > uart_get_max_baud()) {
+    return false;
+  }
+  uart_tx_flush();
+  huart1.Init.BaudRate = baud;
+  return true;
+}
+
+/* Flow control --------------------------------------------------------------*/
+
+void uart_set_flow(eUartFlow flow)
+{
+  s_flow = flow;
+  s_tx_paused = false;
+}
+
+eUartFlow uart_get_flow(void)
+{
+  return s_flow;
+}
+
+void uart_rx_throttle(bool stop)
+{
+  if (stop == s_rx_throttled) {
+    return;
+  }
+  s_rx_throttled = stop;
+  if (stop) {
+    s_rx_stats.throttled++;
+  }
+  if (s_flow == kUartFlow_XonXoff) {
+    uart_tx_poll_byte(stop ? UART_XOFF : UART_XON);
+  }
+}
+
+bool uart_rx_throttled(void)
+{
+  return s_rx_throttled;
+}
+
+void uart_rx_get_stats(sUartRxStats *stats)
+{
+  *stats = s_rx_stats;
+}
+
+void uart_rx_reset_stats(void)
+{
+  s_rx_stats = (sUartRxStats) { 0 };
+}
+
+/* Interrupt -----------------------------------------------------------------*/
+
+int host_uart_poll_fds(struct pollfd *fds)
+{
+  int n = 0;
+  if (!s_eof && !s_rx_throttled && s_rx.pos == s_rx.len) {
+    fds[n++] = (struct pollfd) { .fd = s_fd_in, .events = POLLIN };
+  }
+  if (s_tx.pos != s_tx.len) {
+    fds[n++] = (struct pollfd) { .fd = s_fd_out, .events = POLLOUT };
+  }
+  return n;
+}
+
+// XON/XOFF from the host pause our output in that mode
+static void prv_rx_filter_flow(void)
+{
+  size_t out = s_rx.pos;
+  for (size_t i = s_rx.pos; i < s_rx.len; i++) {
+    const uint8_t b = s_rx.buf[i];
+    if (b == UART_XOFF || b == UART_XON) {
+      s_tx_paused = (b == UART_XOFF);
+    } else {
+      s_rx.buf[out++] = b;
+    }
+  }
+  s_rx.len = out;
+}
+
+static void prv_rx(void)
+{
+  if (s_rx.pos == s_rx.len && !s_eof && !s_rx_throttled) {
+    const ssize_t n = read(s_fd_in, s_rx.buf, sizeof(s_rx.buf));
+    if (n > 0) {
+      s_rx.pos = 0;
+      s_rx.len = n;
+      s_rx_stats.rx_bytes += n;
+      s_last_activity_ms = HAL_GetTick();
+      if (s_flow == kUartFlow_XonXoff) {
+        prv_rx_filter_flow();
+      }
+    } else if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+      s_eof = true;
+    }
+  }
+  if (s_rx.pos != s_rx.len) {
+    s_rx.pos += uart_byte_received_cb(&s_rx.buf[s_rx.pos], s_rx.len - s_rx.pos);
+    s_rx_stats.publish_events++;
+  }
+}
+
+void uart_irq(void)
+{
+  prv_rx();
+
+  pthread_mutex_lock(&s_tx_lock);
+  if (s_tx_active || s_tx.pos != s_tx.len) {
+    prv_tx_pump(false);
+  }
+  pthread_mutex_unlock(&s_tx_lock);
+}
+
+void host_uart_irq(void)
+{
+  uart_irq();
+
+  if (s_is_stdio && s_eof && s_rx.pos == s_rx.len && !s_tx_active &&
+      s_tx.pos == s_tx.len && HAL_GetTick() - s_last_activity_ms > HOST_UART_EOF_SETTLE_MS) {
+    exit(0);
+  }
+}
+
+void uart_rx_dma_irq(void)
+{
+}
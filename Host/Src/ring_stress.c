@@ -0,0 +1,112 @@
+// make ring-stress: one thread produces into an sRingBuf, another consumes,
+// as the UART interrupt and the shell do on the target. Every byte is a
+// function of its position in the stream, so a lost, repeated or reordered
+// byte shows up at the consumer. The ring is small and its free running
+// indices start just short of 2^32, so the data wraps around the buffer all
+// the time and the indices wrap within the first few hundred bytes.
+
+#include "ring.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define RING_STRESS_SIZE (64)
+// larger than the ring, so some bulk calls only get part of their data in
+#define RING_STRESS_CHUNK_MAX (100)
+#define RING_STRESS_DEFAULT_BYTES (64u * 1024 * 1024)
+
+RING_DEFINE(s_ring, RING_STRESS_SIZE);
+
+static uint64_t s_total;
+
+static uint8_t prv_expected(uint64_t pos)
+{
+  // not just pos & 0xff, which a slip by 256 bytes would match
+  uint32_t x = (uint32_t)pos * 2654435761u;
+  return (uint8_t)(x >> 24) ^ (uint8_t)(pos >> 8);
+}
+
+// Chunk sizes from a cheap generator, each thread its own
+static size_t prv_chunk(uint32_t *state)
+{
+  *state = *state * 1664525u + 1013904223u;
+  return 1 + (*state >> 16) % RING_STRESS_CHUNK_MAX;
+}
+
+static void *prv_producer(void *arg)
+{
+  uint32_t rng = 1;
+  uint8_t buf[RING_STRESS_CHUNK_MAX];
+  uint64_t pos = 0;
+  while (pos < s_total) {
+    size_t len = prv_chunk(&rng);
+    if (len > s_total - pos) {
+      len = (size_t)(s_total - pos);
+    }
+    for (size_t i = 0; i < len; i++) {
+      buf[i] = prv_expected(pos + i);
+    }
+    // single bytes too, ring_put() has its own path
+    const size_t put = (len == 1) ? (ring_put(&s_ring, buf[0]) ? 1 : 0) :
+        ring_write_bulk(&s_ring, buf, len);
+    pos += put;
+    if (put == 0) {
+      sched_yield(); // full, let the consumer in on a single core
+    }
+  }
+  return NULL;
+}
+
+static void *prv_consumer(void *arg)
+{
+  uint32_t rng = 2;
+  uint8_t buf[RING_STRESS_CHUNK_MAX];
+  uint64_t pos = 0;
+  while (pos < s_total) {
+    const size_t want = prv_chunk(&rng);
+    size_t got;
+    if (want == 1) {
+      got = ring_get(&s_ring, buf) ? 1 : 0;
+    } else {
+      got = ring_read_bulk(&s_ring, buf, want);
+    }
+    if (got == 0) {
+      sched_yield();
+    }
+    for (size_t i = 0; i < got; i++, pos++) {
+      if (buf[i] != prv_expected(pos)) {
+        fprintf(stderr, "ring_stress: byte %llu is 0x%02x, expected 0x%02x\n",
+                (unsigned long long)pos, buf[i], prv_expected(pos));
+        exit(1);
+      }
+    }
+  }
+  return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+  s_total = (argc > 1) ? strtoull(argv[1], NULL, 0) : RING_STRESS_DEFAULT_BYTES;
+  s_ring.head = s_ring.tail = s_ring.reserve = UINT32_MAX - 3 * RING_STRESS_SIZE;
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  pthread_t producer, consumer;
+  pthread_create(&consumer, NULL, prv_consumer, NULL);
+  pthread_create(&producer, NULL, prv_producer, NULL);
+  pthread_join(producer, NULL);
+  pthread_join(consumer, NULL);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  if (ring_used(&s_ring) != 0) {
+    fprintf(stderr, "ring_stress: %zu bytes left over\n", ring_used(&s_ring));
+    return 1;
+  }
+  const double secs = (double)(end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  printf("ring_stress: %llu bytes through a %d byte ring in %.2f s, %.0f bytes/s, no loss\n",
+         (unsigned long long)s_total, RING_STRESS_SIZE, secs, (double)s_total / secs);
+  return 0;
+}
@@ -0,0 +1,62 @@
+// The flash HAL for the macro page of the host and QEMU builds. The page is
+// RAM there (see Host/host.ld and Qemu/mps2_an385.ld), erased at boot, and
+// like F1 flash a halfword can only be programmed once erased, or to 0.
+
+#include "sim.h"
+#include "main.h"
+
+#include <string.h>
+
+extern uint8_t __macro_flash_start[], __macro_flash_end[];
+
+static bool s_flash_locked = true;
+
+void sim_flash_init(void)
+{
+  memset(__macro_flash_start, 0xFF, __macro_flash_end - __macro_flash_start);
+}
+
+static bool prv_flash_range(uint32_t addr, size_t len)
+{
+  const uint32_t start = (uint32_t)(uintptr_t)__macro_flash_start;
+  const uint32_t size = (uint32_t)(__macro_flash_end - __macro_flash_start);
+  return addr >= start && addr - start + len <= size;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Unlock(void)
+{
+  s_flash_locked = false;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Lock(void)
+{
+  s_flash_locked = true;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Program(uint32_t type, uint32_t address, uint64_t data)
+{
+  if (s_flash_locked || type != FLASH_TYPEPROGRAM_HALFWORD || (address & 0x1) != 0 ||
+      !prv_flash_range(address, sizeof(uint16_t))) {
+    return HAL_ERROR;
+  }
+  uint16_t *halfword = (uint16_t *)(uintptr_t)address;
+  if (*halfword != 0xFFFF && (uint16_t)data != 0) {
+    return HAL_ERROR; // PGERR
+  }
+  *halfword = (uint16_t)data;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASHEx_Erase(FLASH_EraseInitTypeDef *erase, uint32_t *page_error)
+{
+  const size_t len = erase->NbPages * FLASH_PAGE_SIZE;
+  if (s_flash_locked || !prv_flash_range(erase->PageAddress, len)) {
+    *page_error = erase->PageAddress;
+    return HAL_ERROR;
+  }
+  memset((void *)(uintptr_t)erase->PageAddress, 0xFF, len);
+  *page_error = 0xFFFFFFFF;
+  return HAL_OK;
+}
@@ -0,0 +1,367 @@
+// Simulated core debug registers for the host and QEMU builds, and `sim`,
+// which plays the CPU running into them: it walks instructions and makes
+// data accesses, raises DebugMonitor for FPB matches, single steps and
+// DWT watchpoints the way the core would, and runs
+// debug_monitor_handler_c() for each event.
+
+#include "sim.h"
+#include "core_regs.h"
+#include "console.h"
+#include "main.h"
+#include "bkpt.h"
+#include "dbg_proto.h"
+#include "shell_args.h"
+#include "shell_cmd.h"
+
+#include <string.h>
+
+#define SIM_FP_NUM_CODE (6)
+#define SIM_FP_NUM_LIT (2)
+// DWT_CTRL up to FUNCTION3, the four comparators of a Cortex-M3
+#define SIM_DWT_NUM_COMP (4)
+#define SIM_DWT_WORDS ((0x20 + 0x10 * SIM_DWT_NUM_COMP) / 4)
+#define SIM_DHCSR_KEY (0xA05Fu << 16)
+#define SIM_DWT_CTRL_CYCCNTENA (1u << 0)
+#define SIM_DWT_CTRL_NUMCOMP (0xFu << 28)
+// index of COMPn in dwt[], MASKn and FUNCTIONn follow
+#define SIM_DWT_COMP_INDEX(_n) ((0x20 + 0x10 * (_n)) / 4)
+// FUNCTION, EMITRANGE, DATAVSIZE, DATAVADDR0 and DATAVADDR1
+#define SIM_DWT_FUNCTION_RW (0x000FFC2Fu)
+#define SIM_DWT_MASK_RW (0x1Fu)
+#define SIM_EXC_DEBUGMON (12)
+
+static struct {
+  volatile uint32_t dfsr;
+  volatile uint32_t dhcsr;
+  volatile uint32_t demcr;
+  volatile uint32_t dwt[SIM_DWT_WORDS];
+  // FP_CTRL, FP_REMAP and the comparators
+  volatile uint32_t fpb[2 + SIM_FP_NUM_CODE + SIM_FP_NUM_LIT];
+} s_regs = {
+  .dwt = { (uint32_t)SIM_DWT_NUM_COMP << 28 },
+  // revision 0, 6 code and 2 literal comparators, disabled
+  .fpb = { (SIM_FP_NUM_LIT << 8) | (SIM_FP_NUM_CODE << 4) },
+};
+
+// CYCCNT at the last write, and sim_cycles() back then
+static uint32_t s_cyccnt_base;
+static uint32_t s_cyccnt_base_cycles;
+
+static volatile uint32_t *prv_reg(uint32_t addr)
+{
+  switch (addr) {
+    case CORE_REG_DFSR:
+      return &s_regs.dfsr;
+    case CORE_REG_DHCSR:
+      return &s_regs.dhcsr;
+    case CORE_REG_DEMCR:
+      return &s_regs.demcr;
+    default:
+      break;
+  }
+  if (addr - CORE_REG_DWT_CTRL < sizeof(s_regs.dwt)) {
+    return &s_regs.dwt[(addr - CORE_REG_DWT_CTRL) / 4];
+  }
+  if (addr - CORE_REG_FP_CTRL < sizeof(s_regs.fpb)) {
+    return &s_regs.fpb[(addr - CORE_REG_FP_CTRL) / 4];
+  }
+  return NULL;
+}
+
+// Offset of addr in the COMP, MASK, FUNCTION block of its comparator, or
+// -1 if it isn't one of them
+static int prv_dwt_comp_reg(uint32_t addr, size_t *comp)
+{
+  const uint32_t offset = addr - CORE_REG_DWT_COMP(0);
+  if (offset >= 0x10 * SIM_DWT_NUM_COMP) {
+    return -1;
+  }
+  *comp = offset / 0x10;
+  return (int)(offset % 0x10);
+}
+
+static bool prv_cyccnt_running(void)
+{
+  return (s_regs.demcr & CORE_REG_DEMCR_TRCENA) &&
+      (s_regs.dwt[0] & SIM_DWT_CTRL_CYCCNTENA);
+}
+
+static uint32_t prv_cyccnt(void)
+{
+  if (!prv_cyccnt_running()) {
+    return s_cyccnt_base;
+  }
+  return s_cyccnt_base + (sim_cycles() - s_cyccnt_base_cycles);
+}
+
+uint32_t sim_reg_read(uint32_t addr)
+{
+  volatile uint32_t *reg = prv_reg(addr);
+  if (reg == NULL) {
+    return 0;
+  }
+  switch (addr) {
+    case CORE_REG_DWT_CYCCNT:
+      return prv_cyccnt();
+    case CORE_REG_FP_CTRL:
+      return *reg & ~0x2u; // KEY reads as zero
+    default:
+      break;
+  }
+  const uint32_t value = *reg;
+  size_t comp;
+  if (prv_dwt_comp_reg(addr, &comp) == CORE_REG_DWT_FUNCTION(0) - CORE_REG_DWT_COMP(0)) {
+    *reg &= ~CORE_REG_DWT_FUNCTION_MATCHED; // cleared by reading
+  }
+  return value;
+}
+
+void sim_reg_write(uint32_t addr, uint32_t value)
+{
+  volatile uint32_t *reg = prv_reg(addr);
+  if (reg == NULL) {
+    return;
+  }
+  size_t comp;
+  uint32_t writable;
+  switch (addr) {
+    case CORE_REG_DFSR:
+      *reg &= ~value; // write one to clear
+      break;
+    case CORE_REG_DHCSR:
+      // only with the key, the way a halting debugger would set C_DEBUGEN
+      if ((value & 0xFFFF0000u) == SIM_DHCSR_KEY) {
+        *reg = value & 0xFFFF;
+      }
+      break;
+    case CORE_REG_DWT_CTRL:
+    case CORE_REG_DEMCR:
+      s_cyccnt_base = prv_cyccnt();
+      s_cyccnt_base_cycles = sim_cycles();
+      if (addr == CORE_REG_DWT_CTRL) {
+        value = (value & ~SIM_DWT_CTRL_NUMCOMP) | (*reg & SIM_DWT_CTRL_NUMCOMP);
+      }
+      *reg = value;
+      break;
+    case CORE_REG_DWT_CYCCNT:
+      s_cyccnt_base = value;
+      s_cyccnt_base_cycles = sim_cycles();
+      break;
+    case CORE_REG_FP_CTRL:
+      // ENABLE only changes with KEY set, the rest is read only
+      if (value & 0x2) {
+        *reg = (*reg & ~0x1u) | (value & 0x1);
+      }
+      break;
+    default:
+      switch (prv_dwt_comp_reg(addr, &comp)) {
+        case CORE_REG_DWT_MASK(0) - CORE_REG_DWT_COMP(0):
+          *reg = value & SIM_DWT_MASK_RW;
+          break;
+        case CORE_REG_DWT_FUNCTION(0) - CORE_REG_DWT_COMP(0):
+          // comparator 1 alone matches data values, MATCHED is read only
+          writable = SIM_DWT_FUNCTION_RW | ((comp == 1) ? CORE_REG_DWT_FUNCTION_DATAVMATCH : 0);
+          *reg = (*reg & CORE_REG_DWT_FUNCTION_MATCHED) | (value & writable);
+          break;
+        default:
+          *reg = value;
+          break;
+      }
+      break;
+  }
+}
+
+/* Simulated execution -------------------------------------------------------*/
+
+static bool prv_fpb_match(uint32_t pc)
+{
+  if ((sim_reg_read(CORE_REG_FP_CTRL) & 0x1) == 0) {
+    return false;
+  }
+  for (size_t i = 0; i < SIM_FP_NUM_CODE; i++) {
+    const uint32_t comp = sim_reg_read(CORE_REG_FP_COMP(i));
+    const uint32_t replace = comp >> 30;
+    if ((comp & 0x1) == 0 || replace == 0) {
+      continue; // remaps aren't simulated
+    }
+    const uint32_t addr = (comp & 0x1FFFFFFC) | ((replace == 0x2) ? 0x2 : 0);
+    if (addr == pc) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool prv_dwt_addr_match(size_t comp, uint32_t addr, uint32_t size)
+{
+  const volatile uint32_t *regs = &s_regs.dwt[SIM_DWT_COMP_INDEX(comp)];
+  const uint32_t ignore = (1u << regs[1]) - 1;
+  const uint32_t start = regs[0] & ~ignore;
+  return addr <= start + ignore && addr + size > start;
+}
+
+// Sets MATCHED on the comparators a data access hits. PC and cycle count
+// comparisons aren't simulated.
+static bool prv_dwt_match(uint32_t addr, uint32_t size, bool write, uint32_t value)
+{
+  if ((s_regs.demcr & CORE_REG_DEMCR_TRCENA) == 0) {
+    return false;
+  }
+  bool hit = false;
+  for (size_t i = 0; i < SIM_DWT_NUM_COMP; i++) {
+    volatile uint32_t *regs = &s_regs.dwt[SIM_DWT_COMP_INDEX(i)];
+    const uint32_t function = regs[2];
+    const uint32_t kind = function & 0xF;
+    if (kind < 5 || (kind == 5 && write) || (kind == 6 && !write)) {
+      continue;
+    }
+    if (function & CORE_REG_DWT_FUNCTION_DATAVMATCH) {
+      // COMP1 holds the value, the linked comparator the address
+      const size_t link = (function >> 12) & 0xF;
+      const uint32_t vsize = 1u << ((function >> 10) & 0x3);
+      const uint32_t lanes = (vsize == 4) ? 0xFFFFFFFFu : ((1u << (8 * vsize)) - 1);
+      if (size != vsize || ((value ^ regs[0]) & lanes) != 0 || link >= SIM_DWT_NUM_COMP ||
+          (link != i && !prv_dwt_addr_match(link, addr, size))) {
+        continue;
+      }
+    } else if (!prv_dwt_addr_match(i, addr, size)) {
+      continue;
+    }
+    regs[2] |= CORE_REG_DWT_FUNCTION_MATCHED;
+    hit = true;
+  }
+  return hit;
+}
+
+#if HOST_BUILD
+static void prv_debug_mon(void *ctx)
+{
+  debug_monitor_handler_c(ctx);
+}
+#endif
+
+// What DebugMon_Handler would have saved, for events no real exception
+// precedes. r4-r11 keep whatever the monitor last wrote to them.
+static void prv_fake_entry(void)
+{
+  g_debug_context.primask = 0;
+  g_debug_context.basepri = 0;
+  g_debug_context.control = 0;
+  g_debug_context.exc_return = 0xFFFFFFF9; // thread mode on MSP
+}
+
+bool sim_debug_event(sContextStateFrame *frame, uint32_t dfsr_bit)
+{
+  if ((s_regs.demcr & CORE_REG_DEMCR_MON_EN) == 0) {
+    return false;
+  }
+  s_regs.dfsr |= dfsr_bit;
+#if HOST_BUILD
+  prv_fake_entry();
+  host_exception_run(SIM_EXC_DEBUGMON, prv_debug_mon, frame);
+#else
+  // in QEMU either already the real exception, or `sim` in thread mode
+  debug_monitor_handler_c(frame);
+#endif
+  return true;
+}
+
+// Returns where execution continues
+static uint32_t prv_debug_event(uint32_t pc, uint32_t dfsr_bit)
+{
+  sContextStateFrame frame = {
+    .return_address = pc,
+    .xpsr = 0x01000000, // Thumb
+  };
+  prv_fake_entry();
+  sim_debug_event(&frame, dfsr_bit);
+  return frame.return_address;
+}
+
+// The program's code, and the functions it runs from RAM, what the debug
+// monitor may read an instruction from
+static bool prv_sim_addr_ok(uint32_t addr)
+{
+  extern const char __executable_start[], _etext[], _sdata[], _edata[];
+  return (addr >= (uintptr_t)__executable_start && addr + 2 <= (uintptr_t)_etext) ||
+      (addr >= (uintptr_t)_sdata && addr + 2 <= (uintptr_t)_edata);
+}
+
+// A load or store of size bytes, the way an instruction of the `sim`
+// command itself would make it. Watchpoints stop the core after the access.
+static int prv_sim_access(int argc, char *argv[])
+{
+  const bool write = (strcmp(argv[1], "write") == 0);
+  const int size_arg = write ? 4 : 3;
+  uint32_t addr;
+  uint32_t value = 0;
+  uint32_t size = 4;
+  if (argc < size_arg || argc > size_arg + 1 || !shell_arg_addr(argv[2], &addr) ||
+      (write && !shell_arg_u32(argv[3], &value)) ||
+      (argc > size_arg && !shell_arg_u32(argv[size_arg], &size))) {
+    logp("Expected read <addr> [size] | write <addr> <value> [size]");
+    return -1;
+  }
+  if ((size != 1 && size != 2 && size != 4) || (addr & (size - 1)) != 0 ||
+      core_reg_is_ppb(addr) ||
+      !(write ? dbg_proto_write_ok(addr, size) : dbg_proto_access_ok(addr, size))) {
+    logp("Can't access 0x%x+%d", (int)addr, (int)size);
+    return -1;
+  }
+
+  void *mem = (void *)(uintptr_t)addr;
+  if (write) {
+    memcpy(mem, &value, size);
+  } else {
+    memcpy(&value, mem, size);
+  }
+  if (prv_dwt_match(addr, size, write, value)) {
+    prv_debug_event((uint32_t)(uintptr_t)prv_sim_access & ~0x1u, CORE_REG_DFSR_DWTTRAP);
+  }
+  logp("sim: %s 0x%x at 0x%x", argv[1], (int)value, (int)addr);
+  return 0;
+}
+
+static int prv_sim(int argc, char *argv[])
+{
+  if (argc > 1 && (strcmp(argv[1], "read") == 0 || strcmp(argv[1], "write") == 0)) {
+    return prv_sim_access(argc, argv);
+  }
+
+  uint32_t pc;
+  uint32_t count = 1;
+  if (argc < 3 || strcmp(argv[1], "exec") != 0 || !shell_arg_addr(argv[2], &pc) ||
+      (argc > 3 && !shell_arg_u32(argv[3], &count))) {
+    logp("Expected exec <addr> [instructions] | read <addr> [size] | write <addr> <value> [size]");
+    return -1;
+  }
+  pc &= ~0x1u;
+  if (!prv_sim_addr_ok(pc) || !prv_sim_addr_ok(pc + 2 * count)) {
+    logp("0x%x is not in the program", (int)pc);
+    return -1;
+  }
+
+  // Every instruction is two bytes, a breakpoint is taken before its
+  // instruction runs and a step halts after it. The code is the host's, so
+  // the only BKPT instructions are those software breakpoints patched in.
+  for (uint32_t i = 0; i < count; i++) {
+    const uint16_t instruction = *(const volatile uint16_t *)(uintptr_t)pc;
+    if (prv_fpb_match(pc) || ((instruction & 0xff00) == 0xbe00 && bkpt_find(pc) >= 0)) {
+      const uint32_t resume = prv_debug_event(pc, CORE_REG_DFSR_BKPT);
+      if (resume != pc) {
+        pc = resume;
+        continue; // skipped a BKPT instruction
+      }
+    }
+    pc += 2;
+    if (s_regs.demcr & CORE_REG_DEMCR_MON_STEP) {
+      pc = prv_debug_event(pc, CORE_REG_DFSR_HALTED);
+    }
+  }
+  logp("sim: stopped at 0x%x", (int)pc);
+  return 0;
+}
+
+SHELL_COMMAND(sim, prv_sim,
+              "Run the simulated core into breakpoints, steps and watchpoints: "
+              "exec <addr> [instructions] | read <addr> [size] | write <addr> <value> [size]");
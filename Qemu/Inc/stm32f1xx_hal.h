@@ -0,0 +1,73 @@
+#ifndef __STM32F1xx_HAL_H
+#define __STM32F1xx_HAL_H
+
+// Device header of the QEMU build (make qemu): the mps2-an385 board, a
+// Cortex-M3 with CMSDK peripherals, under the name the portable sources
+// include. The core is real, so this is the actual CMSIS, next to the HAL
+// subset the host build uses too.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sim_hal.h"
+
+typedef enum {
+  NonMaskableInt_IRQn = -14,
+  HardFault_IRQn = -13,
+  MemoryManagement_IRQn = -12,
+  BusFault_IRQn = -11,
+  UsageFault_IRQn = -10,
+  SVCall_IRQn = -5,
+  DebugMonitor_IRQn = -4,
+  PendSV_IRQn = -2,
+  SysTick_IRQn = -1,
+
+  UART0RX_IRQn = 0,
+  //! The transmit interrupt is the one that feeds the TX queues, so it
+  //! stands in for USART1 when the mux holds the consumer off
+  UART0TX_IRQn = 1,
+  USART1_IRQn = UART0TX_IRQn,
+} IRQn_Type;
+
+#define __CM3_REV (0x0201U)
+#define __MPU_PRESENT (1U)
+#define __NVIC_PRIO_BITS (3U)
+#define __Vendor_SysTickConfig (0U)
+
+#include "core_cm3.h"
+
+//! 25 MHz, what QEMU clocks the board and SysTick at
+extern uint32_t SystemCoreClock;
+
+void HAL_IncTick(void);
+
+/* CMSDK APB UART ------------------------------------------------------------*/
+
+typedef struct {
+  volatile uint32_t DATA;
+  volatile uint32_t STATE;
+  volatile uint32_t CTRL;
+  //! INTSTATUS on read, INTCLEAR (write one to clear) on write
+  volatile uint32_t INTSTATUS;
+  volatile uint32_t BAUDDIV;
+} CMSDK_UART_TypeDef;
+
+#define CMSDK_UART0 ((CMSDK_UART_TypeDef *)0x40004000UL)
+
+#define CMSDK_UART_STATE_TXFULL (1UL << 0)
+#define CMSDK_UART_STATE_RXFULL (1UL << 1)
+#define CMSDK_UART_STATE_RXOVR (1UL << 3)
+#define CMSDK_UART_CTRL_TXEN (1UL << 0)
+#define CMSDK_UART_CTRL_RXEN (1UL << 1)
+#define CMSDK_UART_CTRL_TXINTEN (1UL << 2)
+#define CMSDK_UART_CTRL_RXINTEN (1UL << 3)
+#define CMSDK_UART_INT_TX (1UL << 0)
+#define CMSDK_UART_INT_RX (1UL << 1)
+
+/* QEMU ----------------------------------------------------------------------*/
+
+//! UART0 receive interrupt, the transmit side is USART1_IRQHandler()
+void UART0RX_IRQHandler(void);
+
+#endif /* __STM32F1xx_HAL_H */
@@ -0,0 +1,80 @@
+// Entry point of the QEMU build (make qemu) and the part of the HAL the
+// portable sources need, on the mps2-an385 board. SysTick, PendSV and the
+// NVIC are QEMU's, so interrupts, priorities and PRIMASK are the real thing.
+
+#include "main.h"
+#include "console.h"
+#include "dbg_proto.h"
+#include "sampler.h"
+#include "shell.h"
+#include "sim.h"
+#include "usart.h"
+
+uint32_t SystemCoreClock = 25000000;
+
+static volatile uint32_t s_tick_ms;
+
+/* HAL -----------------------------------------------------------------------*/
+
+void HAL_IncTick(void)
+{
+  s_tick_ms++;
+}
+
+uint32_t HAL_GetTick(void)
+{
+  return s_tick_ms;
+}
+
+void HAL_Delay(uint32_t delay_ms)
+{
+  const uint32_t start = HAL_GetTick();
+  while (HAL_GetTick() - start < delay_ms) { }
+}
+
+uint32_t HAL_RCC_GetSysClockFreq(void)
+{
+  return SystemCoreClock;
+}
+
+uint32_t HAL_RCC_GetPCLK2Freq(void)
+{
+  return SystemCoreClock;
+}
+
+void Error_Handler(void)
+{
+  __disable_irq();
+  while (1) { }
+}
+
+/* Simulation --------------------------------------------------------------*/
+
+uint32_t sim_cycles(void)
+{
+  // SysTick counts down from LOAD once per millisecond. With -icount its
+  // clock is QEMU's virtual time, which only instructions advance.
+  uint32_t tick;
+  uint32_t val;
+  do {
+    tick = s_tick_ms;
+    val = SysTick->VAL;
+  } while (tick != s_tick_ms);
+  return tick * (SysTick->LOAD + 1) + (SysTick->LOAD - val);
+}
+
+int main(void)
+{
+  SysTick_Config(SystemCoreClock / 1000);
+  // what HAL_InitTick(TICK_INT_PRIORITY) leaves on the target
+  NVIC_SetPriority(SysTick_IRQn, 0);
+
+  sim_flash_init();
+  MX_USART1_UART_Init();
+
+  logp("==Booted==");
+
+  dbg_proto_init();
+  sampler_init();
+  shell_processing_loop();
+}
@@ -0,0 +1,68 @@
+// Core registers of the QEMU build. QEMU models the NVIC and the rest of
+// the SCS but no debug hardware: there is no FPB, no DWT and no monitor
+// stepping, so DFSR, DHCSR, DEMCR, the DWT and the FPB are the simulation
+// in Host/Src/sim_regs.c. FPB hits only happen under `sim exec`, and
+// watchpoint hits under `sim read` and `sim write`.
+// BKPT instructions do raise DebugMonitor, DebugMon_Handler calls
+// qemu_debug_mon() in place of debug_monitor_handler_c().
+
+#include "bkpt.h"
+#include "core_regs.h"
+#include "sim.h"
+#include "main.h"
+#include "stm32f1xx_it.h"
+
+#define QEMU_SCS_BASE (0xE000E000)
+#define QEMU_SCS_END (0xE000F000)
+
+static bool prv_is_debug_reg(uint32_t addr)
+{
+  return addr == CORE_REG_DFSR || addr == CORE_REG_DHCSR || addr == CORE_REG_DEMCR ||
+      (addr >= CORE_REG_DWT_CTRL && addr < CORE_REG_FP_CTRL + 0x1000);
+}
+
+// The rest of the PPB either doesn't exist in QEMU or faults
+static bool prv_is_scs(uint32_t addr)
+{
+  return addr >= QEMU_SCS_BASE && addr < QEMU_SCS_END;
+}
+
+uint32_t core_reg_read(uint32_t addr)
+{
+  if (prv_is_debug_reg(addr)) {
+    return sim_reg_read(addr);
+  }
+  if (core_reg_is_ppb(addr) && !prv_is_scs(addr)) {
+    return 0;
+  }
+  return *(volatile uint32_t *)addr;
+}
+
+void core_reg_write(uint32_t addr, uint32_t value)
+{
+  if (prv_is_debug_reg(addr)) {
+    sim_reg_write(addr, value);
+  } else if (!core_reg_is_ppb(addr) || prv_is_scs(addr)) {
+    *(volatile uint32_t *)addr = value;
+  }
+}
+
+//! DebugMonitor, from DebugMon_Handler with the context saved
+void qemu_debug_mon(sContextStateFrame *frame)
+{
+  const uint32_t pc = frame->return_address;
+  // QEMU takes it whatever DEMCR says, a core escalates to HardFault
+  if (!sim_debug_event(frame, CORE_REG_DFSR_BKPT)) {
+    HardFault_Handler();
+  }
+  // and can't single step: the steps the monitor asks for halt in place,
+  // until it continues
+  while (core_reg_read(CORE_REG_DEMCR) & CORE_REG_DEMCR_MON_STEP) {
+    sim_debug_event(frame, CORE_REG_DFSR_HALTED);
+  }
+  // A software breakpoint would hit again straight away, it stays lifted
+  // until the next debug event instead
+  if (frame->return_address == pc) {
+    bkpt_step_begin(pc);
+  }
+}
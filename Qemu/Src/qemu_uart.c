@@ -0,0 +1,322 @@
+// usart.h for the QEMU build: USART1 is UART0 of the mps2-an385, a CMSDK
+// APB UART on QEMU's -serial. Its receive and transmit interrupts are
+// separate, transmit is USART1_IRQHandler() so that masking USART1_IRQn
+// keeps the TX queue consumer out as on the target. There are no RTS/CTS
+// lines, and no DMA.
+
+#include "usart.h"
+#include "dbg.h"
+
+UART_HandleTypeDef huart1;
+DMA_HandleTypeDef hdma_usart1_rx;
+
+#define UART CMSDK_UART0
+
+static sUartRxStats s_rx_stats;
+
+static eUartFlow s_flow = UART_FLOW;
+static bool s_rx_throttled;
+// XOFF from the host holds back the TX interrupt
+static volatile bool s_tx_paused;
+// XON/XOFF waiting to go out ahead of everything queued
+static volatile uint8_t s_tx_ctrl;
+
+static uint32_t s_tx_sent;
+static bool s_tx_direct;
+
+// CPU time spent in uart_irq(), see uart_get_irq_profile()
+static uint32_t s_irq_cycles;
+static uint32_t s_irq_count;
+
+static void prv_ctrl_modify(uint32_t clear, uint32_t set)
+{
+  const uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+  UART->CTRL = (UART->CTRL & ~clear) | set;
+  __set_PRIMASK(primask);
+}
+
+/* Receive -------------------------------------------------------------------*/
+
+static void prv_publish_data(const uint8_t *buf, size_t size)
+{
+  if (size == 0) {
+    return;
+  }
+  const size_t accepted = uart_byte_received_cb(buf, size);
+  s_rx_stats.rx_bytes += size;
+  s_rx_stats.dropped += size - accepted;
+  s_rx_stats.publish_events++;
+}
+
+void UART0RX_IRQHandler(void)
+{
+  UART->INTSTATUS = CMSDK_UART_INT_RX;
+  if (UART->STATE & CMSDK_UART_STATE_RXOVR) {
+    UART->STATE = CMSDK_UART_STATE_RXOVR;
+    s_rx_stats.errors++;
+  }
+  // a one byte buffer, QEMU holds the rest back until it is read
+  while (UART->STATE & CMSDK_UART_STATE_RXFULL) {
+    const uint8_t byte = UART->DATA;
+    if (s_flow == kUartFlow_XonXoff && (byte == UART_XON || byte == UART_XOFF)) {
+      // the host's XON/XOFF are meant for our transmitter, not the consumer
+      s_tx_paused = (byte == UART_XOFF);
+      if (!s_tx_paused) {
+        uart_tx_kick();
+      }
+      continue;
+    }
+    prv_publish_data(&byte, 1);
+  }
+}
+
+void uart_rx_dma_irq(void)
+{
+}
+
+void uart_rx_get_stats(sUartRxStats *stats)
+{
+  *stats = s_rx_stats;
+}
+
+void uart_rx_reset_stats(void)
+{
+  s_rx_stats = (sUartRxStats) { 0 };
+}
+
+/* Transmit ------------------------------------------------------------------*/
+// The queues live with the producer, see uart_tx_next_byte_cb()
+
+// The TX interrupt fires when a byte has gone out, TXINTEN doubles as the
+// TXEIE of the target: set while the interrupt feeds the data register
+static void prv_tx_irq(void)
+{
+  UART->INTSTATUS = CMSDK_UART_INT_TX;
+  if (!(UART->CTRL & CMSDK_UART_CTRL_TXINTEN) || (UART->STATE & CMSDK_UART_STATE_TXFULL)) {
+    return;
+  }
+
+  uint8_t byte = s_tx_ctrl;
+  if (byte != 0) {
+    s_tx_ctrl = 0;
+  } else if (s_tx_paused || !uart_tx_next_byte_cb(&byte)) {
+    prv_ctrl_modify(CMSDK_UART_CTRL_TXINTEN, 0);
+    return;
+  }
+
+  UART->DATA = byte;
+  s_tx_sent++;
+}
+
+void uart_irq(void)
+{
+  const uint32_t start = dwt_cyccnt_read();
+  prv_tx_irq();
+  s_irq_cycles += dwt_cyccnt_read() - start;
+  s_irq_count++;
+}
+
+void uart_get_irq_profile(uint32_t *cycles, uint32_t *count)
+{
+  *cycles = s_irq_cycles;
+  *count = s_irq_count;
+}
+
+void uart_reset_irq_profile(void)
+{
+  s_irq_cycles = 0;
+  s_irq_count = 0;
+}
+
+void uart_tx_kick(void)
+{
+  if (!s_tx_direct) {
+    // an idle transmitter raises nothing by itself, the first byte goes
+    // out from a software pended interrupt
+    prv_ctrl_modify(0, CMSDK_UART_CTRL_TXINTEN);
+    NVIC_SetPendingIRQ(UART0TX_IRQn);
+  }
+}
+
+bool uart_tx_irq_can_run(void)
+{
+  if (s_tx_direct || __get_PRIMASK() != 0) {
+    return false;
+  }
+
+  const uint32_t ipsr = __get_IPSR();
+  if (ipsr == 0) {
+    return true; // thread mode
+  }
+  if (ipsr < 4) {
+    return false; // NMI / HardFault
+  }
+  const IRQn_Type active = (IRQn_Type)((int32_t)ipsr - 16);
+  return NVIC_GetPriority(active) > NVIC_GetPriority(USART1_IRQn);
+}
+
+void uart_tx_poll_byte(uint8_t byte)
+{
+  while (UART->STATE & CMSDK_UART_STATE_TXFULL) { }
+  UART->DATA = byte;
+  s_tx_sent++;
+}
+
+bool uart_tx_poll_one(void)
+{
+  uint8_t byte;
+  if (!uart_tx_next_byte_cb(&byte)) {
+    return false;
+  }
+  uart_tx_poll_byte(byte);
+  return true;
+}
+
+bool uart_tx_is_direct(void)
+{
+  return s_tx_direct;
+}
+
+void uart_tx_set_direct(bool direct)
+{
+  if (direct) {
+    // take over from the interrupt and push out what is already committed
+    prv_ctrl_modify(CMSDK_UART_CTRL_TXINTEN, 0);
+    s_tx_direct = true;
+    while (uart_tx_poll_one()) { }
+  } else {
+    s_tx_direct = false;
+    uart_tx_kick();
+  }
+}
+
+void uart_tx_flush(void)
+{
+  if (uart_tx_irq_can_run()) {
+    uart_tx_kick();
+    // the interrupt switches itself off once there is nothing left
+    while (UART->CTRL & CMSDK_UART_CTRL_TXINTEN) { }
+  } else {
+    while (uart_tx_poll_one()) { }
+  }
+  while (UART->STATE & CMSDK_UART_STATE_TXFULL) { }
+}
+
+uint32_t uart_tx_get_sent(void)
+{
+  return s_tx_sent;
+}
+
+HAL_StatusTypeDef HAL_UART_Transmit(UART_HandleTypeDef *huart, uint8_t *data, uint16_t size,
+                                    uint32_t timeout)
+{
+  for (uint16_t i = 0; i < size; i++) {
+    uart_tx_poll_byte(data[i]);
+  }
+  return HAL_OK;
+}
+
+/* Flow control --------------------------------------------------------------*/
+
+void uart_set_flow(eUartFlow flow)
+{
+  const uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+
+  s_flow = flow;
+  s_tx_paused = false;
+  s_tx_ctrl = 0;
+  if (flow == kUartFlow_XonXoff && s_rx_throttled) {
+    s_tx_ctrl = UART_XOFF;
+  }
+
+  __set_PRIMASK(primask);
+  uart_tx_kick();
+}
+
+eUartFlow uart_get_flow(void)
+{
+  return s_flow;
+}
+
+void uart_rx_throttle(bool stop)
+{
+  if (stop == s_rx_throttled) {
+    return;
+  }
+  s_rx_throttled = stop;
+  if (stop) {
+    s_rx_stats.throttled++;
+  }
+
+  // kUartFlow_RtsCts has no lines to move here
+  if (s_flow == kUartFlow_XonXoff) {
+    if (s_tx_direct) {
+      uart_tx_poll_byte(stop ? UART_XOFF : UART_XON);
+    } else {
+      s_tx_ctrl = stop ? UART_XOFF : UART_XON;
+      uart_tx_kick();
+    }
+  }
+}
+
+bool uart_rx_throttled(void)
+{
+  return s_rx_throttled;
+}
+
+/* Baud rate, BAUDDIV is PCLK / baud and at least 16 -------------------------*/
+
+uint32_t uart_get_baud(void)
+{
+  return huart1.Init.BaudRate;
+}
+
+uint32_t uart_get_max_baud(void)
+{
+  return HAL_RCC_GetPCLK2Freq() / 16;
+}
+
+uint32_t uart_get_min_baud(void)
+{
+  // BAUDDIV has 20 bits
+  return (HAL_RCC_GetPCLK2Freq() + 0xfffff - 1) / 0xfffff;
+}
+
+uint32_t uart_get_actual_baud(uint32_t baud)
+{
+  const uint32_t pclk = HAL_RCC_GetPCLK2Freq();
+  return pclk / (pclk / baud);
+}
+
+bool uart_set_baud(uint32_t baud)
+{
+  if (baud < uart_get_min_baud() || baud > uart_get_max_baud()) {
+    return false;
+  }
+
+  // let everything queued at the old rate go out first
+  uart_tx_flush();
+
+  UART->BAUDDIV = HAL_RCC_GetPCLK2Freq() / baud;
+  huart1.Init.BaudRate = baud;
+  return true;
+}
+
+/* UART0 init function */
+
+void MX_USART1_UART_Init(void)
+{
+  huart1.Init.BaudRate = 115200;
+  UART->BAUDDIV = HAL_RCC_GetPCLK2Freq() / huart1.Init.BaudRate;
+  UART->CTRL = CMSDK_UART_CTRL_TXEN | CMSDK_UART_CTRL_RXEN | CMSDK_UART_CTRL_RXINTEN;
+
+  // same priority for both halves, as for the target's single USART1 vector
+  NVIC_SetPriority(UART0RX_IRQn, 0);
+  NVIC_SetPriority(UART0TX_IRQn, 0);
+  NVIC_EnableIRQ(UART0RX_IRQn);
+  NVIC_EnableIRQ(UART0TX_IRQn);
+
+  uart_set_flow(s_flow);
+}
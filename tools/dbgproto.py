@@ -0,0 +1,257 @@
+#!/usr/bin/env python3
+"""Host side of the binary debug channel (see Core/Inc/dbg_proto.h).
+
+    tools/dbgproto.py /dev/ttyUSB0 ping
+    tools/dbgproto.py /dev/ttyUSB0 read 0x20000000 0x8000 -o ram.bin
+    tools/dbgproto.py /dev/ttyUSB0 write 0x20001000 deadbeef
+    tools/dbgproto.py /dev/ttyUSB0 reg 0xE000EDFC [value]
+    tools/dbgproto.py /dev/ttyUSB0 bkpt set 0 0x08000400
+    tools/dbgproto.py /dev/ttyUSB0 bkpt clear 0
+    tools/dbgproto.py /dev/ttyUSB0 baud [rate] --bench 0x08000000 0x10000
+"""
+import argparse
+import struct
+import sys
+import time
+
+CMD_PING = 0x01
+CMD_MEM_READ = 0x02
+CMD_MEM_WRITE = 0x03
+CMD_REG_READ = 0x04
+CMD_REG_WRITE = 0x05
+CMD_BKPT_SET = 0x06
+CMD_BKPT_CLEAR = 0x07
+CMD_MEM_STREAM = 0x08
+CMD_SET_BAUD = 0x09
+RESPONSE_FLAG = 0x80
+
+STATUS_OK = 0
+STATUS_MORE = 1
+STATUS_NAMES = ["ok", "more", "bad crc", "bad length", "bad address",
+                "unknown command", "failed"]
+
+
+def crc16(data, crc=0xFFFF):
+    for b in data:
+        crc ^= b << 8
+        for _ in range(8):
+            crc = ((crc << 1) ^ 0x1021) if crc & 0x8000 else crc << 1
+            crc &= 0xFFFF
+    return crc
+
+
+def cobs_encode(data):
+    out = bytearray()
+    block = bytearray()
+    for b in data:
+        if b == 0:
+            out += bytes([len(block) + 1]) + block
+            block = bytearray()
+        else:
+            block.append(b)
+            if len(block) == 254:
+                out += b"\xff" + block
+                block = bytearray()
+    out += bytes([len(block) + 1]) + block
+    return bytes(out)
+
+
+def cobs_decode(data):
+    out = bytearray()
+    i = 0
+    while i < len(data):
+        code = data[i]
+        if code == 0 or i + code > len(data):
+            raise ValueError("malformed COBS frame")
+        out += data[i + 1:i + code]
+        i += code
+        if code != 0xFF and i < len(data):
+            out.append(0)
+    return bytes(out)
+
+
+class ProtocolError(Exception):
+    pass
+
+
+class DbgLink:
+    """Sends requests and collects responses, skipping any text the shell
+    prints in between frames."""
+
+    def __init__(self, ser, retries=3):
+        self.ser = ser
+        self.seq = 0
+        self.retries = retries
+        self.rx = bytearray()
+        self.text = bytearray()
+
+    def _read_frame(self, timeout=1.0):
+        deadline = time.time() + timeout
+        while time.time() < deadline:
+            start = self.rx.find(b"\x00")
+            if start >= 0:
+                self.text += self.rx[:start]
+                end = self.rx.find(b"\x00", start + 1)
+                if end > start + 1:
+                    frame = bytes(self.rx[start + 1:end])
+                    del self.rx[:end + 1]
+                    return cobs_decode(frame)
+                if end == start + 1:
+                    del self.rx[:start + 1]
+                    continue
+            self.rx += self.ser.read(max(1, self.ser.in_waiting))
+        return None
+
+    def _packets(self, seq, cmd, timeout):
+        while True:
+            pkt = self._read_frame(timeout)
+            if pkt is None:
+                return
+            if len(pkt) < 5 or crc16(pkt[:-2]) != struct.unpack("<H", pkt[-2:])[0]:
+                continue
+            if pkt[0] != seq or pkt[1] != (cmd | RESPONSE_FLAG):
+                continue
+            yield pkt[2], pkt[3:-2]
+
+    def request(self, cmd, payload=b"", timeout=1.0, stream=False):
+        for _ in range(self.retries):
+            self.seq = (self.seq + 1) & 0xFF
+            pkt = bytes([self.seq, cmd]) + payload
+            pkt += struct.pack("<H", crc16(pkt))
+            self.ser.write(b"\x00" + cobs_encode(pkt) + b"\x00")
+            chunks = []
+            for status, data in self._packets(self.seq, cmd, timeout):
+                if status == STATUS_MORE and stream:
+                    chunks.append(data)
+                    continue
+                if status != STATUS_OK:
+                    if status == 2:  # bad crc, resend
+                        break
+                    raise ProtocolError(STATUS_NAMES[status] if status < len(STATUS_NAMES)
+                                        else "status %d" % status)
+                return chunks if stream else data
+        raise ProtocolError("no response")
+
+    def ping(self):
+        data = self.request(CMD_PING)
+        version, max_payload = struct.unpack("<BH", data[:3])
+        return version, max_payload
+
+    def read(self, addr, length):
+        out = bytearray(length)
+        for chunk in self.request(CMD_MEM_STREAM, struct.pack("<II", addr, length),
+                                  timeout=2.0, stream=True):
+            offset = struct.unpack("<I", chunk[:4])[0]
+            out[offset:offset + len(chunk) - 4] = chunk[4:]
+        return bytes(out)
+
+    def write(self, addr, data):
+        self.request(CMD_MEM_WRITE, struct.pack("<I", addr) + data)
+
+    def reg_read(self, addr):
+        return struct.unpack("<I", self.request(CMD_REG_READ, struct.pack("<I", addr)))[0]
+
+    def reg_write(self, addr, value):
+        self.request(CMD_REG_WRITE, struct.pack("<II", addr, value))
+
+    def bkpt_set(self, comp_id, addr):
+        self.request(CMD_BKPT_SET, struct.pack("<BI", comp_id, addr))
+
+    def bkpt_clear(self, comp_id):
+        self.request(CMD_BKPT_CLEAR, struct.pack("<B", comp_id))
+
+    def set_baud(self, baud=0):
+        """Negotiates a new rate (0 = fastest the target allows). Returns the
+        new rate, or None if the target fell back to the old one."""
+        old = self.ser.baudrate
+        data = self.request(CMD_SET_BAUD, struct.pack("<I", baud))
+        new, timeout_ms = struct.unpack("<II", data)
+        self.ser.flush()
+        time.sleep(0.01)
+        self.ser.baudrate = new
+        self.rx.clear()
+        deadline = time.time() + timeout_ms / 1000.0 * 0.8
+        while time.time() < deadline:
+            try:
+                self.ping()
+                return new
+            except ProtocolError:
+                pass
+        self.ser.baudrate = old
+        return None
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("port")
+    parser.add_argument("-b", "--baud", type=int, default=115200)
+    sub = parser.add_subparsers(dest="cmd", required=True)
+    sub.add_parser("ping")
+    p = sub.add_parser("read")
+    p.add_argument("addr", type=lambda x: int(x, 0))
+    p.add_argument("length", type=lambda x: int(x, 0))
+    p.add_argument("-o", "--output")
+    p = sub.add_parser("write")
+    p.add_argument("addr", type=lambda x: int(x, 0))
+    p.add_argument("hexdata")
+    p = sub.add_parser("reg")
+    p.add_argument("addr", type=lambda x: int(x, 0))
+    p.add_argument("value", type=lambda x: int(x, 0), nargs="?")
+    p = sub.add_parser("baud", help="negotiate a rate, then time a read at it")
+    p.add_argument("rate", type=int, nargs="?", default=0)
+    p.add_argument("--bench", nargs=2, metavar=("ADDR", "LEN"),
+                   type=lambda x: int(x, 0))
+    p = sub.add_parser("bkpt")
+    p.add_argument("action", choices=["set", "clear"])
+    p.add_argument("comp_id", type=int)
+    p.add_argument("addr", type=lambda x: int(x, 0), nargs="?")
+    args = parser.parse_args()
+
+    import serial
+    with serial.Serial(args.port, args.baud, timeout=0.05) as ser:
+        link = DbgLink(ser)
+        if args.cmd == "ping":
+            print("protocol v%d, max payload %d" % link.ping())
+        elif args.cmd == "read":
+            start = time.time()
+            data = link.read(args.addr, args.length)
+            elapsed = time.time() - start
+            if args.output:
+                with open(args.output, "wb") as f:
+                    f.write(data)
+            else:
+                for off in range(0, len(data), 16):
+                    print("0x%08x: %s" % (args.addr + off, data[off:off + 16].hex(" ")))
+            print("%d bytes in %.3f s (%.0f bytes/s)" % (len(data), elapsed,
+                                                         len(data) / elapsed),
+                  file=sys.stderr)
+        elif args.cmd == "write":
+            link.write(args.addr, bytes.fromhex(args.hexdata))
+        elif args.cmd == "reg":
+            if args.value is None:
+                print("0x%08x" % link.reg_read(args.addr))
+            else:
+                link.reg_write(args.addr, args.value)
+        elif args.cmd == "baud":
+            new = link.set_baud(args.rate)
+            if new is None:
+                print("target did not confirm, still at %d" % ser.baudrate)
+                sys.exit(1)
+            print("link at %d baud" % new)
+            if args.bench:
+                start = time.time()
+                data = link.read(*args.bench)
+                elapsed = time.time() - start
+                print("read %d bytes in %.3f s: %.0f bytes/s (%.0f%% of line rate)" %
+                      (len(data), elapsed, len(data) / elapsed,
+                       100.0 * len(data) * 10 / elapsed / new))
+        elif args.cmd == "bkpt":
+            if args.action == "set":
+                link.bkpt_set(args.comp_id, args.addr)
+            else:
+                link.bkpt_clear(args.comp_id)
+
+
+if __name__ == "__main__":
+    main()
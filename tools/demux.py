@@ -0,0 +1,107 @@
+#!/usr/bin/env python3
+"""Splits the output of a MUX_FRAMED=1 build back into its channels.
+
+Every channel gets a pseudo terminal. Whatever is written to any of them goes
+to the target unchanged, so a terminal can be attached to the shell channel
+and tools/dbgproto.py or tools/logdecode.py to the others:
+
+    tools/demux.py /dev/ttyUSB0
+    tools/demux.py /dev/ttyUSB0 --print log --record capture
+"""
+import argparse
+import os
+import select
+import sys
+import tty
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from dbgproto import cobs_decode  # noqa: E402
+
+CHANNELS = ["shell", "log", "trace", "bulk"]
+FRAME_TAG = 0xA0
+
+
+class Demux:
+    def __init__(self, sink):
+        self.sink = sink
+        self.in_frame = False
+        self.frame = bytearray()
+        self.errors = 0
+
+    def _frame(self, frame):
+        try:
+            chunk = cobs_decode(bytes(frame))
+        except ValueError:
+            chunk = b""
+        ch = chunk[0] - FRAME_TAG if chunk else -1
+        if not 0 <= ch < len(CHANNELS):
+            self.errors += 1
+            return
+        self.sink(ch, chunk[1:])
+
+    def feed(self, data):
+        for b in data:
+            if b == 0:
+                if self.in_frame and self.frame:
+                    self._frame(self.frame)
+                    self.in_frame = False
+                else:
+                    self.in_frame = True
+                self.frame = bytearray()
+            elif self.in_frame:
+                self.frame.append(b)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("port")
+    parser.add_argument("-b", "--baud", type=int, default=115200)
+    parser.add_argument("--print", action="append", default=[], choices=CHANNELS,
+                        help="also copy a channel to stdout")
+    parser.add_argument("--record", metavar="PREFIX",
+                        help="append each channel to PREFIX.<channel>")
+    args = parser.parse_args()
+
+    import serial
+    ser = serial.Serial(args.port, args.baud, timeout=0)
+
+    ptys = []
+    for name in CHANNELS:
+        master, slave = os.openpty()
+        tty.setraw(slave)
+        ptys.append(master)
+        print("%-6s %s" % (name, os.ttyname(slave)))
+    sys.stdout.flush()
+
+    records = [open("%s.%s" % (args.record, name), "ab") if args.record else None
+               for name in CHANNELS]
+
+    def sink(ch, data):
+        os.write(ptys[ch], data)
+        if records[ch]:
+            records[ch].write(data)
+            records[ch].flush()
+        if CHANNELS[ch] in args.print:
+            sys.stdout.buffer.write(data)
+            sys.stdout.flush()
+
+    demux = Demux(sink)
+    try:
+        while True:
+            ready, _, _ = select.select([ser.fileno()] + ptys, [], [])
+            for fd in ready:
+                if fd == ser.fileno():
+                    demux.feed(ser.read(ser.in_waiting or 1))
+                else:
+                    try:
+                        ser.write(os.read(fd, 1024))
+                    except OSError:
+                        pass  # nothing attached to this pty
+    except KeyboardInterrupt:
+        if demux.errors:
+            print("%d bad frames" % demux.errors, file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,164 @@
+#!/usr/bin/env python3
+"""Decoder for deferred logging (make LOG_DEFERRED=1).
+
+Reads the target's output from a serial port (or a capture file with -f),
+passes text through and expands kDbgProtoEvt_Log frames back into log lines
+using the format strings in the ELF's .log_fmt section.
+
+    tools/logdecode.py build/stm32f1test.elf /dev/ttyUSB0
+    tools/logdecode.py build/stm32f1test.elf -f capture.bin
+"""
+import argparse
+import os
+import re
+import struct
+import sys
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from dbgproto import cobs_decode, crc16, RESPONSE_FLAG  # noqa: E402
+
+EVT_LOG = 0x40
+# LOG_DEFERRED_STR_INLINE, a string copied into the frame at the offset below
+STR_INLINE = 0xFFFF0000
+SHF_ALLOC = 0x2
+SHT_NOBITS = 8
+
+FORMAT_RE = re.compile(r"%([-+ #0]*)(\d+|\*)?(?:\.(\d+))?(hh|h|ll|l|z|t|j)?([diuxXcspo%])")
+
+
+class Elf:
+    """Just enough of an ELF32 little endian reader to find sections."""
+
+    def __init__(self, path):
+        with open(path, "rb") as f:
+            self.data = f.read()
+        if self.data[:4] != b"\x7fELF" or self.data[4] != 1:
+            raise ValueError("%s is not an ELF32 file" % path)
+        shoff, = struct.unpack_from("<I", self.data, 0x20)
+        shentsize, shnum, shstrndx = struct.unpack_from("<HHH", self.data, 0x2E)
+        headers = [struct.unpack_from("<IIIIIIIIII", self.data, shoff + i * shentsize)
+                   for i in range(shnum)]
+        strtab_off = headers[shstrndx][4]
+        self.sections = {}
+        for name, stype, flags, addr, offset, size, *_ in headers:
+            end = self.data.index(b"\x00", strtab_off + name)
+            self.sections[self.data[strtab_off + name:end].decode()] = (stype, flags, addr,
+                                                                         offset, size)
+
+    def section_data(self, name):
+        stype, _, _, offset, size = self.sections[name]
+        return self.data[offset:offset + size]
+
+    def read_cstring(self, addr):
+        """Resolve a pointer into a loaded section, or None."""
+        for stype, flags, start, offset, size in self.sections.values():
+            if flags & SHF_ALLOC and stype != SHT_NOBITS and start <= addr < start + size:
+                pos = offset + addr - start
+                end = self.data.find(b"\x00", pos, offset + size)
+                return self.data[pos:end if end >= 0 else offset + size].decode(errors="replace")
+        return None
+
+
+def inline_cstring(payload, offset):
+    end = payload.find(b"\x00", offset)
+    return payload[offset:end if end >= 0 else len(payload)].decode(errors="replace")
+
+
+def c_format(fmt, args, elf, payload=b""):
+    args = list(args)
+
+    def convert(m):
+        flags, width, precision, _, conv = m.groups()
+        if conv == "%":
+            return "%"
+        word = args.pop(0) if args else 0
+        spec = "%" + (flags or "") + (width if width and width != "*" else "")
+        if precision is not None:
+            spec += "." + precision
+        if conv in "di":
+            return (spec + "d") % (word - (1 << 32) if word & 0x80000000 else word)
+        if conv == "c":
+            return (spec + "c") % chr(word & 0xFF)
+        if conv == "s":
+            if word & 0xFFFF0000 == STR_INLINE:
+                return (spec + "s") % inline_cstring(payload, word & 0xFFFF)
+            s = elf.read_cstring(word)
+            return (spec + "s") % (s if s is not None else "<str@0x%08x>" % word)
+        if conv == "p":
+            return "0x%x" % word
+        return (spec + conv) % word
+
+    return FORMAT_RE.sub(convert, fmt)
+
+
+class Decoder:
+    def __init__(self, elf):
+        self.elf = elf
+        self.fmt = elf.section_data(".log_fmt")
+        self.in_frame = False
+        self.frame = bytearray()
+
+    def _log_line(self, payload):
+        fmt_id, = struct.unpack_from("<H", payload)
+        end = self.fmt.find(b"\x00", fmt_id)
+        fmt = self.fmt[fmt_id:end].decode(errors="replace")
+        # words past the arguments are inline strings, c_format() doesn't get that far
+        nargs = (len(payload) - 2) // 4
+        args = struct.unpack_from("<%dI" % nargs, payload, 2)
+        return c_format(fmt, args, self.elf, payload) + "\n"
+
+    def _frame(self, frame):
+        try:
+            pkt = cobs_decode(bytes(frame))
+        except ValueError:
+            return ""
+        if len(pkt) < 5 or crc16(pkt[:-2]) != struct.unpack("<H", pkt[-2:])[0]:
+            return "<corrupt frame>\n"
+        if pkt[1] == EVT_LOG | RESPONSE_FLAG:
+            return self._log_line(pkt[3:-2])
+        return ""
+
+    def feed(self, data):
+        out = []
+        for b in data:
+            if b == 0:
+                if self.in_frame and self.frame:
+                    out.append(self._frame(self.frame))
+                    self.in_frame = False
+                else:
+                    self.in_frame = True
+                self.frame = bytearray()
+            elif self.in_frame:
+                self.frame.append(b)
+            else:
+                out.append(chr(b))
+        return "".join(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("elf")
+    parser.add_argument("port", nargs="?")
+    parser.add_argument("-b", "--baud", type=int, default=115200)
+    parser.add_argument("-f", "--file", help="decode a capture instead of a port")
+    args = parser.parse_args()
+
+    decoder = Decoder(Elf(args.elf))
+    if args.file:
+        with open(args.file, "rb") as f:
+            sys.stdout.write(decoder.feed(f.read()))
+        return
+
+    import serial
+    with serial.Serial(args.port, args.baud, timeout=0.1) as ser:
+        try:
+            while True:
+                sys.stdout.write(decoder.feed(ser.read(max(1, ser.in_waiting))))
+                sys.stdout.flush()
+        except KeyboardInterrupt:
+            pass
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,368 @@
+#!/usr/bin/env python3
+"""End to end test of the shell and the debug monitor over the console UART.
+
+Boots the QEMU build (make qemu) on an emulated mps2-an385, or the host
+build (make host) with --host, then drives it through the serial port like
+a user would: a BKPT instruction, an FPB breakpoint and single steps, each
+answered with 's' / 'c' at the monitor's prompt. Any step that doesn't see
+the expected output fails the run.
+
+It also times a fixed set of commands with `time`. QEMU runs with
+-icount, where every instruction advances virtual time by 2^shift ns, so
+the cycles the firmware reports translate into an exact, repeatable
+instruction count per command, a performance regression signal:
+
+    tools/qemu_test.py --record counts.json
+    tools/qemu_test.py --baseline counts.json --tolerance 2
+    tools/qemu_test.py --host            # against build/host/armdbg
+"""
+import argparse
+import json
+import os
+import re
+import subprocess
+import sys
+import threading
+import time
+
+PROMPT = b"shell> "
+
+# commands whose instruction counts are recorded, side effect free
+TIMED_COMMANDS = [
+    "help",
+    "fpb_dump",
+    "md _sdata 256",
+    "call_dummy_funcs",
+    "sched",
+    "cmdstats",
+]
+
+
+class TestFailure(Exception):
+    pass
+
+
+class Console:
+    """The firmware's UART on a child process' stdin / stdout"""
+
+    def __init__(self, argv, verbose):
+        self.proc = subprocess.Popen(argv, stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+        self.verbose = verbose
+        self.buf = b""
+        self.lock = threading.Condition()
+        threading.Thread(target=self._reader, daemon=True).start()
+
+    def _reader(self):
+        while True:
+            data = os.read(self.proc.stdout.fileno(), 4096)
+            if self.verbose:
+                sys.stdout.buffer.write(data)
+                sys.stdout.flush()
+            with self.lock:
+                self.buf += data if data else b""
+                self.lock.notify_all()
+            if not data:
+                return
+
+    def send(self, text):
+        self.proc.stdin.write(text.encode())
+        self.proc.stdin.flush()
+
+    def expect(self, pattern, timeout=10.0):
+        """Waits for pattern, returns its match and drops everything up to it"""
+        regex = re.compile(pattern.encode() if isinstance(pattern, str) else pattern)
+        deadline = time.time() + timeout
+        with self.lock:
+            while True:
+                match = regex.search(self.buf)
+                if match:
+                    self.buf = self.buf[match.end():]
+                    return match
+                remaining = deadline - time.time()
+                if remaining <= 0 or self.proc.poll() is not None:
+                    tail = self.buf[-400:].decode(errors="replace")
+                    raise TestFailure("expected %r, got:\n%s" % (regex.pattern.decode(), tail))
+                self.lock.wait(remaining)
+
+    def command(self, line, timeout=10.0):
+        """Runs a shell command, returns its output"""
+        self.send(line + "\n")
+        self.expect(re.escape(line.encode()) + b"\r?\n", timeout)
+        return self.expect(b"(?s)(.*?)" + re.escape(PROMPT), timeout).group(1)
+
+    def close(self):
+        self.proc.stdin.close()
+        try:
+            self.proc.wait(timeout=2)
+        except subprocess.TimeoutExpired:
+            self.proc.kill()
+            self.proc.wait()
+
+
+def monitor_answer(con, key, expect_dfsr):
+    """Waits for the debug monitor to halt with the given DFSR flags, then
+    answers it"""
+    con.expect(r"DFSR: +0x[0-9a-f]+ \(%s\)" % expect_dfsr)
+    con.expect(r"Awaiting 'c' or 's'")
+    con.send(key)
+    con.expect(r"Got char '%s'" % key)
+
+
+def test_bkpt(con):
+    con.send("bkpt\n")
+    monitor_answer(con, "s", r"bkpt=1, halt=0, dwt=0")
+    # the step lands on the next instruction, and asks again
+    monitor_answer(con, "c", r"bkpt=0, halt=1, dwt=0")
+    con.expect(re.escape(PROMPT))
+
+
+def test_regs(con):
+    con.send("bkpt\n")
+    con.expect(r"Awaiting 'c' or 's'")
+    con.send("reg r4 0x1234\n")
+    con.expect(r" r4  =0x00001234")
+    con.send("reg sp 0\n")
+    con.expect(r"sp is read-only")
+    # r4 goes back into the core, and is still there at the step's halt
+    con.send("s")
+    con.expect(r"Got char 's'")
+    con.expect(r"bkpt=0, halt=1, dwt=0")
+    con.expect(r" r4  =0x00001234")
+    con.expect(r"Awaiting 'c' or 's'")
+    con.send("c")
+    con.expect(re.escape(PROMPT))
+
+
+def test_watch(con):
+    out = con.command("watch set _sdata w")
+    if not re.search(rb"watch set \d+: w", out):
+        raise TestFailure("watch set: %s" % out.decode(errors="replace"))
+    con.send("sim write _sdata 0x1234\n")
+    con.expect(r"DFSR: +0x[0-9a-f]+ \(bkpt=0, halt=0, dwt=1\)")
+    con.expect(r"Watchpoint \d+ hit: w 0x[0-9a-f]+\+4")
+    con.expect(r"0x[0-9a-f]+: 0x[0-9a-f]+ -> 0x1234")
+    con.expect(r"Awaiting 'c' or 's'")
+    con.send("c")
+    con.expect(re.escape(PROMPT))
+    # a value watch only hits on its value
+    con.command("watch set _sdata+8 w 0x55")
+    con.command("sim write _sdata+8 0x44")
+    con.send("sim write _sdata+8 0x55\n")
+    con.expect(r"Watchpoint \d+ hit: w ")
+    con.expect(r"0x[0-9a-f]+: 0x55 matched")
+    con.expect(r"Awaiting 'c' or 's'")
+    con.send("c")
+    con.expect(re.escape(PROMPT))
+    out = con.command("watch clear all")
+    if b"ok" not in out:
+        raise TestFailure("watch clear: %s" % out.decode(errors="replace"))
+
+
+def test_bkpt_manager(con):
+    out = con.command("bkpt set dummy_function_2")
+    m = re.search(rb"bkpt set (\d+): ", out)
+    if not m:
+        raise TestFailure("bkpt set: %s" % out.decode(errors="replace"))
+    bp = int(m.group(1))
+    # the same address gets the same id
+    if not re.search(rb"bkpt set %d: " % bp, con.command("bkpt set dummy_function_2")):
+        raise TestFailure("bkpt set didn't deduplicate")
+    con.send("sim exec dummy_function_2 2\n")
+    con.expect(r"Breakpoint %d hit at 0x[0-9a-f]+" % bp)
+    con.expect(r"Awaiting 'c' or 's'")
+    con.send("c")
+    con.expect(r"sim: stopped at")
+    con.expect(re.escape(PROMPT))
+    if not re.search(rb"id=%d .*hits=1" % bp, con.command("bkpt list")):
+        raise TestFailure("bkpt list doesn't count the hit")
+    # disabled, the FPB lets it run
+    con.command("bkpt disable %d" % bp)
+    out = con.command("sim exec dummy_function_2 2")
+    if b"DebugMonitor" in out:
+        raise TestFailure("disabled breakpoint hit")
+    if b"ok" not in con.command("bkpt clear %d" % bp):
+        raise TestFailure("bkpt clear failed")
+
+
+def test_soft_bkpt(con):
+    out = con.command("bkpt set dummy_function_ram")
+    m = re.search(rb"bkpt set (\d+): ", out)
+    if not m:
+        raise TestFailure("bkpt set: %s" % out.decode(errors="replace"))
+    bp = int(m.group(1))
+    if not re.search(rb"id=%d .*kind=soft" % bp, con.command("bkpt list")):
+        raise TestFailure("RAM breakpoint isn't a software one")
+    # stepped over with the original instruction, then patched back in
+    for _ in range(2):
+        con.send("sim exec dummy_function_ram 2\n")
+        con.expect(r"Breakpoint %d hit at 0x[0-9a-f]+" % bp)
+        con.expect(r"Awaiting 'c' or 's'")
+        con.send("c")
+        con.expect(r"Single-Stepping over software breakpoint")
+        con.expect(r"sim: stopped at")
+        con.expect(re.escape(PROMPT))
+    if b"ok" not in con.command("bkpt clear %d" % bp):
+        raise TestFailure("bkpt clear failed")
+    if b"DebugMonitor" in con.command("sim exec dummy_function_ram 2"):
+        raise TestFailure("cleared software breakpoint hit")
+
+
+def test_tracepoint(con):
+    for func in ("dummy_function_2", "dummy_function_ram"):
+        out = con.command("trace set %s r0 pc @_sdata" % func)
+        if not re.search(rb"trace set \d+: ", out):
+            raise TestFailure("trace set: %s" % out.decode(errors="replace"))
+        # recorded and resumed, nothing printed on the way
+        for _ in range(2):
+            out = con.command("sim exec %s 2" % func)
+            if b"DebugMonitor" in out or b"sim: stopped" not in out:
+                raise TestFailure("tracepoint stopped: %s" % out.decode(errors="replace"))
+    if not re.search(rb"hits=4 dropped=0", con.command("trace stats")):
+        raise TestFailure("trace stats doesn't count the hits")
+    out = con.command("trace dump")
+    if len(re.findall(rb"trace: id=\d+ cyccnt=\d+ r0=0x[0-9a-f]+ pc=0x[0-9a-f]+ w0=", out)) != 4:
+        raise TestFailure("trace dump: %s" % out.decode(errors="replace"))
+    if b"trace:" in con.command("trace dump"):
+        raise TestFailure("trace dump doesn't drain the ring")
+    # a breakpoint and a tracepoint never share an address, and clearing
+    # one kind leaves the other alone
+    con.command("bkpt set dummy_function_1")
+    if b"already has a breakpoint" not in con.command("trace set dummy_function_1"):
+        raise TestFailure("tracepoint taken over a breakpoint")
+    if b"already has a tracepoint" not in con.command("bkpt set dummy_function_2"):
+        raise TestFailure("breakpoint taken over a tracepoint")
+    con.command("bkpt clear all")
+    if b"tracepoint:" not in con.command("trace list"):
+        raise TestFailure("bkpt clear all took the tracepoints")
+    con.command("bkpt set dummy_function_1")
+    con.command("trace clear all")
+    out = con.command("bkpt list")
+    if b"owner=trace" in out or b"bkpt:" not in out:
+        raise TestFailure("trace clear all: %s" % out.decode(errors="replace"))
+    con.command("bkpt clear all")
+
+
+def test_fpb_step(con):
+    out = con.command("fpb_set_breakpoint 0 dummy_function_1")
+    if b"Succeeded" not in out:
+        raise TestFailure("fpb_set_breakpoint: %s" % out.decode(errors="replace"))
+    con.send("sim exec dummy_function_1 4\n")
+    monitor_answer(con, "s", r"bkpt=1, halt=0, dwt=0")
+    con.expect(r"Single-Stepping over FPB")
+    monitor_answer(con, "s", r"bkpt=0, halt=1, dwt=0")
+    monitor_answer(con, "c", r"bkpt=0, halt=1, dwt=0")
+    stop = con.expect(r"sim: stopped at (0x[0-9a-f]+)")
+    con.expect(re.escape(PROMPT))
+    # the breakpoint is armed again once the steps are done
+    if not re.search(rb"fpb: revision=\d+ enabled=1", con.command("fpb_dump")):
+        raise TestFailure("FPB not re-enabled after stepping")
+    return int(stop.group(1), 16)
+
+
+def measure(con, shift):
+    """Instruction counts of TIMED_COMMANDS, from the `time` records"""
+    con.command("format json")
+    counts = {}
+    for line in TIMED_COMMANDS:
+        con.send("time %s\n" % line)
+        # the record goes out on the log channel, possibly after the prompt
+        rec = con.expect(r'\{"t":"time","name":"%s",[^\r\n]*\}' % re.escape(line.split()[0]),
+                         timeout=30)
+        rec = json.loads(rec.group(0))
+        # cycles at hz are virtual ns, one instruction per 2^shift of them
+        ns = rec["cycles"] * 1e9 / rec["hz"]
+        counts[line] = int(round(ns / (1 << shift)))
+    con.command("format text")
+    return counts
+
+
+def compare(counts, baseline, tolerance):
+    worse = []
+    for line, count in counts.items():
+        base = baseline.get(line)
+        if not base:
+            print("  %-20s %10d  (new)" % (line, count))
+            continue
+        delta = 100.0 * (count - base) / base
+        flag = ""
+        if delta > tolerance:
+            flag = "  REGRESSION"
+            worse.append(line)
+        print("  %-20s %10d  %+6.1f%%%s" % (line, count, delta, flag))
+    return worse
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--elf", default="build/qemu/armdbg.elf")
+    parser.add_argument("--qemu", default="qemu-system-arm")
+    parser.add_argument("--icount-shift", type=int, default=0,
+                        help="QEMU -icount shift, 2^shift ns per instruction")
+    parser.add_argument("--host", nargs="?", const="build/host/armdbg",
+                        help="test the host build instead, its counts are wall clock ns")
+    parser.add_argument("--record", help="write the instruction counts to this file")
+    parser.add_argument("--baseline", help="compare the instruction counts against this file")
+    parser.add_argument("--tolerance", type=float, default=1.0,
+                        help="percent increase over the baseline that fails the run")
+    parser.add_argument("-v", "--verbose", action="store_true", help="echo the console")
+    args = parser.parse_args()
+
+    if args.host:
+        argv = [args.host, "-s"]
+        shift = 0
+    else:
+        # sleep=off: idle time in WFI doesn't count, so runs are repeatable
+        argv = [args.qemu, "-M", "mps2-an385", "-display", "none", "-monitor", "none",
+                "-serial", "stdio", "-icount", "shift=%d,sleep=off" % args.icount_shift,
+                "-kernel", args.elf]
+        shift = args.icount_shift
+
+    con = Console(argv, args.verbose)
+    try:
+        con.expect(re.escape(PROMPT), timeout=20)
+        counts = measure(con, shift)
+
+        out = con.command("debug_mon_en")
+        if b"Enabled" not in out:
+            raise TestFailure("debug_mon_en: %s" % out.decode(errors="replace"))
+        test_bkpt(con)
+        print("bkpt: ok")
+        test_regs(con)
+        print("registers: ok")
+        test_watch(con)
+        print("watchpoints: ok")
+        test_bkpt_manager(con)
+        print("breakpoint manager: ok")
+        test_soft_bkpt(con)
+        print("software breakpoints: ok")
+        test_tracepoint(con)
+        print("tracepoints: ok")
+        stop = test_fpb_step(con)
+        print("fpb breakpoint + steps: ok, stopped at 0x%x" % stop)
+    except TestFailure as e:
+        print("FAIL: %s" % e)
+        return 1
+    finally:
+        con.close()
+
+    print("instructions per command:")
+    worse = []
+    if args.baseline:
+        with open(args.baseline) as f:
+            worse = compare(counts, json.load(f), args.tolerance)
+    else:
+        for line, count in counts.items():
+            print("  %-20s %10d" % (line, count))
+    if args.record:
+        with open(args.record, "w") as f:
+            json.dump(counts, f, indent=2)
+            f.write("\n")
+    if worse:
+        print("FAIL: %s over the baseline by more than %g%%" % (", ".join(worse), args.tolerance))
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
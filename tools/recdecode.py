@@ -0,0 +1,120 @@
+#!/usr/bin/env python3
+"""Decoder for the shell's cbor output format (format cbor, see
+Core/Inc/record.h).
+
+Reads the target's output from a serial port (or a capture file with -f),
+passes text through and prints each kDbgProtoEvt_Record frame as one line
+of JSON, the same lines format json would have sent.
+
+    tools/recdecode.py /dev/ttyUSB0
+    tools/recdecode.py -f capture.bin
+"""
+import argparse
+import json
+import os
+import struct
+import sys
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from dbgproto import cobs_decode, crc16, RESPONSE_FLAG  # noqa: E402
+
+EVT_RECORD = 0x41
+CBOR_BREAK = 0xFF
+
+
+def cbor_decode(data, pos=0):
+    """Just the subset record.c writes: uints, byte and text strings,
+    booleans and indefinite length maps. Returns (value, next position)."""
+    head = data[pos]
+    pos += 1
+    major, info = head >> 5, head & 0x1F
+    if head == 0xBF:
+        out = {}
+        while data[pos] != CBOR_BREAK:
+            key, pos = cbor_decode(data, pos)
+            out[key], pos = cbor_decode(data, pos)
+        return out, pos + 1
+    if major == 7:
+        if info in (20, 21):
+            return info == 21, pos
+        raise ValueError("unsupported simple value %d" % info)
+    if info < 24:
+        value = info
+    elif info <= 26:
+        size = 1 << (info - 24)
+        value = int.from_bytes(data[pos:pos + size], "big")
+        pos += size
+    else:
+        raise ValueError("unsupported length %d" % info)
+    if major == 0:
+        return value, pos
+    if major == 2:
+        return data[pos:pos + value].hex(), pos + value
+    if major == 3:
+        return data[pos:pos + value].decode(errors="replace"), pos + value
+    raise ValueError("unsupported major type %d" % major)
+
+
+class Decoder:
+    def __init__(self):
+        self.in_frame = False
+        self.frame = bytearray()
+
+    def _frame(self, frame):
+        try:
+            pkt = cobs_decode(bytes(frame))
+        except ValueError:
+            return ""
+        if len(pkt) < 5 or crc16(pkt[:-2]) != struct.unpack("<H", pkt[-2:])[0]:
+            return "<corrupt frame>\n"
+        if pkt[1] != EVT_RECORD | RESPONSE_FLAG:
+            return ""
+        try:
+            record, _ = cbor_decode(pkt[3:-2])
+        except (ValueError, IndexError):
+            return "<bad record %s>\n" % pkt[3:-2].hex()
+        return json.dumps(record, separators=(",", ":")) + "\n"
+
+    def feed(self, data):
+        out = []
+        for b in data:
+            if b == 0:
+                if self.in_frame and self.frame:
+                    out.append(self._frame(self.frame))
+                    self.in_frame = False
+                else:
+                    self.in_frame = True
+                self.frame = bytearray()
+            elif self.in_frame:
+                self.frame.append(b)
+            else:
+                out.append(chr(b))
+        return "".join(out)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("port", nargs="?")
+    parser.add_argument("-b", "--baud", type=int, default=115200)
+    parser.add_argument("-f", "--file", help="decode a capture instead of a port")
+    args = parser.parse_args()
+
+    decoder = Decoder()
+    if args.file:
+        with open(args.file, "rb") as f:
+            sys.stdout.write(decoder.feed(f.read()))
+        return
+
+    import serial
+    with serial.Serial(args.port, args.baud, timeout=0.1) as ser:
+        try:
+            while True:
+                sys.stdout.write(decoder.feed(ser.read(max(1, ser.in_waiting))))
+                sys.stdout.flush()
+        except KeyboardInterrupt:
+            pass
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,64 @@
+#!/usr/bin/env python3
+"""Loopback RX benchmark for the shell UART.
+
+Starts `rx_bench` on the target, streams a burst of bytes at it and prints
+the target's report (sustained bytes/s and drop count).
+
+    tools/rx_bench.py /dev/ttyUSB0 -b 115200 -n 65536
+    tools/rx_bench.py /dev/ttyUSB0 -b 921600 --flow rtscts --stall 5
+"""
+import argparse
+import os
+import time
+
+import serial
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("port")
+    parser.add_argument("-b", "--baud", type=int, default=115200)
+    parser.add_argument("-n", "--bytes", type=int, default=32 * 1024,
+                        help="number of bytes to send")
+    parser.add_argument("--flow", choices=["none", "rtscts", "xonxoff"],
+                        help="switch the target to this flow control first")
+    parser.add_argument("--stall", type=int, default=0,
+                        help="ms the target stalls after every 64 bytes")
+    args = parser.parse_args()
+
+    with serial.Serial(args.port, args.baud, timeout=0.5,
+                       rtscts=args.flow == "rtscts",
+                       xonxoff=args.flow == "xonxoff") as ser:
+        ser.reset_input_buffer()
+        if args.flow:
+            ser.write(b"flow %s\n" % args.flow.encode())
+            time.sleep(0.1)
+        ser.write(b"rx_bench 10 %d\n" % args.stall)
+        # wait for the target to enter the benchmark
+        deadline = time.time() + 2
+        banner = b""
+        while b"send data now" not in banner and time.time() < deadline:
+            banner += ser.read(64)
+
+        # printable payload so the shell can't misinterpret leftovers
+        payload = bytes(0x21 + (b % 94) for b in os.urandom(args.bytes))
+        start = time.time()
+        ser.write(payload)
+        ser.flush()
+        host_elapsed = time.time() - start
+
+        report = b""
+        deadline = time.time() + 3
+        while b"bytes/s" not in report and time.time() < deadline:
+            report += ser.read(128)
+
+    print("host: sent %d bytes in %.3f s (%.0f bytes/s)" %
+          (args.bytes, host_elapsed, args.bytes / host_elapsed))
+    for line in report.decode(errors="replace").splitlines():
+        if line.startswith("rx_bench:"):
+            print("target: " + line[len("rx_bench: "):])
+
+
+if __name__ == "__main__":
+    main()